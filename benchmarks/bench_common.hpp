@@ -5,16 +5,24 @@
 #ifndef FABRICBENCH_COMM_EXP_HPP
 #define FABRICBENCH_COMM_EXP_HPP
 #include <iostream>
-#include <sys/time.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <getopt.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define BENCH_HAVE_TSC
+#endif
 #include "bench_config.h"
 
-#define LARGE 8192
-#define TOTAL 4000
-#define SKIP 1000
-#define TOTAL_LARGE 1000
-#define SKIP_LARGE 100
-
 namespace bench {
 #ifdef USE_PAPI
 #include <papi.h>
@@ -39,7 +47,221 @@ char papi_event_names[PAPI_NUM][10] = { };
 #define PAPI_SAFECALL(x)
 #endif
 
+// Time source of wtime()/ticks(): the TSC read with rdtscp when it is
+// invariant, calibrated against CLOCK_MONOTONIC_RAW in init(), and
+// CLOCK_MONOTONIC_RAW itself otherwise (ticks are then nanoseconds).
+// Set IBVB_TIMER=clock to force the fallback.
+struct Timer {
+    bool use_tsc = false;
+    double sec_per_tick = 1e-9;
+};
+Timer timer;
+
+static inline uint64_t clock_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t ticks() {
+#ifdef BENCH_HAVE_TSC
+    if (timer.use_tsc) {
+        unsigned int aux;
+        return __rdtscp(&aux);
+    }
+#endif
+    return clock_ns();
+}
+
+static inline double ticks_to_sec(uint64_t n) {
+    return n * timer.sec_per_tick;
+}
+
+static inline double wtime() {
+    return ticks_to_sec(ticks());
+}
+
+inline const char *timer_name() {
+    return timer.use_tsc ? "tsc" : "clock_monotonic_raw";
+}
+
+inline bool tsc_is_invariant() {
+#ifdef BENCH_HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 27)))
+        return false; // no rdtscp
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return edx & (1u << 8);
+#else
+    return false;
+#endif
+}
+
+inline void timer_init() {
+    const char *env = getenv("IBVB_TIMER");
+    timer.use_tsc = false;
+    timer.sec_per_tick = 1e-9;
+    if ((env && strcmp(env, "clock") == 0) || !tsc_is_invariant())
+        return;
+    timer.use_tsc = true;
+    // median of three 10ms samples
+    double samples[3];
+    for (double &sample : samples) {
+        uint64_t ns0 = clock_ns(), tsc0 = ticks();
+        while (clock_ns() - ns0 < 10000000) continue;
+        uint64_t ns1 = clock_ns(), tsc1 = ticks();
+        sample = (ns1 - ns0) * 1e-9 / (tsc1 - tsc0);
+    }
+    std::sort(samples, samples + 3);
+    timer.sec_per_tick = samples[1];
+}
+
+// Result sink. In table mode RUN_VARY_MSG prints the classic columns; in
+// json (one object per line) and csv mode it writes one record per message
+// size: the fields of result_context (benchmark, config, device) followed by
+// the timing statistics of that size. Select it with --output=json|csv|table.
+enum class OutputFormat { TABLE, JSON, CSV };
+OutputFormat output_format = OutputFormat::TABLE;
+
+inline void setOutputFormat(const char *name) {
+    if (strcmp(name, "table") == 0) {
+        output_format = OutputFormat::TABLE;
+    } else if (strcmp(name, "json") == 0) {
+        output_format = OutputFormat::JSON;
+    } else if (strcmp(name, "csv") == 0) {
+        output_format = OutputFormat::CSV;
+    } else {
+        fprintf(stderr, "Unknown output format %s (expect json, csv or table)\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Ordered list of key/value fields. Setting an existing key overwrites it.
+class Record {
+public:
+    struct Field {
+        std::string key;
+        std::string value;
+        bool quoted; // a string (as opposed to a number or a boolean)
+    };
+
+    void set(const std::string &key, const std::string &value) { put(key, value, true); }
+    void set(const std::string &key, const char *value) { put(key, value ? value : "", true); }
+    void set(const std::string &key, bool value) { put(key, value ? "true" : "false", false); }
+    void set(const std::string &key, double value) {
+        char buf[32];
+        if (std::isfinite(value))
+            snprintf(buf, sizeof(buf), "%.6g", value);
+        else
+            snprintf(buf, sizeof(buf), "null");
+        put(key, buf, false);
+    }
+    template<typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    void set(const std::string &key, T value) { put(key, std::to_string(value), false); }
+
+    void append(const Record &other) {
+        for (const Field &field : other.fields) put(field.key, field.value, field.quoted);
+    }
+
+    void erase(const std::string &key) {
+        for (auto it = fields.begin(); it != fields.end(); ++it) {
+            if (it->key == key) {
+                fields.erase(it);
+                return;
+            }
+        }
+    }
+
+    const std::vector<Field> &getFields() const { return fields; }
+
+private:
+    void put(const std::string &key, const std::string &value, bool quoted) {
+        for (Field &field : fields) {
+            if (field.key == key) {
+                field.value = value;
+                field.quoted = quoted;
+                return;
+            }
+        }
+        fields.push_back({key, value, quoted});
+    }
+
+    std::vector<Field> fields;
+};
+
+// Fields shared by every record of this process.
+Record result_context;
+
+inline std::string json_escape(const std::string &str) {
+    std::string out;
+    for (char c : str) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+inline std::string csv_escape(const std::string &str) {
+    if (str.find_first_of(",\"\n") == std::string::npos) return str;
+    std::string out = "\"";
+    for (char c : str) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Write result_context plus stats as one record in the selected format.
+// CSV repeats the header whenever the fields differ from the last record's.
+inline void emit_record(const Record &stats) {
+    static std::string csv_header;
+    Record record = result_context;
+    record.append(stats);
+    std::string line;
+    if (output_format == OutputFormat::JSON) {
+        line = "{";
+        for (const Record::Field &field : record.getFields()) {
+            if (line.size() > 1) line += ",";
+            line += "\"" + json_escape(field.key) + "\":";
+            line += field.quoted ? "\"" + json_escape(field.value) + "\"" : field.value;
+        }
+        line += "}";
+    } else if (output_format == OutputFormat::CSV) {
+        std::string header;
+        for (const Record::Field &field : record.getFields()) {
+            if (!header.empty()) header += ",";
+            header += csv_escape(field.key);
+        }
+        if (header != csv_header) {
+            printf("%s\n", header.c_str());
+            csv_header = header;
+        }
+        for (const Record::Field &field : record.getFields()) {
+            if (!line.empty()) line += ",";
+            line += csv_escape(field.value);
+        }
+    }
+    printf("%s\n", line.c_str());
+    fflush(stdout);
+}
+
 void init(bool isMultithreaded = false) {
+    timer_init();
+    result_context.set("benchmark", program_invocation_short_name);
+    result_context.set("timer", timer_name());
 #ifdef USE_PAPI
     int retval = PAPI_library_init(PAPI_VER_CURRENT);
     if (retval != PAPI_VER_CURRENT) {
@@ -54,12 +276,6 @@ void init(bool isMultithreaded = false) {
 
 void finalize() {}
 
-static inline double wtime() {
-    timeval t1;
-    gettimeofday(&t1, nullptr);
-    return t1.tv_sec + t1.tv_usec / 1e6;
-}
-
 void write_buffer(char *buffer, int len, char input) {
     for (int i = 0; i < len; ++i) {
         buffer[i] = input;
@@ -87,11 +303,88 @@ static inline double get_bw(double time, size_t size, double n_msg) {
     return n_msg * size / time;
 }
 
+// Log-linear histogram of tick counts (HdrHistogram-like). Values below
+// 2^SUB_BITS are recorded exactly; above that, every power of two is split
+// into 2^(SUB_BITS-1) linear buckets, so the relative error stays below
+// 2^-(SUB_BITS-1). All buckets are preallocated: record() never allocates.
+class Histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << (SUB_BITS - 1);
+    static const int NUM_BUCKETS = (64 - SUB_BITS + 2) * SUB_COUNT;
+
+    Histogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        min_value = UINT64_MAX;
+        max_value = 0;
+    }
+
+    void record(uint64_t value) {
+        ++counts[index(value)];
+        ++total;
+        if (value < min_value) min_value = value;
+        if (value > max_value) max_value = value;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? min_value : 0; }
+    uint64_t max() const { return max_value; }
+
+    // Smallest recorded value (bucket midpoint) such that p percent of
+    // the values are less or equal.
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        if (p <= 0) return min_value;
+        if (p >= 100) return max_value;
+        uint64_t rank = (uint64_t) (p / 100.0 * total + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total) rank = total;
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t value = midpoint(i);
+                return value < min_value ? min_value : value > max_value ? max_value : value;
+            }
+        }
+        return max_value;
+    }
+
+private:
+    static int index(uint64_t value) {
+        if (value < (1ull << SUB_BITS)) return (int) value;
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        return (shift << (SUB_BITS - 1)) + (int) (value >> shift);
+    }
+
+    static uint64_t midpoint(int i) {
+        if (i < (1 << SUB_BITS)) return i;
+        int shift = i / SUB_COUNT - 1;
+        uint64_t sub = i - shift * SUB_COUNT;
+        return (sub << shift) + ((1ull << shift) >> 1);
+    }
+
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    uint64_t min_value;
+    uint64_t max_value;
+};
+
+// percentiles reported next to the mean latency (0 and 100 are min and max)
+const double report_percentiles[] = {0, 50, 90, 99, 99.9, 100};
+const char *report_percentile_names[] = {"min", "p50", "p90", "p99", "p99.9", "max"};
+
 inline void print_banner()
 {
     char str[256];
     int used = 0;
     used += snprintf(str+used, 256-used, "%-10s %-10s %-10s %-10s", "Size", "us", "Mmsg/s", "MB/s");
+    for (const char *name : report_percentile_names) {
+        used += snprintf(str+used, 256-used, " %-10s", name);
+    }
     for (auto & papi_event_name : papi_event_names) {
         used += snprintf(str+used, 256-used, " %-10s", papi_event_name);
     }
@@ -99,13 +392,84 @@ inline void print_banner()
     fflush(stdout);
 }
 
+// What one call of the benchmark function moves.
+struct Traffic {
+    int msgs = 1;         // messages per direction
+    bool pingpong = true; // a round trip of msgs each way, otherwise a one-way stream
+    // Bidirectional streams: time (in seconds) the benchmark spent on the
+    // stream issued by rank 0 and rank 1 during the timed iterations.
+    // Reset before the timed loop; reported as per-direction bandwidth,
+    // while the standard columns report the aggregate.
+    double *dir_time = nullptr;
+    // If set, the reporting process appends the mean latency (us) of every
+    // size, as reported, e.g. to compare sweeps of a benchmark parameter.
+    std::vector<double> *latencies = nullptr;
+};
+
+// Message sizes and iteration counts of RUN_VARY_MSG, set from the command
+// line (--sizes, --iterations, --warmup, --time-budget).
+struct Schedule {
+    // Explicit message sizes (sorted). Empty: powers of two from the
+    // minimum to the maximum message size of the benchmark.
+    std::vector<size_t> sizes;
+    int iterations = 4000;       // timed iterations per size
+    int warmup = 1000;           // untimed iterations per size
+    int iterations_large = 1000; // the same for sizes >= large_size
+    int warmup_large = 100;
+    size_t large_size = 8192;
+    // If > 0, run each size for at least this many seconds; iterations
+    // is then only the first estimate.
+    double time_budget = 0;
+    // Maximum of a value over all processes that run RUN_VARY_MSG. They
+    // must run the same number of iterations, so the time budget mode uses
+    // it to agree on them; without it every process decides alone (fine if
+    // only one of them runs the loop, e.g. with a passive RDMA target).
+    int (*agree_max)(int value) = nullptr;
+};
+Schedule schedule;
+
+// Parse a comma separated list of sizes with optional k/m/g (binary) suffix,
+// e.g. "4095,4096,4097,1m".
+inline std::vector<size_t> parse_sizes(const char *str) {
+    std::vector<size_t> sizes;
+    while (*str) {
+        char *end;
+        unsigned long long size = strtoull(str, &end, 0);
+        switch (*end) {
+            case 'k': case 'K': size <<= 10; ++end; break;
+            case 'm': case 'M': size <<= 20; ++end; break;
+            case 'g': case 'G': size <<= 30; ++end; break;
+            default: break;
+        }
+        if (end == str || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid size list %s\n", str);
+            exit(EXIT_FAILURE);
+        }
+        sizes.push_back(size);
+        str = *end ? end + 1 : end;
+    }
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    return sizes;
+}
+
+// The message sizes RUN_VARY_MSG sweeps for the range [min_size, max_size].
+inline std::vector<size_t> sweep_sizes(size_t min_size, size_t max_size) {
+    if (!schedule.sizes.empty()) return schedule.sizes;
+    std::vector<size_t> sizes;
+    for (size_t msg_size = min_size; msg_size <= max_size; msg_size <<= 1)
+        sizes.push_back(msg_size);
+    return sizes;
+}
+
 template<typename FUNC>
 static inline void RUN_VARY_MSG(std::pair<size_t, size_t> &&range,
                                 const int report,
-                                FUNC &&f, std::pair<int, int> &&iter = {0, 1}) {
+                                FUNC &&f, std::pair<int, int> &&iter = {0, 1},
+                                Traffic traffic = Traffic()) {
     double t;
-    int loop = TOTAL;
-    int skip = SKIP;
+    // per-iteration latencies, kept off the stack as it is ~30KB
+    static Histogram hist;
 
 #ifdef USE_PAPI
     int papi_eventSet = PAPI_NULL;
@@ -114,41 +478,121 @@ static inline void RUN_VARY_MSG(std::pair<size_t, size_t> &&range,
     PAPI_SAFECALL(PAPI_add_events(papi_eventSet, papi_events, PAPI_NUM));
 #endif
 
-    for (size_t msg_size = range.first; msg_size <= range.second; msg_size <<= 1) {
-        if (msg_size >= LARGE) {
-            loop = TOTAL_LARGE;
-            skip = SKIP_LARGE;
-        }
+    for (size_t msg_size : sweep_sizes(range.first, range.second)) {
+        bool large = msg_size >= schedule.large_size;
+        int loop = large ? schedule.iterations_large : schedule.iterations;
+        int skip = large ? schedule.warmup_large : schedule.warmup;
 
+        uint64_t t_warmup = ticks();
         for (int i = iter.first; i < skip; i += iter.second) {
             f(msg_size, i);
         }
+        t_warmup = ticks() - t_warmup;
+        if (schedule.time_budget > 0) {
+            if (skip > iter.first) {
+                // first estimate from the warmup
+                double per_iter = ticks_to_sec(t_warmup) * iter.second / (skip - iter.first);
+                loop = (int) std::min(schedule.time_budget / per_iter + 1, 1e9);
+            }
+            if (schedule.agree_max) loop = schedule.agree_max(loop);
+        }
 
+        if (traffic.dir_time) traffic.dir_time[0] = traffic.dir_time[1] = 0;
+        hist.reset();
         PAPI_SAFECALL(PAPI_start(papi_eventSet));
-        t = wtime();
+        uint64_t t_total = 0;
+        int i = iter.first;
+        while (true) {
+            uint64_t t_start = ticks();
+            uint64_t t_prev = t_start;
 
-        for (int i = iter.first; i < loop; i += iter.second) {
-            f(msg_size, i);
+            for (; i < loop; i += iter.second) {
+                f(msg_size, i);
+                uint64_t t_now = ticks();
+                hist.record(t_now - t_prev);
+                t_prev = t_now;
+            }
+            t_total += t_prev - t_start;
+
+            if (schedule.time_budget <= 0) break;
+            // extend the run until every process spent the time budget
+            double elapsed = ticks_to_sec(t_total);
+            int more = 0;
+            if (elapsed < schedule.time_budget) {
+                if (loop > iter.first && elapsed > 0)
+                    more = (int) std::min((schedule.time_budget - elapsed) / elapsed * (loop - iter.first) + 1, 1e9);
+                else
+                    more = std::max(loop, 1);
+            }
+            if (schedule.agree_max) more = schedule.agree_max(more);
+            if (more == 0) break;
+            loop += more;
         }
 
         PAPI_SAFECALL(PAPI_stop(papi_eventSet, papi_values));
-        t = wtime() - t;
+        t = ticks_to_sec(t_total);
 
         if (report) {
-            double latency = 1e6 * get_latency(t, 2.0 * loop); // one-way latency
-            double msgrate = get_msgrate(t, loop) / 1e6;           // single-direction message rate
-            double bw = get_bw(t, msg_size, loop) / 1024 / 1024;   // single-direction bandwidth
+            double n_msg = (double) traffic.msgs * loop * (traffic.dir_time ? 2 : 1);
+            // one-way latency (of a burst of msgs for pingpong, of one message
+            // for streams); an iteration covers n_lat of them
+            double n_lat = traffic.pingpong ? 2.0 : n_msg / loop;
+            double latency = 1e6 * get_latency(t, n_lat * loop);
+            double msgrate = get_msgrate(t, n_msg) / 1e6;           // single-direction message rate
+            double bw = get_bw(t, msg_size, n_msg) / 1024 / 1024;   // single-direction bandwidth
+            if (traffic.latencies) traffic.latencies->push_back(latency);
+
+            if (output_format != OutputFormat::TABLE) {
+                Record stats;
+                stats.set("msg_size", msg_size);
+                stats.set("iterations", loop / iter.second);
+                stats.set("warmup", skip / iter.second);
+                stats.set("msgs_per_iteration", traffic.msgs);
+                stats.set("pingpong", traffic.pingpong);
+                stats.set("bidirectional", traffic.dir_time != nullptr);
+                stats.set("latency_us", latency);
+                stats.set("msgrate_mmsgs", msgrate);
+                stats.set("bandwidth_mbs", bw);
+                for (int j = 0; j < (int) (sizeof(report_percentiles) / sizeof(report_percentiles[0])); ++j) {
+                    double value = 1e6 * get_latency(ticks_to_sec(hist.percentile(report_percentiles[j])), n_lat);
+                    stats.set(std::string("latency_") + report_percentile_names[j] + "_us", value);
+                }
+#ifdef USE_PAPI
+                for (int j = 0; j < PAPI_NUM; ++j) {
+                    double event = (double)papi_values[j] / ((traffic.pingpong || traffic.dir_time ? 2.0 : 1.0) * traffic.msgs * (loop / iter.second));
+                    stats.set(std::string("papi.") + papi_event_names[j], event);
+                }
+#endif
+                if (traffic.dir_time) {
+                    for (int d = 0; d < 2; ++d) {
+                        double dir_bw = get_bw(traffic.dir_time[d], msg_size, (double) traffic.msgs * loop) / 1024 / 1024;
+                        stats.set("bandwidth_rank" + std::to_string(d) + "_mbs", dir_bw);
+                    }
+                }
+                emit_record(stats);
+                continue;
+            }
 
             char output_str[256];
             int used = 0;
             used += snprintf(output_str + used, 256, "%-10lu %-10.2f %-10.3f %-10.2f",
                              msg_size, latency, msgrate, bw);
+            for (double p : report_percentiles) {
+                double value = 1e6 * get_latency(ticks_to_sec(hist.percentile(p)), n_lat);
+                used += snprintf(output_str + used, 256 - used, " %-10.2f", value);
+            }
 #ifdef USE_PAPI
             for (long_long papi_value : papi_values) {
-                double event = (double)papi_value / (2.0 * (loop / iter.second));
+                double event = (double)papi_value / ((traffic.pingpong || traffic.dir_time ? 2.0 : 1.0) * traffic.msgs * (loop / iter.second));
                 used += snprintf(output_str + used, 256 - used, " %-10.2f", event);
             }
 #endif
+            if (traffic.dir_time) {
+                for (int d = 0; d < 2; ++d) {
+                    double dir_bw = get_bw(traffic.dir_time[d], msg_size, (double) traffic.msgs * loop) / 1024 / 1024;
+                    used += snprintf(output_str + used, 256 - used, " %-10.2f", dir_bw);
+                }
+            }
             printf("%s\n", output_str);
             fflush(stdout);
         }
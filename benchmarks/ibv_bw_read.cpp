@@ -0,0 +1,245 @@
+#include <vector>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    bool touch_data = true;
+    int min_msg_size = 8;
+    int max_msg_size = 64 * 1024;
+    int window = 64;
+    int poll_batch = 16;
+    int max_spin = 0;
+    int batch = 1;
+    int signal_interval = 1;
+    bool bidirectional = false;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"min-msg-size", required_argument, 0, 'a'},
+            {"max-msg-size", required_argument, 0, 'b'},
+            {"touch-data",   required_argument, 0, 't'},
+            {"window",       required_argument, 0, 'w'},
+            {"poll-batch",   required_argument, 0, 'p'},
+            {"max-spin",     required_argument, 0, 's'},
+            {"batch",        required_argument, 0, 'B'},
+            {"signal-interval", required_argument, 0, 'k'},
+            {"bidirectional", no_argument,     0, 'd'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "t:w:p:B:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                config.min_msg_size = atoi(optarg);
+                break;
+            case 'b':
+                config.max_msg_size = atoi(optarg);
+                break;
+            case 't':
+                config.touch_data = atoi(optarg);
+                break;
+            case 'w':
+                config.window = atoi(optarg);
+                break;
+            case 'p':
+                config.poll_batch = atoi(optarg);
+                break;
+            case 's':
+                config.max_spin = atoi(optarg);
+                break;
+            case 'B':
+                config.batch = atoi(optarg);
+                break;
+            case 'k':
+                config.signal_interval = atoi(optarg);
+                break;
+            case 'd':
+                config.bidirectional = true;
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.window", config.window);
+    result_context.set("config.poll_batch", config.poll_batch);
+    result_context.set("config.max_spin", config.max_spin);
+    result_context.set("config.batch", config.batch);
+    result_context.set("config.signal_interval", config.signal_interval);
+    result_context.set("config.bidirectional", config.bidirectional);
+}
+
+// Rank 0 keeps a window of RDMA reads from rank 1 in flight and waits for
+// their completions (osu_get_bw style). Rank 1 stays passive.
+// With --batch=B the reads are posted as linked chains of B WRs, with
+// --signal-interval=k only every k-th read (and the last one) is signaled.
+// With --bidirectional both ranks keep a window of reads in flight at the
+// same time. A rank acks once its own reads completed, so the stream of the
+// peer is done when the ack of the peer arrives. The aggregate and the
+// bandwidth of the streams issued by rank 0 and rank 1 are reported.
+int run(Config config) {
+    MLOG_Assert(config.window > 0 && config.poll_batch > 0 && config.batch > 0,
+                "window, poll-batch and batch must be positive\n");
+    ibv::Device device;
+    ibv::DeviceConfig deviceConfig;
+    // two data buffers, then a pool of receive buffers for the acks
+    deviceConfig.mr_size = config.max_msg_size * 2 + ibv::CACHE_LINE_SIZE * deviceConfig.max_recv_num;
+    deviceConfig.max_send_num = config.window;
+    deviceConfig.post_batch = min(config.batch, config.window);
+    deviceConfig.signal_interval = config.signal_interval;
+    deviceConfig.max_cqe_num = config.window + 1;
+    ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
+    char value = 'a' + rank;
+    char peer_value = 'a' + 1 - rank;
+    void *src_buf = (char*) device.mr_addr;
+    void *dst_buf = (char*) device.mr_addr + config.max_msg_size;
+    const ibv::RemoteMemRegion &remote_mr = ibv::remoteMR(&device, 1-rank);
+    vector<struct ibv_wc> wcs(config.poll_batch);
+    write_buffer((char*) src_buf, config.max_msg_size, value);
+    ibv::barrier(&device);
+
+    auto check_ack = [](const struct ibv_wc &wc) {
+        MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!");
+    };
+
+    if (config.bidirectional) {
+        schedule.agree_max = ibv::pmAllreduceMax;
+        double dir_time[2];
+        ibv::initRecvPool(&device, (char*) device.mr_addr + 2 * config.max_msg_size,
+                          ibv::CACHE_LINE_SIZE, device.dev_mr->lkey);
+        ibv::barrier(&device);
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, rank == 0, [&](int msg_size, int iter) {
+            double t0 = wtime(), t_out = t0, t_in = t0;
+            // post a window of reads
+            if (config.touch_data) write_buffer((char*) dst_buf, msg_size, value);
+            for (int i = 0; i < config.window; ++i) {
+                if (i == config.window - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postRead(&device, 1-rank, dst_buf, msg_size, device.dev_mr->lkey,
+                                        remote_mr.addr, remote_mr.rkey, NULL);
+                MLOG_Assert(ret == 0, "Post Read failed!");
+            }
+            int ret = ibv::flushSends(&device, 1-rank);
+            MLOG_Assert(ret == 0, "Post Read failed!");
+
+            // progress both directions until our reads and our ack
+            // completed and the ack of the peer arrived
+            int completed = 0, nspin = 0;
+            bool ack_posted = false, acked = false;
+            while (completed < config.window + 1 || !acked) {
+                int ne = 0;
+                if (completed < config.window + 1) {
+                    ne += ibv::tryPollCQBatch(&device, device.send_cq, wcs.data(), config.poll_batch,
+                                              [&](const struct ibv_wc &wc) {
+                                                  MLOG_Assert(wc.status == IBV_WC_SUCCESS &&
+                                                              (wc.opcode == IBV_WC_RDMA_READ || wc.opcode == IBV_WC_SEND),
+                                                              "Read completion failed!");
+                                                  completed += ibv::retireSends(&device, wc);
+                                              });
+                    if (completed == config.window && !ack_posted) {
+                        t_out = wtime();
+                        ibv::signalNext(&device, 1-rank);
+                        ret = ibv::postSend(&device, 1-rank, src_buf, 4, device.dev_mr->lkey, NULL);
+                        MLOG_Assert(ret == 0, "Post Send failed!");
+                        ret = ibv::flushSends(&device, 1-rank);
+                        MLOG_Assert(ret == 0, "Post Send failed!");
+                        ack_posted = true;
+                    }
+                }
+                if (!acked) {
+                    int nr = ibv::tryPollCQBatch(&device, device.recv_cq, wcs.data(), 1, check_ack);
+                    if (nr > 0) {
+                        acked = true;
+                        t_in = wtime();
+                        ibv::releaseRecv(&device, wcs[0]);
+                        ibv::refillRecvs(&device);
+                    }
+                    ne += nr;
+                }
+                if (ne == 0) ibv::spinOrYield(&device, config.max_spin, &nspin);
+            }
+            if (config.touch_data) check_buffer((char*) dst_buf, msg_size, peer_value);
+            dir_time[rank] += t_out - t0;
+            dir_time[1-rank] += t_in - t0;
+        }, {0, 1}, {config.window, false, dir_time});
+    } else if (rank == 0) {
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
+            // post a window of reads
+            if (config.touch_data) write_buffer((char*) dst_buf, msg_size, value);
+            for (int i = 0; i < config.window; ++i) {
+                if (i == config.window - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postRead(&device, 1-rank, dst_buf, msg_size, device.dev_mr->lkey,
+                                        remote_mr.addr, remote_mr.rkey, NULL);
+                MLOG_Assert(ret == 0, "Post Read failed!");
+            }
+            int ret = ibv::flushSends(&device, 1-rank);
+            MLOG_Assert(ret == 0, "Post Read failed!");
+
+            // wait for all reads to complete
+            int completed = 0;
+            while (completed < config.window) {
+                ibv::pollCQBatch(&device, device.send_cq, wcs.data(), config.poll_batch,
+                                 [&](const struct ibv_wc &wc) {
+                                     MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_READ,
+                                                 "Read completion failed! %d %d\n", wc.status, wc.opcode);
+                                     completed += ibv::retireSends(&device, wc);
+                                 }, config.max_spin);
+            }
+            if (config.touch_data) check_buffer((char*) dst_buf, msg_size, peer_value);
+        }, {0, 1}, {config.window, false});
+    }
+
+    ibv::barrier(&device);
+    ibv::finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
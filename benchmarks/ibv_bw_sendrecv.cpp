@@ -0,0 +1,277 @@
+#include <vector>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    bool touch_data = true;
+    int min_msg_size = 8;
+    int max_msg_size = 64 * 1024;
+    int inline_size = 236;
+    int window = 64;
+    int poll_batch = 16;
+    int max_spin = 0;
+    int batch = 1;
+    int signal_interval = 1;
+    int recv_batch = 0;
+    bool bidirectional = false;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"min-msg-size", required_argument, 0, 'a'},
+            {"max-msg-size", required_argument, 0, 'b'},
+            {"touch-data",   required_argument, 0, 't'},
+            {"inline-size",  required_argument, 0, 'i'},
+            {"window",       required_argument, 0, 'w'},
+            {"poll-batch",   required_argument, 0, 'p'},
+            {"max-spin",     required_argument, 0, 's'},
+            {"batch",        required_argument, 0, 'B'},
+            {"signal-interval", required_argument, 0, 'k'},
+            {"recv-batch",   required_argument, 0, 'r'},
+            {"bidirectional", no_argument,     0, 'd'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "t:i:w:p:B:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                config.min_msg_size = atoi(optarg);
+                break;
+            case 'b':
+                config.max_msg_size = atoi(optarg);
+                break;
+            case 't':
+                config.touch_data = atoi(optarg);
+                break;
+            case 'i':
+                config.inline_size = atoi(optarg);
+                break;
+            case 'w':
+                config.window = atoi(optarg);
+                break;
+            case 'p':
+                config.poll_batch = atoi(optarg);
+                break;
+            case 's':
+                config.max_spin = atoi(optarg);
+                break;
+            case 'B':
+                config.batch = atoi(optarg);
+                break;
+            case 'k':
+                config.signal_interval = atoi(optarg);
+                break;
+            case 'r':
+                config.recv_batch = atoi(optarg);
+                break;
+            case 'd':
+                config.bidirectional = true;
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.inline_size", config.inline_size);
+    result_context.set("config.window", config.window);
+    result_context.set("config.poll_batch", config.poll_batch);
+    result_context.set("config.max_spin", config.max_spin);
+    result_context.set("config.batch", config.batch);
+    result_context.set("config.signal_interval", config.signal_interval);
+    result_context.set("config.recv_batch", config.recv_batch);
+    result_context.set("config.bidirectional", config.bidirectional);
+}
+
+// Rank 0 streams a window of sends to rank 1, which drains them with
+// batched polling and answers with a single ack (osu_bw style).
+// Run with --poll-batch=1 to get the one-completion-per-poll baseline.
+// With --batch=B the sends are posted as linked chains of B WRs, with
+// --signal-interval=k only every k-th send (and the last one) is signaled.
+// With --bidirectional both ranks stream a window to each other at the same
+// time (osu_bibw style); the aggregate and the bandwidth of the streams
+// issued by rank 0 and rank 1 are reported.
+int run(Config config) {
+    MLOG_Assert(config.window > 0 && config.poll_batch > 0 && config.batch > 0,
+                "window, poll-batch and batch must be positive\n");
+    ibv::Device device;
+    ibv::DeviceConfig deviceConfig;
+    deviceConfig.inline_size = config.inline_size;
+    deviceConfig.max_send_num = config.window;
+    deviceConfig.post_batch = min(config.batch, config.window);
+    deviceConfig.signal_interval = config.signal_interval;
+    deviceConfig.min_recv_num = config.window;
+    deviceConfig.max_recv_num = 2 * config.window;
+    deviceConfig.max_cqe_num = deviceConfig.max_recv_num + 1;
+    deviceConfig.recv_post_batch = config.recv_batch;
+    // one send buffer and a pool of receive buffers
+    deviceConfig.mr_size = config.max_msg_size * (1 + deviceConfig.max_recv_num);
+    ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    schedule.agree_max = ibv::pmAllreduceMax;
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
+    char value = 'a' + rank;
+    char peer_value = 'a' + 1 - rank;
+    void *send_buf = (char*) device.mr_addr;
+    void *recv_buf = (char*) device.mr_addr + config.max_msg_size;
+    vector<struct ibv_wc> wcs(config.poll_batch);
+    ibv::initRecvPool(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey);
+
+    auto check_send = [](const struct ibv_wc &wc) {
+        MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!");
+    };
+    auto check_recv = [](const struct ibv_wc &wc) {
+        MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!");
+    };
+    // check a message of the peer and hand its receive back to the pool
+    auto recv_msg = [&](const struct ibv_wc &wc) {
+        check_recv(wc);
+        if (config.touch_data) check_buffer((char*) ibv::recvBuf(&device, wc), wc.byte_len, peer_value);
+        ibv::releaseRecv(&device, wc);
+    };
+
+    if (config.bidirectional) {
+        double dir_time[2];
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, rank == 0, [&](int msg_size, int iter) {
+            double t0 = wtime(), t_out = t0, t_in = t0;
+            // post a window of sends
+            if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
+            for (int i = 0; i < config.window; ++i) {
+                if (i == config.window - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postSend(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey, NULL);
+                MLOG_Assert(ret == 0, "Post Send failed!");
+            }
+            int ret = ibv::flushSends(&device, 1-rank);
+            MLOG_Assert(ret == 0, "Post Send failed!");
+
+            // progress both directions until our sends completed and
+            // the window of the peer arrived
+            int sent = 0, received = 0, nspin = 0;
+            while (sent < config.window || received < config.window) {
+                int ne = 0;
+                if (sent < config.window) {
+                    ne += ibv::tryPollCQBatch(&device, device.send_cq, wcs.data(), config.poll_batch,
+                                              [&](const struct ibv_wc &wc) {
+                                                  check_send(wc);
+                                                  sent += ibv::retireSends(&device, wc);
+                                              });
+                    if (sent == config.window) t_out = wtime();
+                }
+                if (received < config.window) {
+                    int nr = ibv::tryPollCQBatch(&device, device.recv_cq, wcs.data(),
+                                                 min(config.poll_batch, config.window - received),
+                                                 recv_msg);
+                    received += nr;
+                    // optionally post recv buffers
+                    ibv::refillRecvs(&device);
+                    if (received == config.window) t_in = wtime();
+                    ne += nr;
+                }
+                if (ne == 0) ibv::spinOrYield(&device, config.max_spin, &nspin);
+            }
+            dir_time[rank] += t_out - t0;
+            dir_time[1-rank] += t_in - t0;
+        }, {0, 1}, {config.window, false, dir_time});
+        ibv::barrier(&device);
+    } else if (rank == 0) {
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
+            // post a window of sends
+            if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
+            for (int i = 0; i < config.window; ++i) {
+                if (i == config.window - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postSend(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey, NULL);
+                MLOG_Assert(ret == 0, "Post Send failed!");
+            }
+            int ret = ibv::flushSends(&device, 1-rank);
+            MLOG_Assert(ret == 0, "Post Send failed!");
+
+            // wait for all sends to complete
+            int completed = 0;
+            while (completed < config.window) {
+                ibv::pollCQBatch(&device, device.send_cq, wcs.data(), config.poll_batch,
+                                 [&](const struct ibv_wc &wc) {
+                                     check_send(wc);
+                                     completed += ibv::retireSends(&device, wc);
+                                 }, config.max_spin);
+            }
+
+            // wait for the ack
+            struct ibv_wc wc = ibv::pollCQ(&device, device.recv_cq, config.max_spin);
+            check_recv(wc);
+            ibv::releaseRecv(&device, wc);
+            ibv::refillRecvs(&device);
+        }, {0, 1}, {config.window, false});
+    } else {
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
+            // wait for a window of recvs to complete
+            int completed = 0;
+            while (completed < config.window) {
+                int ne = ibv::pollCQBatch(&device, device.recv_cq, wcs.data(), config.poll_batch,
+                                          recv_msg, config.max_spin);
+                completed += ne;
+                // optionally post recv buffers
+                ibv::refillRecvs(&device);
+            }
+
+            // send the ack
+            ibv::signalNext(&device, 1 - rank);
+            int ret = ibv::postSend(&device, 1 - rank, send_buf, 4, device.dev_mr->lkey, NULL);
+            MLOG_Assert(ret == 0, "Post Send failed!");
+            ret = ibv::flushSends(&device, 1 - rank);
+            MLOG_Assert(ret == 0, "Post Send failed!");
+            struct ibv_wc wc = ibv::pollCQ(&device, device.send_cq, config.max_spin);
+            check_send(wc);
+            ibv::retireSends(&device, wc);
+        }, {0, 1}, {config.window, false});
+    }
+
+    ibv::finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -6,8 +6,15 @@
 #define IBVBENCH_IBV_COMMON_HPP
 
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include "infiniband/verbs.h"
 #include "mlog.h"
 #include "pmi_wrapper.h"
@@ -36,6 +43,14 @@ struct RemoteMemRegion {
     uint32_t rkey;
 };
 
+// What a rank needs to connect its QP to a peer.
+struct PeerAddr {
+    uintptr_t addr;
+    uint32_t rkey;
+    uint32_t qpn;  // of the peer's QP connected to us (lazy_connect: its bootstrap QP)
+    uint16_t lid;
+};
+
 struct DeviceConfig {
     bool send_inline = true;
     int inline_size = 0;
@@ -45,8 +60,185 @@ struct DeviceConfig {
     int max_sge_num = 1;
     int max_cqe_num = max_recv_num + 1;
     int mr_size = 64 * 1024; // 64KB for now
+    // Number of send WRs collected per QP before they are posted as one
+    // linked chain (one doorbell). 1 posts every WR immediately.
+    int post_batch = 1;
+    // Only every signal_interval-th send WR of a QP asks for a completion.
+    // The unsignaled WRs before it retire when that completion is passed
+    // to retireSends. 1 signals every WR and needs no accounting.
+    int signal_interval = 1;
+    // Maximum number of receive WRs per linked ibv_post_srq_recv chain when
+    // the receive pool refills the SRQ. 0 posts each refill as one chain.
+    int recv_post_batch = 0;
+    // Refill the receive pool from a helper thread: the SRQ limit is armed
+    // at min_recv_num and IBV_EVENT_SRQ_LIMIT_REACHED triggers a bulk repost
+    // of the released slots. refillRecvs is then a no-op and releaseRecv
+    // only hands the slot to the helper thread, without a lock.
+    bool async_recv_refill = false;
+    // Wire-up through PMI. packed: every rank publishes one blob with its
+    // LID, MR and QPNs, and a peer fetches one key per rank (two if the QPNs
+    // are neither strided nor in the first chunk). Otherwise one key per
+    // (rank, peer) pair is published and fetched.
+    bool packed_wireup = true;
+    // Create and connect the QP to a rank on the first send to it instead of
+    // one QP per rank in init. The QPNs are exchanged as datagrams between
+    // per-rank UD bootstrap QPs, whose addresses are wired up through PMI.
+    bool lazy_connect = false;
+    // Reduce the time of every phase of init (InitPhase) over the ranks
+    // (min/avg/max on rank 0, see printInitProfile and describeDevice).
+    // Also turned on by the environment variable IBVB_PROFILE_INIT=1, which
+    // prints the breakdown to stderr.
+    bool profile_init = false;
+    // Threads that create the QPs of init and drive them through
+    // INIT/RTR/RTS, each over a contiguous batch of ranks. The QPNs then
+    // need not be strided in rank order (the packed wire-up takes more keys).
+    int setup_threads = 1;
 };
 
+// Send WRs waiting to be posted to one QP as a linked chain.
+struct SendBatch {
+    struct ibv_send_wr *wrs;
+    struct ibv_sge *sges;
+    int num;
+};
+
+// Send queue accounting of one QP for selective signaling.
+struct SendQueue {
+    int outstanding;     // posted WRs that are not retired yet
+    int unsignaled;      // WRs posted since the last signaled one
+    bool force_signal;   // signal the next WR regardless of the interval
+    int *retire;         // FIFO: number of WRs each in-flight signaled WR retires
+    int head, tail;      // indices into retire, in [0, max_send_num)
+};
+
+// Receive buffers of the SRQ: max_recv_num slots carved out of registered
+// memory. The slot index travels in wr_id.
+struct RecvPool {
+    char *base;
+    uint32_t slot_size;
+    uint32_t lkey;
+    int *free_slots;     // stack of slots not posted to the SRQ
+    int num_free;
+    struct ibv_recv_wr *wrs;
+    struct ibv_sge *sges;
+    // async_recv_refill: free_slots belongs to the helper thread. The slots
+    // released by releaseRecv reach it through a single-producer/single-
+    // consumer ring of max_recv_num + 1 entries (head == tail: empty).
+    int *released;
+    alignas(64) uint32_t released_head;  // written by the helper thread
+    alignas(64) uint32_t released_tail;  // written by releaseRecv
+    pthread_t refill_thread;
+    bool refill_running;
+    bool refill_stop;
+};
+
+// lazy_connect: the UD QP that carries connection requests and replies.
+struct Bootstrap {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *bufs;                // receive slots
+    struct ibv_ah **ahs;       // per rank, created on first use
+    struct ibv_qp **pending;   // per rank: created, waiting for the peer's QPN
+    bool *known;               // per rank: peers[rank] and rmrs[rank] are set
+    int round;                 // of the PMI key this rank published
+    int send_outstanding;
+};
+
+// QPN -> rank of the connected QPs: open addressing with linear probing over
+// a power-of-two table kept at most half full, so building it is O(#QPs)
+// and a lookup usually reads one or two entries.
+struct Qp2Rank {
+    struct Entry {
+        uint32_t qpn;
+        int32_t rank;    // -1: empty
+    };
+    Entry *entries;
+    int shift;           // slot = (qpn * QP2RANK_HASH) >> shift
+    int capacity;
+    int num;
+};
+const uint32_t QP2RANK_HASH = 0x9e3779b1;   // Fibonacci hashing: spreads strided QPNs
+
+inline void qp2rankInit(Qp2Rank *table, int num) {
+    int capacity = 2, shift = 31;
+    while (capacity < 2 * num) {
+        capacity *= 2;
+        --shift;
+    }
+    table->entries = (Qp2Rank::Entry*) malloc(capacity * sizeof(Qp2Rank::Entry));
+    for (int i = 0; i < capacity; ++i)
+        table->entries[i].rank = -1;
+    table->shift = shift;
+    table->capacity = capacity;
+    table->num = 0;
+}
+
+inline void qp2rankFree(Qp2Rank *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = table->num = 0;
+}
+
+inline void qp2rankInsert(Qp2Rank *table, uint32_t qpn, int rank) {
+    if (2 * (table->num + 1) > table->capacity) {
+        // grow: rehash into a table twice as large
+        Qp2Rank old = *table;
+        qp2rankInit(table, old.num + 1);
+        for (int i = 0; i < old.capacity; ++i)
+            if (old.entries[i].rank >= 0)
+                qp2rankInsert(table, old.entries[i].qpn, old.entries[i].rank);
+        free(old.entries);
+    }
+    uint32_t mask = table->capacity - 1;
+    uint32_t slot = (qpn * QP2RANK_HASH) >> table->shift;
+    while (table->entries[slot].rank >= 0) {
+        MLOG_Assert(table->entries[slot].qpn != qpn, "QPN %u is already mapped\n", qpn);
+        slot = (slot + 1) & mask;
+    }
+    table->entries[slot].qpn = qpn;
+    table->entries[slot].rank = rank;
+    ++table->num;
+}
+
+// Rank of the QP qpn; -1 if it is not connected.
+inline int qp2rankLookup(const Qp2Rank &table, uint32_t qpn) {
+    uint32_t mask = table.capacity - 1;
+    uint32_t slot = (qpn * QP2RANK_HASH) >> table.shift;
+    while (true) {
+        const Qp2Rank::Entry &entry = table.entries[slot];
+        if (entry.qpn == qpn || entry.rank < 0) return entry.rank;
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Phases of init, in order. The PMI exchange (exchangeAddrs) is split into
+// publish, barrier and lookups.
+enum InitPhase {
+    INIT_PMI, INIT_DEVICE_OPEN, INIT_PD, INIT_QUERY, INIT_SRQ_CQ, INIT_MR, INIT_BUFFERS,
+    INIT_QP_CREATE, INIT_PUBLISH, INIT_FENCE, INIT_LOOKUP, INIT_CONNECT, INIT_QP2RANK,
+    INIT_BARRIER, INIT_NUM_PHASES
+};
+const char *const INIT_PHASE_NAMES[INIT_NUM_PHASES] = {
+    "pmi_init", "device_open", "pd_alloc", "query", "srq_cq", "mr_reg", "buffers",
+    "qp_create", "pmi_publish", "pmi_barrier", "pmi_lookup", "qp_connect", "qp2rank",
+    "barrier"
+};
+
+// Seconds spent by init in every phase. With profile_init the min, avg and
+// max over the ranks are filled in on rank 0 (reduced).
+struct InitProfile {
+    double time[INIT_NUM_PHASES];
+    double min[INIT_NUM_PHASES], avg[INIT_NUM_PHASES], max[INIT_NUM_PHASES];
+    bool reduced;
+};
+
+inline double initClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
 struct Device {
     DeviceConfig config;
     struct ibv_device **dev_list;
@@ -60,23 +252,691 @@ struct Device {
     struct ibv_cq *send_cq, *recv_cq;
     struct ibv_qp **qps;
     RemoteMemRegion *rmrs;
+    SendBatch *send_batches;
+    SendQueue *send_queues;
+    RecvPool recv_pool = {};
+    Bootstrap bootstrap = {};
+    PeerAddr *peers = NULL;    // lazy_connect only, see lookupPeer
     void *mr_addr;
     uint32_t mr_size;
     uint8_t dev_port;
-    int posted_recv_num = 0;
+    int posted_recv_num = 0;   // atomic with async_recv_refill
+    // Resources in use: connected RC QPs, and bytes of pinned memory: the
+    // registered buffers and the queues of the QPs, SRQ and CQs (see
+    // queueBytes).
+    int num_qps = 0;
+    size_t pinned_bytes = 0;
     // Helper fields.
-    int* qp2rank;
-    int qp2rank_mod;
+    Qp2Rank qp2rank = {};
+    InitProfile init_profile = {};
 };
 
+// Rank at the other end of the local QP qp_num (e.g. wc.qp_num).
+inline int qpRank(const Device *device, uint32_t qp_num) {
+    return qp2rankLookup(device->qp2rank, qp_num);
+}
+
 int postRecv(Device *device, void *buf, uint32_t size, uint32_t lkey, void *user_context);
 
+// Header of a packed wire-up blob. It is followed by either {first, stride}
+// (all QPNs are first + i * stride) or by up to WIREUP_CHUNK_QPNS QPNs.
+struct WireupHeader {
+    uint64_t addr;
+    uint32_t rkey;
+    uint16_t lid;
+    uint16_t strided;
+};
+// PMI values are limited to 255 characters: 186 bytes in base64.
+const int WIREUP_CHUNK_QPNS = (186 - sizeof(WireupHeader)) / sizeof(uint32_t);
+
+// URL-safe base64 without padding (no '=' for the PMI wire protocols).
+inline void base64Encode(const void *data, size_t len, char *out) {
+    static const char table[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const uint8_t *in = (const uint8_t*) data;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len) v |= in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        int nout = i + 2 < len ? 4 : (i + 1 < len ? 3 : 2);
+        for (int j = 0; j < nout; ++j)
+            *out++ = table[(v >> (18 - 6 * j)) & 0x3f];
+    }
+    *out = '\0';
+}
+
+// Return the number of decoded bytes.
+inline size_t base64Decode(const char *str, void *data) {
+    uint8_t *out = (uint8_t*) data;
+    uint32_t v = 0;
+    int nbits = 0;
+    size_t len = 0;
+    for (; *str; ++str) {
+        char c = *str;
+        int d = c >= 'A' && c <= 'Z' ? c - 'A' :
+                c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+                c >= '0' && c <= '9' ? c - '0' + 52 :
+                c == '-' ? 62 : 63;
+        v = (v << 6) | d;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[len++] = (uint8_t) (v >> nbits);
+        }
+    }
+    return len;
+}
+
+// Publish this rank's wire-up information and collect the address of
+// every peer. Collective; the keys carry a round number so that it can be
+// repeated (see ibv_wireup). The time of the publish, barrier and lookup
+// phases is added to profile, if any.
+inline void exchangeAddrs(Device *device, PeerAddr *peers, InitProfile *profile = NULL) {
+    static int round = 0;
+    double t = initClock();
+    auto lap = [&](InitPhase phase) {
+        double now = initClock();
+        if (profile) profile->time[phase] += now - t;
+        t = now;
+    };
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    char key[256];
+    char value[256];
+    // the QPN the peer i connects to
+    auto qpn = [device](int i) -> uint32_t {
+        return device->qps[i]->qp_num;
+    };
+    if (!device->config.packed_wireup) {
+        for (int i = 0; i < nranks; i++) {
+            sprintf(key, "ibvBench_%d_%d_%d", round, rank, i);
+            sprintf(value, "%lx:%x:%x:%hx",
+                    (uintptr_t) device->mr_addr,
+                    device->dev_mr->rkey, qpn(i),
+                    device->port_attr.lid);
+            lcm_pm_publish(key, value);
+        }
+        lap(INIT_PUBLISH);
+        lcm_pm_barrier();
+        lap(INIT_FENCE);
+        for (int i = 0; i < nranks; i++) {
+            sprintf(key, "ibvBench_%d_%d_%d", round, i, rank);
+            lcm_pm_getname_rank(i, key, value);
+            sscanf(value, "%lx:%x:%x:%hx", &peers[i].addr,
+                   &peers[i].rkey, &peers[i].qpn, &peers[i].lid);
+        }
+        lap(INIT_LOOKUP);
+        ++round;
+        return;
+    }
+
+    // packed: the chunk c of a rank holds the QPNs to the peers
+    // [c * WIREUP_CHUNK_QPNS, (c + 1) * WIREUP_CHUNK_QPNS)
+    char blob[sizeof(WireupHeader) + WIREUP_CHUNK_QPNS * sizeof(uint32_t)];
+    WireupHeader *header = (WireupHeader*) blob;
+    uint32_t *payload = (uint32_t*) (blob + sizeof(WireupHeader));
+    header->addr = (uintptr_t) device->mr_addr;
+    header->rkey = device->dev_mr->rkey;
+    header->lid = device->port_attr.lid;
+    uint32_t stride = nranks > 1 ? qpn(1) - qpn(0) : 0;
+    header->strided = 1;
+    for (int i = 1; i < nranks; i++)
+        if (qpn(i) - qpn(i - 1) != stride)
+            header->strided = 0;
+    if (header->strided) {
+        payload[0] = qpn(0);
+        payload[1] = stride;
+        base64Encode(blob, sizeof(WireupHeader) + 2 * sizeof(uint32_t), value);
+        sprintf(key, "ibvBench_%d_%d", round, rank);
+        lcm_pm_publish(key, value);
+    } else {
+        for (int c = 0; c * WIREUP_CHUNK_QPNS < nranks; ++c) {
+            int num = std::min(WIREUP_CHUNK_QPNS, nranks - c * WIREUP_CHUNK_QPNS);
+            for (int i = 0; i < num; ++i)
+                payload[i] = qpn(c * WIREUP_CHUNK_QPNS + i);
+            base64Encode(blob, sizeof(WireupHeader) + num * sizeof(uint32_t), value);
+            if (c == 0) sprintf(key, "ibvBench_%d_%d", round, rank);
+            else sprintf(key, "ibvBench_%d_%d_%d", round, rank, c);
+            lcm_pm_publish(key, value);
+        }
+    }
+    lap(INIT_PUBLISH);
+    lcm_pm_barrier();
+    lap(INIT_FENCE);
+
+    for (int i = 0; i < nranks; i++) {
+        sprintf(key, "ibvBench_%d_%d", round, i);
+        lcm_pm_getname_rank(i, key, value);
+        base64Decode(value, blob);
+        peers[i].addr = header->addr;
+        peers[i].rkey = header->rkey;
+        peers[i].lid = header->lid;
+        if (header->strided) {
+            peers[i].qpn = payload[0] + rank * payload[1];
+            continue;
+        }
+        int c = rank / WIREUP_CHUNK_QPNS;
+        if (c > 0) {
+            sprintf(key, "ibvBench_%d_%d_%d", round, i, c);
+            lcm_pm_getname_rank(i, key, value);
+            base64Decode(value, blob);
+        }
+        peers[i].qpn = payload[rank % WIREUP_CHUNK_QPNS];
+    }
+    lap(INIT_LOOKUP);
+    ++round;
+}
+
+// Estimated bytes of a work queue of num entries of up to max_sge SGEs
+// or inline_size bytes of inline data, laid out as NICs do it (mlx5):
+// 16-byte segments (control, address, SGEs or the inline data) rounded up
+// to 64-byte blocks in send queues. Receive queue entries hold their
+// scatter list after one segment. A CQ entry takes 64 bytes.
+inline size_t queueBytes(int num, int max_sge, int inline_size, bool send) {
+    if (!send) return (size_t) num * 16 * (1 + max_sge);
+    size_t data = std::max((size_t) max_sge * 16, ((size_t) inline_size + 4 + 15) / 16 * 16);
+    return (size_t) num * ((48 + data + 63) / 64 * 64);
+}
+const size_t CQE_BYTES = 64;
+
+// Create an RC QP on the shared CQs and SRQ and bring it to INIT.
+inline struct ibv_qp *createQP(Device *device) {
+    struct ibv_qp *qp;
+    {
+        struct ibv_qp_init_attr init_attr;
+        memset(&init_attr, 0, sizeof(init_attr));
+        init_attr.send_cq = device->send_cq;
+        init_attr.recv_cq = device->recv_cq;
+        init_attr.srq = device->dev_srq;
+        init_attr.cap.max_send_wr  = device->config.max_send_num;
+        init_attr.cap.max_recv_wr  = device->config.max_recv_num;
+        init_attr.cap.max_send_sge = device->config.max_sge_num;
+        init_attr.cap.max_recv_sge = device->config.max_sge_num;
+        init_attr.cap.max_inline_data = device->config.inline_size;
+        init_attr.qp_type = IBV_QPT_RC;
+        init_attr.sq_sig_all = 0;
+        qp = ibv_create_qp(device->dev_pd, &init_attr);
+
+        if (!qp)  {
+            fprintf(stderr, "Couldn't create QP\n");
+            exit(EXIT_FAILURE);
+        }
+
+        struct ibv_qp_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        ibv_query_qp(qp, &attr, IBV_QP_CAP, &init_attr);
+        MLOG_Assert(init_attr.cap.max_inline_data >= device->config.inline_size,
+                    "Specified inline size %d is too large (maximum %d)", device->config.inline_size,
+                    init_attr.cap.max_inline_data);
+        if (device->config.inline_size < attr.cap.max_inline_data) {
+            MLOG_Log(MLOG_LOG_INFO, "Maximum inline-size(%d) > requested inline-size(%d)\n",
+                   attr.cap.max_inline_data, device->config.inline_size);
+        }
+        // the receives go to the SRQ; may run on several setup threads
+        __atomic_add_fetch(&device->pinned_bytes,
+                           queueBytes(init_attr.cap.max_send_wr, init_attr.cap.max_send_sge,
+                                      init_attr.cap.max_inline_data, true), __ATOMIC_RELAXED);
+    }
+    MLOG_Log(MLOG_LOG_INFO, "Current inline data size is %d\n",
+             device->config.inline_size);
+    {
+        // When a queue pair (QP) is newly created, it is in the RESET
+        // state. The first state transition that needs to happen is to
+        // bring the QP in the INIT state.
+        struct ibv_qp_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.qp_state        = IBV_QPS_INIT;
+        attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                               IBV_ACCESS_REMOTE_READ |
+                               IBV_ACCESS_REMOTE_WRITE;
+        attr.pkey_index      = 0;
+        attr.port_num        = device->dev_port;
+
+        int flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                    IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+        int rc = ibv_modify_qp(qp, &attr, flags);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to modify QP to INIT\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return qp;
+}
+
+// Connect qp to the QP dest_qpn of the port dest_lid (RTR, then RTS).
+inline void connectQP(Device *device, struct ibv_qp *qp, uint32_t dest_qpn, uint16_t dest_lid) {
+    // Once a queue pair (QP) has receive buffers posted to it, it is now
+    // possible to transition the QP into the ready to receive (RTR) state.
+    {
+        struct ibv_qp_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.qp_state		= IBV_QPS_RTR;
+        attr.path_mtu		= device->port_attr.active_mtu;
+        // starting receive packet sequence number
+        // (should match remote QP's sq_psn)
+        attr.rq_psn			= 0;
+        attr.dest_qp_num	= dest_qpn;
+        // an address handle (AH) needs to be created and filled in as
+        // appropriate. Minimally; ah_attr.dlid needs to be filled in.
+        attr.ah_attr.dlid		= dest_lid;
+        attr.ah_attr.sl		= 0;
+        attr.ah_attr.src_path_bits	= 0;
+        attr.ah_attr.is_global	= 0;
+        attr.ah_attr.static_rate = 0;
+        attr.ah_attr.port_num	= device->dev_port;
+        // maximum number of resources for incoming RDMA requests
+        // (reads in flight towards us): as many as the device allows
+        attr.max_dest_rd_atomic	= std::max(device->dev_attr.max_qp_rd_atom, 1);
+        // minimum RNR NAK timer (recommended value: 12)
+        attr.min_rnr_timer		= 12;
+        // should not be necessary to set these, given is_global = 0
+        memset(&attr.ah_attr.grh, 0, sizeof attr.ah_attr.grh);
+
+        int flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                    IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+
+        int rc = ibv_modify_qp(qp, &attr, flags);
+        if (rc != 0) {
+            fprintf(stderr, "failed to modify QP state to RTR\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Once a queue pair (QP) has reached ready to receive (RTR) state,
+    // it may then be transitioned to the ready to send (RTS) state.
+    {
+        struct ibv_qp_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.qp_state = IBV_QPS_RTS;
+        attr.sq_psn = 0;
+        // number of outstanding RDMA reads and atomic operations allowed
+        attr.max_rd_atomic = std::max(device->dev_attr.max_qp_init_rd_atom, 1);
+        attr.timeout = 14;
+        attr.retry_cnt = 7;
+        attr.rnr_retry = 7;
+
+        int flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                    IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+        int rc = ibv_modify_qp(qp, &attr, flags);
+        if (rc != 0) {
+            fprintf(stderr, "failed to modify QP state to RTS\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Run f(i) for every i in [0, n) on num_threads threads, each over a
+// contiguous batch. The calling thread takes the first batch and joins the
+// others.
+template<typename F>
+void parallelFor(int n, int num_threads, const F &f) {
+    num_threads = std::max(1, std::min(num_threads, n));
+    if (num_threads == 1) {
+        for (int i = 0; i < n; ++i) f(i);
+        return;
+    }
+    struct Batch {
+        const F *f;
+        int begin, end;
+        pthread_t thread;
+    };
+    auto work = [](void *arg) -> void* {
+        Batch *batch = (Batch*) arg;
+        for (int i = batch->begin; i < batch->end; ++i) (*batch->f)(i);
+        return NULL;
+    };
+    Batch *batches = new Batch[num_threads];
+    for (int t = 0; t < num_threads; ++t) {
+        batches[t].f = &f;
+        batches[t].begin = (int) ((long) n * t / num_threads);
+        batches[t].end = (int) ((long) n * (t + 1) / num_threads);
+        if (t > 0) {
+            int rc = pthread_create(&batches[t].thread, NULL, work, &batches[t]);
+            MLOG_Assert(rc == 0, "Cannot start setup thread %d\n", t);
+        }
+    }
+    work(&batches[0]);
+    for (int t = 1; t < num_threads; ++t)
+        pthread_join(batches[t].thread, NULL);
+    delete[] batches;
+}
+
+// qp2rank: index the connected QPs.
+inline void buildQp2rank(Device *device) {
+    int nranks = lcm_pm_get_size();
+    qp2rankFree(&device->qp2rank);
+    qp2rankInit(&device->qp2rank, device->num_qps);
+    for (int i = 0; i < nranks; i++) {
+        if (device->qps[i]) qp2rankInsert(&device->qp2rank, device->qps[i]->qp_num, i);
+    }
+}
+
+// lazy_connect: connection requests and replies exchanged between the UD
+// bootstrap QPs. A request carries the QPN of the RC QP the sender created
+// for the receiver; the reply carries the receiver's QPN. Both sides
+// connect as soon as they know the other QPN, so two ranks connecting to
+// each other at the same time end up with one QP pair. Both also carry the
+// sender's address, so the receiver of a request needs no PMI lookup.
+struct ConnMsg {
+    int32_t type;
+    int32_t rank;
+    uint32_t qpn;
+    PeerAddr addr;     // MR and bootstrap QP of the sender
+};
+enum ConnMsgType { CONN_REQUEST, CONN_REPLY };
+const uint32_t BOOTSTRAP_QKEY = 0x1bb1;
+const int BOOTSTRAP_QUEUE_NUM = 64;
+// UD receives start with room for the GRH.
+const int BOOTSTRAP_GRH_SIZE = 40;
+const int BOOTSTRAP_SLOT_SIZE = 64 + sizeof(ConnMsg);
+// Unanswered requests are resent after this many seconds (datagrams may be
+// dropped).
+const double BOOTSTRAP_RETRY_TIME = 0.1;
+
+inline void postBootstrapRecv(Device *device, int slot) {
+    Bootstrap &bs = device->bootstrap;
+    struct ibv_sge sge;
+    sge.addr = (uint64_t) (bs.bufs + (size_t) slot * BOOTSTRAP_SLOT_SIZE);
+    sge.length = BOOTSTRAP_SLOT_SIZE;
+    sge.lkey = bs.mr->lkey;
+    struct ibv_recv_wr wr = {};
+    wr.wr_id = slot;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr;
+    int ret = ibv_post_recv(bs.qp, &wr, &bad_wr);
+    MLOG_Assert(ret == 0, "Post bootstrap Recv failed!\n");
+}
+
+// Create the UD bootstrap QP, bring it to RTS and post its receives.
+inline void initBootstrap(Device *device) {
+    Bootstrap &bs = device->bootstrap;
+    int nranks = lcm_pm_get_size();
+    bs.cq = ibv_create_cq(device->dev_ctx, 2 * BOOTSTRAP_QUEUE_NUM, NULL, NULL, 0);
+    MLOG_Assert(bs.cq != NULL, "Unable to create the bootstrap cq\n");
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = bs.cq;
+    init_attr.recv_cq = bs.cq;
+    init_attr.cap.max_send_wr = BOOTSTRAP_QUEUE_NUM;
+    init_attr.cap.max_recv_wr = BOOTSTRAP_QUEUE_NUM;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = sizeof(ConnMsg);
+    init_attr.qp_type = IBV_QPT_UD;
+    bs.qp = ibv_create_qp(device->dev_pd, &init_attr);
+    MLOG_Assert(bs.qp != NULL, "Couldn't create the bootstrap QP\n");
+
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = device->dev_port;
+    attr.qkey = BOOTSTRAP_QKEY;
+    int rc = ibv_modify_qp(bs.qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY);
+    MLOG_Assert(rc == 0, "Failed to modify the bootstrap QP to INIT\n");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    rc = ibv_modify_qp(bs.qp, &attr, IBV_QP_STATE);
+    MLOG_Assert(rc == 0, "Failed to modify the bootstrap QP to RTR\n");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    rc = ibv_modify_qp(bs.qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+    MLOG_Assert(rc == 0, "Failed to modify the bootstrap QP to RTS\n");
+
+    size_t size = (size_t) BOOTSTRAP_QUEUE_NUM * BOOTSTRAP_SLOT_SIZE;
+    posix_memalign((void**)&bs.bufs, PAGE_SIZE, size);
+    bs.mr = ibv_reg_mr(device->dev_pd, bs.bufs, size, IBV_ACCESS_LOCAL_WRITE);
+    MLOG_Assert(bs.mr != NULL, "Unable to register the bootstrap buffers\n");
+    device->pinned_bytes += size + queueBytes(BOOTSTRAP_QUEUE_NUM, 1, sizeof(ConnMsg), true) +
+                            queueBytes(BOOTSTRAP_QUEUE_NUM, 1, 0, false) + 2 * BOOTSTRAP_QUEUE_NUM * CQE_BYTES;
+    for (int i = 0; i < BOOTSTRAP_QUEUE_NUM; ++i)
+        postBootstrapRecv(device, i);
+    bs.ahs = (struct ibv_ah**) calloc(nranks, sizeof(struct ibv_ah*));
+    bs.pending = (struct ibv_qp**) calloc(nranks, sizeof(struct ibv_qp*));
+    bs.known = (bool*) calloc(nranks, sizeof(bool));
+    device->peers = (PeerAddr*) calloc(nranks, sizeof(PeerAddr));
+}
+
+// This rank's address for lazy_connect: its MR and bootstrap QP.
+inline PeerAddr localBootstrapAddr(const Device *device) {
+    PeerAddr addr;
+    addr.addr = (uintptr_t) device->mr_addr;
+    addr.rkey = device->dev_mr->rkey;
+    addr.qpn = device->bootstrap.qp->qp_num;
+    addr.lid = device->port_attr.lid;
+    return addr;
+}
+
+// lazy_connect: publish only this rank's address; a peer fetches it with
+// lookupPeer on first use, so init does no per-peer lookup. Needs a PMI
+// barrier before the first lookup (the one at the end of init).
+inline void publishBootstrap(Device *device) {
+    static int round = 0;
+    char key[256];
+    char value[256];
+    PeerAddr addr = localBootstrapAddr(device);
+    device->bootstrap.round = round;
+    sprintf(key, "ibvBench_bs_%d_%d", round, lcm_pm_get_rank());
+    sprintf(value, "%lx:%x:%x:%hx", addr.addr, addr.rkey, addr.qpn, addr.lid);
+    lcm_pm_publish(key, value);
+    ++round;
+}
+
+inline void setPeer(Device *device, int rank, const PeerAddr &addr) {
+    device->peers[rank] = addr;
+    device->rmrs[rank].addr = addr.addr;
+    device->rmrs[rank].size = device->config.mr_size;
+    device->rmrs[rank].rkey = addr.rkey;
+    device->bootstrap.known[rank] = true;
+}
+
+// lazy_connect: the address of rank, fetched from PMI on first use unless
+// a connection message of rank brought it already.
+inline const PeerAddr &lookupPeer(Device *device, int rank) {
+    if (!device->bootstrap.known[rank]) {
+        char key[256];
+        char value[256];
+        PeerAddr addr;
+        sprintf(key, "ibvBench_bs_%d_%d", device->bootstrap.round, rank);
+        lcm_pm_getname_rank(rank, key, value);
+        sscanf(value, "%lx:%x:%x:%hx", &addr.addr, &addr.rkey, &addr.qpn, &addr.lid);
+        setPeer(device, rank, addr);
+    }
+    return device->peers[rank];
+}
+
+// The registered memory of rank (Device::rmrs), looked up first with
+// lazy_connect.
+inline const RemoteMemRegion &remoteMR(Device *device, int rank) {
+    if (device->config.lazy_connect) lookupPeer(device, rank);
+    return device->rmrs[rank];
+}
+
+inline int progressConnections(Device *device);
+
+inline void sendConnMsg(Device *device, int rank, ConnMsgType type, uint32_t qpn) {
+    Bootstrap &bs = device->bootstrap;
+    while (bs.send_outstanding >= BOOTSTRAP_QUEUE_NUM)
+        progressConnections(device);
+    if (!bs.ahs[rank]) {
+        struct ibv_ah_attr ah_attr;
+        memset(&ah_attr, 0, sizeof(ah_attr));
+        ah_attr.dlid = device->peers[rank].lid;
+        ah_attr.port_num = device->dev_port;
+        bs.ahs[rank] = ibv_create_ah(device->dev_pd, &ah_attr);
+        MLOG_Assert(bs.ahs[rank] != NULL, "Unable to create an address handle\n");
+    }
+    ConnMsg msg = {type, lcm_pm_get_rank(), qpn, localBootstrapAddr(device)};
+    struct ibv_sge sge;
+    sge.addr = (uint64_t) &msg;
+    sge.length = sizeof(msg);
+    sge.lkey = 0;
+    struct ibv_send_wr wr = {};
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+    wr.wr.ud.ah = bs.ahs[rank];
+    wr.wr.ud.remote_qpn = device->peers[rank].qpn;
+    wr.wr.ud.remote_qkey = BOOTSTRAP_QKEY;
+    struct ibv_send_wr *bad_wr;
+    int ret = ibv_post_send(bs.qp, &wr, &bad_wr);
+    MLOG_Assert(ret == 0, "Post bootstrap Send failed!\n");
+    ++bs.send_outstanding;
+}
+
+// Connect to rank using its QPN qpn; answer a request.
+inline void handleConnMsg(Device *device, const ConnMsg &msg) {
+    Bootstrap &bs = device->bootstrap;
+    int rank = msg.rank;
+    if (!bs.known[rank]) setPeer(device, rank, msg.addr);
+    if (!device->qps[rank]) {
+        // the peer may send as soon as it gets the reply: RTS first
+        if (!bs.pending[rank]) bs.pending[rank] = createQP(device);
+        connectQP(device, bs.pending[rank], msg.qpn, device->peers[rank].lid);
+        device->qps[rank] = bs.pending[rank];
+        bs.pending[rank] = NULL;
+        ++device->num_qps;
+        qp2rankInsert(&device->qp2rank, device->qps[rank]->qp_num, rank);
+    }
+    if (msg.type == CONN_REQUEST)
+        sendConnMsg(device, rank, CONN_REPLY, device->qps[rank]->qp_num);
+}
+
+// Serve the bootstrap QP; return the number of completions handled.
+inline int progressConnections(Device *device) {
+    Bootstrap &bs = device->bootstrap;
+    struct ibv_wc wcs[16];
+    int ne = ibv_poll_cq(bs.cq, 16, wcs);
+    MLOG_Assert(ne >= 0, "Poll bootstrap CQ failed %d\n", ne);
+    for (int i = 0; i < ne; ++i) {
+        MLOG_Assert(wcs[i].status == IBV_WC_SUCCESS, "Bootstrap completion failed: %s\n",
+                    ibv_wc_status_str(wcs[i].status));
+        if (wcs[i].opcode == IBV_WC_SEND) {
+            --bs.send_outstanding;
+            continue;
+        }
+        int slot = (int) wcs[i].wr_id;
+        ConnMsg msg;
+        memcpy(&msg, bs.bufs + (size_t) slot * BOOTSTRAP_SLOT_SIZE + BOOTSTRAP_GRH_SIZE, sizeof(msg));
+        postBootstrapRecv(device, slot);
+        handleConnMsg(device, msg);
+    }
+    return ne;
+}
+
+// Create the QP to rank and wait until it is connected.
+inline void connectRank(Device *device, int rank) {
+    Bootstrap &bs = device->bootstrap;
+    lookupPeer(device, rank);
+    if (!bs.pending[rank]) bs.pending[rank] = createQP(device);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sendConnMsg(device, rank, CONN_REQUEST, bs.pending[rank]->qp_num);
+    while (!device->qps[rank]) {
+        if (progressConnections(device) > 0) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) * 1e-9 > BOOTSTRAP_RETRY_TIME) {
+            sendConnMsg(device, rank, CONN_REQUEST, bs.pending[rank]->qp_num);
+            start = now;
+        }
+    }
+}
+
+// lcm_pm_barrier that keeps serving the connection requests of other ranks
+// with lazy_connect: a rank may still wait for our reply before it reaches
+// the barrier. The requests are served from a helper thread while this one
+// blocks in PMI, so the device is never used by two threads at once.
+inline void barrier(Device *device) {
+    if (!device->config.lazy_connect) {
+        lcm_pm_barrier();
+        return;
+    }
+    struct Server {
+        Device *device;
+        bool stop;
+    } server = {device, false};
+    auto serve = [](void *arg) -> void* {
+        Server *server = (Server*) arg;
+        while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE))
+            if (progressConnections(server->device) == 0) sched_yield();
+        return NULL;
+    };
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, serve, &server);
+    MLOG_Assert(ret == 0, "Cannot start the connection thread!\n");
+    lcm_pm_barrier();
+    __atomic_store_n(&server.stop, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+}
+
+// Min, avg and max of every phase of the init profile over the ranks, on
+// rank 0. Collective: every rank publishes its times as one key, tagged
+// with the round so that every init of the process reduces its own times.
+inline void reduceInitProfile(InitProfile *profile) {
+    static int next_round = 0;
+    int round = next_round++;
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    char key[256];
+    char value[256];
+    static_assert((sizeof(profile->time) + 2) / 3 * 4 < sizeof(value), "Init profile exceeds a PMI value");
+    sprintf(key, "ibvBench_init_%d_%d", round, rank);
+    base64Encode(profile->time, sizeof(profile->time), value);
+    lcm_pm_publish(key, value);
+    lcm_pm_barrier();
+    if (rank != 0) return;
+    for (int j = 0; j < INIT_NUM_PHASES; ++j) {
+        profile->min[j] = profile->max[j] = profile->time[j];
+        profile->avg[j] = 0;
+    }
+    double time[INIT_NUM_PHASES];
+    for (int i = 0; i < nranks; ++i) {
+        sprintf(key, "ibvBench_init_%d_%d", round, i);
+        lcm_pm_getname_rank(i, key, value);
+        base64Decode(value, time);
+        for (int j = 0; j < INIT_NUM_PHASES; ++j) {
+            profile->min[j] = std::min(profile->min[j], time[j]);
+            profile->max[j] = std::max(profile->max[j], time[j]);
+            profile->avg[j] += time[j] / nranks;
+        }
+    }
+    profile->reduced = true;
+}
+
+// The startup breakdown: min/avg/max over the ranks of every phase of
+// init, and its share of the average total. Needs a reduced profile.
+inline void printInitProfile(const InitProfile &profile, FILE *out) {
+    if (!profile.reduced) return;
+    double total = 0;
+    for (int j = 0; j < INIT_NUM_PHASES; ++j) total += profile.avg[j];
+    fprintf(out, "%-12s %-12s %-12s %-12s %-8s\n", "Phase", "Min(us)", "Avg(us)", "Max(us)", "Share");
+    for (int j = 0; j < INIT_NUM_PHASES; ++j)
+        fprintf(out, "%-12s %-12.1f %-12.1f %-12.1f %5.1f%%\n", INIT_PHASE_NAMES[j], profile.min[j] * 1e6,
+                profile.avg[j] * 1e6, profile.max[j] * 1e6, total > 0 ? profile.avg[j] / total * 100 : 0);
+    fprintf(out, "%-12s %-12s %-12.1f\n", "total", "", total * 1e6);
+    fflush(out);
+}
+
 void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
     MLOG_Init();
+    InitProfile &profile = device->init_profile;
+    memset(&profile, 0, sizeof(profile));
+    double t = initClock();
+    auto lap = [&](InitPhase phase) {
+        double now = initClock();
+        profile.time[phase] += now - t;
+        t = now;
+    };
     lcm_pm_initialize();
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
+    char *env = getenv("IBVB_PROFILE_INIT");
+    bool print_profile = env && atoi(env);
+    if (print_profile) config.profile_init = true;
     device->config = config;
+    lap(INIT_PMI);
 
     int num_devices;
     device->dev_list = ibv_get_device_list(&num_devices);
@@ -112,6 +972,7 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
         fprintf(stderr, "Couldn't get context for %s\n", ibv_get_device_name(device->ib_dev));
         exit(EXIT_FAILURE);
     }
+    lap(INIT_DEVICE_OPEN);
 
     // allocate protection domain
     device->dev_pd = ibv_alloc_pd(device->dev_ctx);
@@ -119,6 +980,7 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
         fprintf(stderr, "Could not create protection domain for context\n");
         exit(EXIT_FAILURE);
     }
+    lap(INIT_PD);
 
     // query device attribute
     int rc = ibv_query_device(device->dev_ctx, &device->dev_attr);
@@ -147,6 +1009,7 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
     MLOG_Log(MLOG_LOG_INFO, "Maximum MTU: %s; Active MTU: %s\n",
              mtu_str(device->port_attr.max_mtu),
              mtu_str(device->port_attr.active_mtu));
+    lap(INIT_QUERY);
 
     // Create shared-receive queue, **number here affect performance**.
     struct ibv_srq_init_attr srq_attr;
@@ -168,6 +1031,9 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
         fprintf(stderr, "Unable to create cq\n");
         exit(EXIT_FAILURE);
     }
+    device->pinned_bytes += queueBytes(device->config.max_recv_num, device->config.max_sge_num, 0, false) +
+                            2 * device->config.max_cqe_num * CQE_BYTES;
+    lap(INIT_SRQ_CQ);
 
     // Create RDMA memory.
     int mr_flags =
@@ -179,6 +1045,7 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
     }
     device->mr_size = device->config.mr_size;
     device->dev_mr = ibv_reg_mr(device->dev_pd, device->mr_addr, device->config.mr_size, mr_flags);
+    device->pinned_bytes += device->config.mr_size;
     MLOG_Log(MLOG_LOG_INFO, "register memory: %p %lu %u %u\n",
              device->dev_mr->addr, device->dev_mr->length, device->dev_mr->lkey,
              device->dev_mr->rkey);
@@ -187,203 +1054,333 @@ void init(char *devname, Device *device, DeviceConfig config = DeviceConfig{}) {
         exit(EXIT_FAILURE);
     }
     assert(device->mr_addr == device->dev_mr->addr);
+    lap(INIT_MR);
 
     posix_memalign((void**)&device->qps, CACHE_LINE_SIZE,
                    nranks * sizeof(struct ibv_qp*));
     posix_memalign((void**)&device->rmrs, CACHE_LINE_SIZE,
                    nranks * sizeof(struct RemoteMemRegion));
-
+    MLOG_Assert(device->config.post_batch >= 1 &&
+                device->config.post_batch <= device->config.max_send_num,
+                "Post batch %d must be in [1, max_send_num(%d)]\n",
+                device->config.post_batch, device->config.max_send_num);
+    posix_memalign((void**)&device->send_batches, CACHE_LINE_SIZE,
+                   nranks * sizeof(SendBatch));
     for (int i = 0; i < nranks; i++) {
-        {
-            struct ibv_qp_init_attr init_attr;
-            memset(&init_attr, 0, sizeof(init_attr));
-            init_attr.send_cq = device->send_cq;
-            init_attr.recv_cq = device->recv_cq;
-            init_attr.srq = device->dev_srq;
-            init_attr.cap.max_send_wr  = device->config.max_send_num;
-            init_attr.cap.max_recv_wr  = device->config.max_recv_num;
-            init_attr.cap.max_send_sge = device->config.max_sge_num;
-            init_attr.cap.max_recv_sge = device->config.max_sge_num;
-            init_attr.cap.max_inline_data = device->config.inline_size;
-            init_attr.qp_type = IBV_QPT_RC;
-            init_attr.sq_sig_all = 0;
-            device->qps[i] = ibv_create_qp(device->dev_pd, &init_attr);
-
-            if (!device->qps[i])  {
-                fprintf(stderr, "Couldn't create QP\n");
-                exit(EXIT_FAILURE);
-            }
+        SendBatch &batch = device->send_batches[i];
+        posix_memalign((void**)&batch.wrs, CACHE_LINE_SIZE,
+                       device->config.post_batch * sizeof(struct ibv_send_wr));
+        posix_memalign((void**)&batch.sges, CACHE_LINE_SIZE,
+                       device->config.post_batch * sizeof(struct ibv_sge));
+        batch.num = 0;
+    }
+    MLOG_Assert(device->config.signal_interval >= 1,
+                "Signal interval %d must be positive\n", device->config.signal_interval);
+    posix_memalign((void**)&device->send_queues, CACHE_LINE_SIZE,
+                   nranks * sizeof(SendQueue));
+    for (int i = 0; i < nranks; i++) {
+        SendQueue &sq = device->send_queues[i];
+        sq.outstanding = 0;
+        sq.unsignaled = 0;
+        sq.force_signal = false;
+        sq.retire = (int*) calloc(device->config.max_send_num, sizeof(int));
+        sq.head = sq.tail = 0;
+    }
+    lap(INIT_BUFFERS);
 
-            struct ibv_qp_attr attr;
-            memset(&attr, 0, sizeof(attr));
-            ibv_query_qp(device->qps[i], &attr, IBV_QP_CAP, &init_attr);
-            MLOG_Assert(init_attr.cap.max_inline_data >= device->config.inline_size,
-                        "Specified inline size %d is too large (maximum %d)", device->config.inline_size,
-                        init_attr.cap.max_inline_data);
-            if (device->config.inline_size < attr.cap.max_inline_data) {
-                MLOG_Log(MLOG_LOG_INFO, "Maximum inline-size(%d) > requested inline-size(%d)\n",
-                       attr.cap.max_inline_data, device->config.inline_size);
-            }
-        }
-        MLOG_Log(MLOG_LOG_INFO, "Current inline data size is %d\n",
-                 device->config.inline_size);
-        {
-            // When a queue pair (QP) is newly created, it is in the RESET
-            // state. The first state transition that needs to happen is to
-            // bring the QP in the INIT state.
-            struct ibv_qp_attr attr;
-            memset(&attr, 0, sizeof(attr));
-            attr.qp_state        = IBV_QPS_INIT;
-            attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
-                                   IBV_ACCESS_REMOTE_READ |
-                                   IBV_ACCESS_REMOTE_WRITE;
-            attr.pkey_index      = 0;
-            attr.port_num        = device->dev_port;
-
-            int flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX |
-                        IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
-            rc = ibv_modify_qp(device->qps[i], &attr, flags);
-            if (rc != 0) {
-                fprintf(stderr, "Failed to modify QP to INIT\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        // At least one receive buffer should be posted
-        // before the QP can be transitioned to the RTR state
-//        for (int j = 0; j < device->config.max_recv_num-1 /*error without -1, don't know why*/; ++j) {
-//            rc = postRecv(device, device->mr_addr, device->mr_size,
-//                          device->dev_mr->lkey, NULL);
-//            if (rc != 0) {
-//                fprintf(stderr, "Failed to post recv %d\n", j);
-//                exit(EXIT_FAILURE);
-//            }
-//        }
-        // Use this queue pair "i" to connect to rank e.
-        char key[256];
-        sprintf(key, "ibvBench_%d_%d", rank, i);
-        char ep_name[256];
-        sprintf(ep_name, "%lx:%x:%x:%hx",
-                (uintptr_t) device->mr_addr,
-                device->dev_mr->rkey, device->qps[i]->qp_num,
-                device->port_attr.lid);
-        lcm_pm_publish(key, ep_name);
+    if (device->config.lazy_connect) {
+        memset(device->qps, 0, nranks * sizeof(struct ibv_qp*));
+        initBootstrap(device);
+    } else {
+        parallelFor(nranks, device->config.setup_threads, [device](int i) {
+            device->qps[i] = createQP(device);
+        });
+        device->num_qps = nranks;
     }
-    lcm_pm_barrier();
+    lap(INIT_QP_CREATE);
 
-    for (int i = 0; i < nranks; i++) {
-        char key[256];
-        sprintf(key, "ibvBench_%d_%d", i, rank);
-        char ep_name[256];
-        uintptr_t dest_addr;
-        uint32_t dest_rkey;
-        uint32_t dest_qpn;
-        uint16_t dest_lid;
-        lcm_pm_getname(key, ep_name);
-        sscanf(ep_name, "%lx:%x:%x:%hx", &dest_addr,
-               &dest_rkey, &dest_qpn, &dest_lid);
-        // Once a queue pair (QP) has receive buffers posted to it, it is now
-        // possible to transition the QP into the ready to receive (RTR) state.
-        {
-            struct ibv_qp_attr attr;
-            memset(&attr, 0, sizeof(attr));
-            attr.qp_state		= IBV_QPS_RTR;
-            attr.path_mtu		= device->port_attr.active_mtu;
-            // starting receive packet sequence number
-            // (should match remote QP's sq_psn)
-            attr.rq_psn			= 0;
-            attr.dest_qp_num	= dest_qpn;
-            // an address handle (AH) needs to be created and filled in as
-            // appropriate. Minimally; ah_attr.dlid needs to be filled in.
-            attr.ah_attr.dlid		= dest_lid;
-            attr.ah_attr.sl		= 0;
-            attr.ah_attr.src_path_bits	= 0;
-            attr.ah_attr.is_global	= 0;
-            attr.ah_attr.static_rate = 0;
-            attr.ah_attr.port_num	= device->dev_port;
-            // maximum number of resources for incoming RDMA requests
-            // don't know what this is
-            attr.max_dest_rd_atomic	= 1;
-            // minimum RNR NAK timer (recommended value: 12)
-            attr.min_rnr_timer		= 12;
-            // should not be necessary to set these, given is_global = 0
-            memset(&attr.ah_attr.grh, 0, sizeof attr.ah_attr.grh);
-
-            int flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-                        IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-
-            rc = ibv_modify_qp(device->qps[i], &attr, flags);
-            if (rc != 0) {
-                fprintf(stderr, "failed to modify QP state to RTR\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        // Once a queue pair (QP) has reached ready to receive (RTR) state,
-        // it may then be transitioned to the ready to send (RTS) state.
-        {
-            struct ibv_qp_attr attr;
-            memset(&attr, 0, sizeof(attr));
-            attr.qp_state = IBV_QPS_RTS;
-            attr.sq_psn = 0;
-            // number of outstanding RDMA reads and atomic operations allowed
-            attr.max_rd_atomic = 1;
-            attr.timeout = 14;
-            attr.retry_cnt = 7;
-            attr.rnr_retry = 7;
-
-            int flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-                        IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
-            rc = ibv_modify_qp(device->qps[i], &attr, flags);
-            if (rc != 0) {
-                fprintf(stderr, "failed to modify QP state to RTS\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        device->rmrs[i].addr = dest_addr;
-        device->rmrs[i].size = device->config.mr_size;
-        device->rmrs[i].rkey = dest_rkey;
-    }
-
-    int j = nranks;
-    int* b;
-    while (j < INT32_MAX) {
-        b = (int*)calloc(j, sizeof(int));
-        int i = 0;
-        for (; i < nranks; i++) {
-            int k = (device->qps[i]->qp_num % j);
-            if (b[k]) break;
-            b[k] = 1;
+    if (device->config.lazy_connect) {
+        publishBootstrap(device);
+        lap(INIT_PUBLISH);
+    } else {
+        // Use queue pair "i" to connect to rank i.
+        PeerAddr *peers = (PeerAddr*) malloc(nranks * sizeof(PeerAddr));
+        exchangeAddrs(device, peers, &profile);
+        t = initClock();
+        parallelFor(nranks, device->config.setup_threads, [device, peers](int i) {
+            connectQP(device, device->qps[i], peers[i].qpn, peers[i].lid);
+        });
+        for (int i = 0; i < nranks; i++) {
+            device->rmrs[i].addr = peers[i].addr;
+            device->rmrs[i].size = device->config.mr_size;
+            device->rmrs[i].rkey = peers[i].rkey;
         }
-        if (i == nranks) break;
-        j++;
-        free(b);
-    }
-    MLOG_Assert(j != INT32_MAX, "Cannot find a suitable mod to hold qp2rank map\n");
-    for (int i = 0; i < nranks; i++) {
-        b[device->qps[i]->qp_num % j] = i;
+        free(peers);
+        lap(INIT_CONNECT);
     }
-    device->qp2rank_mod = j;
-    device->qp2rank = b;
-    MLOG_Log(MLOG_LOG_INFO, "qp2rank_mod is %d\n", j);
+    buildQp2rank(device);
+    lap(INIT_QP2RANK);
 
     lcm_pm_barrier();
+    lap(INIT_BARRIER);
+    if (device->config.profile_init) {
+        reduceInitProfile(&profile);
+        if (print_profile && rank == 0) printInitProfile(profile, stderr);
+    }
 }
 
 void finalize(Device *device) {
+    RecvPool &pool = device->recv_pool;
+    if (pool.refill_running) {
+        __atomic_store_n(&pool.refill_stop, true, __ATOMIC_RELEASE);
+        pthread_join(pool.refill_thread, NULL);
+    }
 //    ibv_close_device(device->dev_ctx);
 //    ibv_free_device_list(device->dev_list);
     lcm_pm_finalize();
 }
 
-inline struct ibv_wc pollCQ(struct ibv_cq *cq) {
+// Add the device configuration and the device/port attributes to a result
+// record (anything with set(key, value), e.g. bench::Record).
+template<typename RECORD>
+void describeDevice(const Device *device, RECORD &record) {
+    const DeviceConfig &config = device->config;
+    record.set("device_config.send_inline", config.send_inline);
+    record.set("device_config.inline_size", config.inline_size);
+    record.set("device_config.max_send_num", config.max_send_num);
+    record.set("device_config.max_recv_num", config.max_recv_num);
+    record.set("device_config.min_recv_num", config.min_recv_num);
+    record.set("device_config.max_sge_num", config.max_sge_num);
+    record.set("device_config.max_cqe_num", config.max_cqe_num);
+    record.set("device_config.mr_size", config.mr_size);
+    record.set("device_config.post_batch", config.post_batch);
+    record.set("device_config.signal_interval", config.signal_interval);
+    record.set("device_config.recv_post_batch", config.recv_post_batch);
+    record.set("device_config.async_recv_refill", config.async_recv_refill);
+    record.set("device_config.packed_wireup", config.packed_wireup);
+    record.set("device_config.lazy_connect", config.lazy_connect);
+    record.set("device_config.profile_init", config.profile_init);
+    record.set("device_config.setup_threads", config.setup_threads);
+    const InitProfile &profile = device->init_profile;
+    if (profile.reduced) {
+        double total = 0;
+        for (int j = 0; j < INIT_NUM_PHASES; ++j) {
+            std::string name = std::string("init.") + INIT_PHASE_NAMES[j];
+            record.set(name + ".min_us", profile.min[j] * 1e6);
+            record.set(name + ".avg_us", profile.avg[j] * 1e6);
+            record.set(name + ".max_us", profile.max[j] * 1e6);
+            total += profile.avg[j];
+        }
+        record.set("init.total.avg_us", total * 1e6);
+    }
+
+    const struct ibv_device_attr &dev_attr = device->dev_attr;
+    record.set("device.name", ibv_get_device_name(device->ib_dev));
+    record.set("device.fw_ver", dev_attr.fw_ver);
+    record.set("device.vendor_id", dev_attr.vendor_id);
+    record.set("device.vendor_part_id", dev_attr.vendor_part_id);
+    record.set("device.max_mr_size", dev_attr.max_mr_size);
+    record.set("device.max_qp", dev_attr.max_qp);
+    record.set("device.max_qp_wr", dev_attr.max_qp_wr);
+    record.set("device.max_sge", dev_attr.max_sge);
+    record.set("device.max_cq", dev_attr.max_cq);
+    record.set("device.max_cqe", dev_attr.max_cqe);
+    record.set("device.max_srq_wr", dev_attr.max_srq_wr);
+    record.set("device.max_qp_rd_atom", dev_attr.max_qp_rd_atom);
+
+    const struct ibv_port_attr &port_attr = device->port_attr;
+    record.set("port.num", (int) device->dev_port);
+    record.set("port.state", ibv_port_state_str(port_attr.state));
+    record.set("port.max_mtu", mtu_str(port_attr.max_mtu));
+    record.set("port.active_mtu", mtu_str(port_attr.active_mtu));
+    record.set("port.lid", port_attr.lid);
+    record.set("port.link_layer", port_attr.link_layer == IBV_LINK_LAYER_ETHERNET ? "ethernet" : "infiniband");
+    record.set("port.active_width", (int) port_attr.active_width);
+    record.set("port.active_speed", (int) port_attr.active_speed);
+}
+
+// Maximum of value over all ranks, through the PMI key-value store.
+// Collective; meant for the rare decisions outside the timed loops.
+inline int pmAllreduceMax(int value) {
+    static int round = 0;
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    char key[256];
+    char buf[256];
+    sprintf(key, "ibvBench_max_%d_%d", round, rank);
+    sprintf(buf, "%d", value);
+    lcm_pm_publish(key, buf);
+    lcm_pm_barrier();
+    for (int i = 0; i < nranks; ++i) {
+        sprintf(key, "ibvBench_max_%d_%d", round, i);
+        lcm_pm_getname_rank(i, key, buf);
+        value = std::max(value, atoi(buf));
+    }
+    ++round;
+    return value;
+}
+
+// Slowest rank of a time, in seconds. PMI only reduces integers, so the time
+// travels as a count of unit (microseconds by default; an int of them
+// overflows past 2147 s, one of nanoseconds past 2.1 s).
+inline double pmAllreduceMaxSeconds(double seconds, double unit = 1e-6) {
+    return pmAllreduceMax((int) (seconds / unit)) * unit;
+}
+
+// Yield the core after max_spin consecutive empty polls (0 means never yield).
+// With lazy_connect, also serves the connection requests of other ranks.
+inline void spinOrYield(Device *device, int max_spin, int *nspin) {
+    if (device->config.lazy_connect) progressConnections(device);
+    if (max_spin > 0 && ++*nspin >= max_spin) {
+        sched_yield();
+        *nspin = 0;
+    }
+}
+
+inline struct ibv_wc pollCQ(Device *device, struct ibv_cq *cq, int max_spin = 0) {
     int ne;
+    int nspin = 0;
     struct ibv_wc wc;
     do {
         ne = ibv_poll_cq(cq, 1, &wc);
         MLOG_Assert(ne >= 0, "Poll CQ failed %d\n", ne);
+        if (ne == 0) spinOrYield(device, max_spin, &nspin);
     } while (ne == 0);
     return wc;
 }
 
+// Drain up to max_entries completions with a single ibv_poll_cq call into
+// the caller-provided wcs array and hand each of them to f.
+// Return the number handled, possibly 0. With lazy_connect, also serves the
+// connection requests of other ranks, so a busy-polling rank answers them.
+template<typename FUNC>
+inline int tryPollCQBatch(Device *device, struct ibv_cq *cq, struct ibv_wc *wcs, int max_entries,
+                          FUNC &&f) {
+    if (device->config.lazy_connect) progressConnections(device);
+    int ne = ibv_poll_cq(cq, max_entries, wcs);
+    MLOG_Assert(ne >= 0, "Poll CQ failed %d\n", ne);
+    for (int i = 0; i < ne; ++i) {
+        f(wcs[i]);
+    }
+    return ne;
+}
+
+// Same as tryPollCQBatch, but spin until at least one completion arrives.
+template<typename FUNC>
+inline int pollCQBatch(Device *device, struct ibv_cq *cq, struct ibv_wc *wcs, int max_entries,
+                       FUNC &&f, int max_spin = 0) {
+    int ne;
+    int nspin = 0;
+    while ((ne = tryPollCQBatch(device, cq, wcs, max_entries, f)) == 0) {
+        spinOrYield(device, max_spin, &nspin);
+    }
+    return ne;
+}
+
+// Post all send WRs collected for rank as one linked chain.
+// Take back the send queue accounting of wrs[first, num), which
+// ibv_post_send did not post, the last one first.
+inline void unaccountSends(Device *device, int rank, const struct ibv_send_wr *wrs, int first, int num)
+{
+    if (device->config.signal_interval <= 1) return;
+    SendQueue &sq = device->send_queues[rank];
+    for (int i = num - 1; i >= first; --i) {
+        --sq.outstanding;
+        if (wrs[i].send_flags & IBV_SEND_SIGNALED) {
+            sq.tail = (sq.tail == 0 ? device->config.max_send_num : sq.tail) - 1;
+            sq.unsignaled = sq.retire[sq.tail] - 1;
+            // it may have been the one signalNext asked for
+            sq.force_signal = true;
+        } else {
+            --sq.unsignaled;
+        }
+    }
+}
+
+inline int flushSends(Device *device, int rank)
+{
+    SendBatch &batch = device->send_batches[rank];
+    if (batch.num == 0) return 0;
+    struct ibv_send_wr *bad_wr;
+    int ret = ibv_post_send(device->qps[rank], batch.wrs, &bad_wr);
+    if (ret != 0) unaccountSends(device, rank, batch.wrs, (int) (bad_wr - batch.wrs), batch.num);
+    batch.num = 0;
+    return ret;
+}
+
+inline int flushAllSends(Device *device)
+{
+    int nranks = lcm_pm_get_size();
+    for (int i = 0; i < nranks; ++i) {
+        int ret = flushSends(device, i);
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+// Make the next send WR to rank signaled, e.g. the last one of a window.
+inline void signalNext(Device *device, int rank)
+{
+    device->send_queues[rank].force_signal = true;
+}
+
+// Account a completion from send_cq; return the number of send WRs it
+// retires. Required for every send completion when signal_interval > 1.
+inline int retireSends(Device *device, const struct ibv_wc &wc)
+{
+    if (device->config.signal_interval <= 1) return 1;
+    int rank = qpRank(device, wc.qp_num);
+    SendQueue &sq = device->send_queues[rank];
+    int n = sq.retire[sq.head];
+    if (++sq.head == device->config.max_send_num) sq.head = 0;
+    sq.outstanding -= n;
+    return n;
+}
+
+// Post a single-sge send WR, or append it to the batch of rank when
+// config.post_batch > 1. A full batch is flushed automatically; otherwise
+// the caller has to flush before waiting for the completion. Buffers of
+// inline WRs are only copied at flush time.
+// With signal_interval > 1, the wr_id of unsignaled WRs is never reported
+// and ENOMEM is returned while max_send_num WRs are not retired. WRs that
+// fail to post are not accounted.
+inline int postSendWR(Device *device, int rank, struct ibv_send_wr *wr)
+{
+    if (!device->qps[rank]) connectRank(device, rank);
+    if (device->config.signal_interval > 1) {
+        SendQueue &sq = device->send_queues[rank];
+        if (sq.outstanding >= device->config.max_send_num) return ENOMEM;
+        ++sq.outstanding;
+        // a full send queue needs a signaled WR to ever retire
+        if (++sq.unsignaled >= device->config.signal_interval || sq.force_signal ||
+            sq.outstanding == device->config.max_send_num) {
+            wr->send_flags |= IBV_SEND_SIGNALED;
+            sq.retire[sq.tail] = sq.unsignaled;
+            if (++sq.tail == device->config.max_send_num) sq.tail = 0;
+            sq.unsignaled = 0;
+            sq.force_signal = false;
+        } else {
+            wr->send_flags &= ~IBV_SEND_SIGNALED;
+        }
+    }
+    if (device->config.post_batch <= 1) {
+        struct ibv_send_wr *bad_wr;
+        int ret = ibv_post_send(device->qps[rank], wr, &bad_wr);
+        if (ret != 0) unaccountSends(device, rank, wr, 0, 1);
+        return ret;
+    }
+    SendBatch &batch = device->send_batches[rank];
+    int i = batch.num++;
+    batch.sges[i] = *wr->sg_list;
+    batch.wrs[i] = *wr;
+    batch.wrs[i].sg_list = &batch.sges[i];
+    if (i > 0) batch.wrs[i - 1].next = &batch.wrs[i];
+    if (batch.num >= device->config.post_batch) {
+        return flushSends(device, rank);
+    }
+    return 0;
+}
+
 inline int postRecv(Device *device, void *buf, uint32_t size, uint32_t lkey, void *user_context)
 {
     MLOG_DBG_Log(MLOG_LOG_DEBUG, "postRecv: %p %u %u %p\n", buf,
@@ -402,6 +1399,165 @@ inline int postRecv(Device *device, void *buf, uint32_t size, uint32_t lkey, voi
     return ibv_post_srq_recv(device->dev_srq, &wr, &bad_wr);
 }
 
+// Post all free slots of the receive pool as linked chains of
+// recv_post_batch WRs.
+inline int postFreeRecvs(Device *device)
+{
+    RecvPool &pool = device->recv_pool;
+    int chain = device->config.recv_post_batch > 0 ? device->config.recv_post_batch : pool.num_free;
+    while (pool.num_free > 0) {
+        int num = std::min(chain, pool.num_free);
+        for (int i = 0; i < num; ++i) {
+            int slot = pool.free_slots[--pool.num_free];
+            pool.sges[i].addr = (uint64_t) (pool.base + (size_t) slot * pool.slot_size);
+            pool.sges[i].length = pool.slot_size;
+            pool.sges[i].lkey = pool.lkey;
+            pool.wrs[i].wr_id = slot;
+            pool.wrs[i].next = i + 1 < num ? &pool.wrs[i + 1] : NULL;
+            pool.wrs[i].sg_list = &pool.sges[i];
+            pool.wrs[i].num_sge = 1;
+        }
+        struct ibv_recv_wr *bad_wr;
+        int ret = ibv_post_srq_recv(device->dev_srq, pool.wrs, &bad_wr);
+        if (ret != 0) return ret;
+        __atomic_add_fetch(&device->posted_recv_num, num, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Post the free slots of the receive pool once fewer than min_recv_num
+// receives are outstanding. Left to the helper thread with async_recv_refill.
+inline int refillRecvs(Device *device)
+{
+    if (device->config.async_recv_refill ||
+        device->posted_recv_num >= device->config.min_recv_num)
+        return 0;
+    return postFreeRecvs(device);
+}
+
+// (Re-)arm the SRQ limit: the next receive that leaves fewer than
+// min_recv_num WQEs posted raises IBV_EVENT_SRQ_LIMIT_REACHED.
+inline int armRecvLimit(Device *device)
+{
+    struct ibv_srq_attr attr = {};
+    attr.srq_limit = device->config.min_recv_num;
+    return ibv_modify_srq(device->dev_srq, &attr, IBV_SRQ_LIMIT);
+}
+
+// async_recv_refill: move the slots released by releaseRecv to
+// free_slots. Helper thread only; return the number moved.
+inline int collectReleased(Device *device)
+{
+    RecvPool &pool = device->recv_pool;
+    uint32_t size = device->config.max_recv_num + 1;
+    uint32_t head = pool.released_head;
+    uint32_t tail = __atomic_load_n(&pool.released_tail, __ATOMIC_ACQUIRE);
+    int num = 0;
+    for (; head != tail; ++num) {
+        pool.free_slots[pool.num_free++] = pool.released[head];
+        if (++head == size) head = 0;
+    }
+    __atomic_store_n(&pool.released_head, head, __ATOMIC_RELEASE);
+    return num;
+}
+
+// Helper thread of async_recv_refill: wait for the SRQ limit event, repost
+// the released slots in bulk and re-arm the limit.
+inline void *recvRefillThread(void *arg)
+{
+    Device *device = (Device*) arg;
+    RecvPool &pool = device->recv_pool;
+    int min_recv_num = device->config.min_recv_num;
+    struct pollfd pfd = {device->dev_ctx->async_fd, POLLIN, 0};
+    // The SRQ is below the limit and no slot could be reposted: no event is
+    // due until some are, so look for released slots soon.
+    bool low = false;
+    while (!__atomic_load_n(&pool.refill_stop, __ATOMIC_ACQUIRE)) {
+        // time out now and then to notice refill_stop
+        if (poll(&pfd, 1, low ? 1 : 100) > 0) {
+            struct ibv_async_event event;
+            if (ibv_get_async_event(device->dev_ctx, &event) == 0) {
+                if (event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED) {
+                    low = true;
+                } else {
+                    MLOG_Log(MLOG_LOG_WARN, "Unexpected async event: %s\n",
+                             ibv_event_type_str(event.event_type));
+                }
+                ibv_ack_async_event(&event);
+            }
+        }
+        if (!low) continue;
+        int moved = collectReleased(device);
+        if (moved == 0) continue;
+        // The receives that drop the SRQ below the limit before it is
+        // re-armed raise no event: check the count again after arming.
+        do {
+            int ret = postFreeRecvs(device);
+            MLOG_Assert(ret == 0, "Post Recv failed!\n");
+            ret = armRecvLimit(device);
+            MLOG_Assert(ret == 0, "Arming the SRQ limit failed!\n");
+        } while (__atomic_load_n(&device->posted_recv_num, __ATOMIC_RELAXED) < min_recv_num &&
+                 collectReleased(device) > 0);
+        low = __atomic_load_n(&device->posted_recv_num, __ATOMIC_RELAXED) < min_recv_num;
+    }
+    return NULL;
+}
+
+// Split buf (registered with lkey, max_recv_num * slot_size bytes) into
+// the receive slots and post them. Completions of these receives carry
+// their slot in wr_id: use recvBuf to find the data and releaseRecv to
+// return the slot before the next refillRecvs.
+inline void initRecvPool(Device *device, void *buf, uint32_t slot_size, uint32_t lkey)
+{
+    RecvPool &pool = device->recv_pool;
+    int num = device->config.max_recv_num;
+    pool.base = (char*) buf;
+    pool.slot_size = slot_size;
+    pool.lkey = lkey;
+    pool.free_slots = (int*) malloc(num * sizeof(int));
+    for (int i = 0; i < num; ++i)
+        pool.free_slots[i] = num - 1 - i;
+    pool.num_free = num;
+    posix_memalign((void**)&pool.wrs, CACHE_LINE_SIZE, num * sizeof(struct ibv_recv_wr));
+    posix_memalign((void**)&pool.sges, CACHE_LINE_SIZE, num * sizeof(struct ibv_sge));
+    int ret = postFreeRecvs(device);
+    MLOG_Assert(ret == 0, "Post Recv failed!\n");
+    if (device->config.async_recv_refill) {
+        MLOG_Assert(device->config.min_recv_num > 0 && device->config.min_recv_num < num,
+                    "async_recv_refill needs 0 < min_recv_num < max_recv_num\n");
+        int flags = fcntl(device->dev_ctx->async_fd, F_GETFL);
+        fcntl(device->dev_ctx->async_fd, F_SETFL, flags | O_NONBLOCK);
+        pool.released = (int*) malloc((num + 1) * sizeof(int));
+        pool.released_head = pool.released_tail = 0;
+        ret = armRecvLimit(device);
+        MLOG_Assert(ret == 0, "Arming the SRQ limit failed!\n");
+        ret = pthread_create(&pool.refill_thread, NULL, recvRefillThread, device);
+        MLOG_Assert(ret == 0, "Cannot start the receive refill thread!\n");
+        pool.refill_running = true;
+    }
+}
+
+inline void *recvBuf(Device *device, const struct ibv_wc &wc)
+{
+    return device->recv_pool.base + (size_t) wc.wr_id * device->recv_pool.slot_size;
+}
+
+inline void releaseRecv(Device *device, const struct ibv_wc &wc)
+{
+    RecvPool &pool = device->recv_pool;
+    if (device->config.async_recv_refill) {
+        // the ring cannot overflow: it holds at most the max_recv_num slots
+        uint32_t tail = pool.released_tail;
+        pool.released[tail] = (int) wc.wr_id;
+        if (++tail == (uint32_t) device->config.max_recv_num + 1) tail = 0;
+        __atomic_store_n(&pool.released_tail, tail, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&device->posted_recv_num, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    pool.free_slots[pool.num_free++] = (int) wc.wr_id;
+    --device->posted_recv_num;
+}
+
 inline void checkAndPostRecvs(Device *device, void *buf, uint32_t size, uint32_t lkey, void *user_context) {
     if (device->posted_recv_num < device->config.min_recv_num) {
         for (int j = device->posted_recv_num; j < device->config.max_recv_num; ++j) {
@@ -429,9 +1585,8 @@ inline int postSend(Device *device, int rank, void *buf, uint32_t size, uint32_t
     if (device->config.send_inline && size <= device->config.inline_size) {
         wr.send_flags |= IBV_SEND_INLINE;
     }
-    struct ibv_send_wr *bad_wr;
 
-    return ibv_post_send(device->qps[rank], &wr, &bad_wr);
+    return postSendWR(device, rank, &wr);
 }
 
 inline int postSendImm(Device *device, int rank, void *buf, uint32_t size,
@@ -454,9 +1609,8 @@ inline int postSendImm(Device *device, int rank, void *buf, uint32_t size,
     if (device->config.send_inline && size <= device->config.inline_size) {
         wr.send_flags |= IBV_SEND_INLINE;
     }
-    struct ibv_send_wr *bad_wr;
 
-    return ibv_post_send(device->qps[rank], &wr, &bad_wr);
+    return postSendWR(device, rank, &wr);
 }
 
 inline int postWrite(Device *device, int rank, void *buf, uint32_t size, uint32_t lkey,
@@ -480,9 +1634,8 @@ inline int postWrite(Device *device, int rank, void *buf, uint32_t size, uint32_
     if (device->config.send_inline && size <= device->config.inline_size) {
         wr.send_flags |= IBV_SEND_INLINE;
     }
-    struct ibv_send_wr *bad_wr;
 
-    return ibv_post_send(device->qps[rank], &wr, &bad_wr);
+    return postSendWR(device, rank, &wr);
 }
 
 inline int postWriteImm(Device *device, int rank, void *buf, uint32_t size, uint32_t lkey,
@@ -507,9 +1660,8 @@ inline int postWriteImm(Device *device, int rank, void *buf, uint32_t size, uint
     if (device->config.send_inline && size <= device->config.inline_size) {
         wr.send_flags |= IBV_SEND_INLINE;
     }
-    struct ibv_send_wr *bad_wr;
 
-    return ibv_post_send(device->qps[rank], &wr, &bad_wr);
+    return postSendWR(device, rank, &wr);
 }
 
 inline int postRead(Device *device, int rank, void *buf, uint32_t size, uint32_t lkey,
@@ -530,9 +1682,8 @@ inline int postRead(Device *device, int rank, void *buf, uint32_t size, uint32_t
     wr.send_flags = IBV_SEND_SIGNALED;
     wr.wr.rdma.remote_addr = remote_addr;
     wr.wr.rdma.rkey = rkey;
-    struct ibv_send_wr *bad_wr;
 
-    return ibv_post_send(device->qps[rank], &wr, &bad_wr);
+    return postSendWR(device, rank, &wr);
 }
 } // namespace ibv
 #endif//IBVBENCH_IBV_COMMON_HPP
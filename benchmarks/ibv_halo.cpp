@@ -0,0 +1,214 @@
+#include <vector>
+#include <algorithm>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+const int MAX_NEIGHBORS = 26;
+
+struct Config {
+    bool lazy_connect = true;
+    int msg_size = 8;
+    int iterations = 1000;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"connect",      required_argument, 0, 'c'},
+            {"msg-size",     required_argument, 0, 'm'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "m:n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                if (strcmp(optarg, "lazy") == 0) {
+                    config.lazy_connect = true;
+                } else if (strcmp(optarg, "eager") == 0) {
+                    config.lazy_connect = false;
+                } else {
+                    fprintf(stderr, "Unknown connection mode %s (lazy or eager)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                config.msg_size = atoi(optarg);
+                break;
+            case 'n':
+                config.iterations = atoi(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.connect", config.lazy_connect ? "lazy" : "eager");
+    result_context.set("config.msg_size", config.msg_size);
+    result_context.set("config.iterations", config.iterations);
+}
+
+// Split nranks into a px * py * pz grid, as square as possible.
+void gridDims(int nranks, int dims[3]) {
+    dims[0] = dims[1] = dims[2] = 1;
+    int n = nranks;
+    vector<int> factors;
+    for (int f = 2; f * f <= n; ++f) {
+        while (n % f == 0) {
+            factors.push_back(f);
+            n /= f;
+        }
+    }
+    if (n > 1) factors.push_back(n);
+    // largest factor first, into the smallest dimension
+    for (auto it = factors.rbegin(); it != factors.rend(); ++it)
+        *min_element(dims, dims + 3) *= *it;
+}
+
+// The (up to) MAX_NEIGHBORS ranks around this one on a periodic 3D grid.
+vector<int> stencilNeighbors(int rank, int nranks) {
+    int dims[3];
+    gridDims(nranks, dims);
+    int x = rank % dims[0], y = rank / dims[0] % dims[1], z = rank / (dims[0] * dims[1]);
+    vector<int> neighbors;
+    for (int dz = -1; dz <= 1; ++dz)
+        for (int dy = -1; dy <= 1; ++dy)
+            for (int dx = -1; dx <= 1; ++dx) {
+                int nx = (x + dx + dims[0]) % dims[0];
+                int ny = (y + dy + dims[1]) % dims[1];
+                int nz = (z + dz + dims[2]) % dims[2];
+                int peer = nx + dims[0] * (ny + dims[1] * nz);
+                if (peer != rank) neighbors.push_back(peer);
+            }
+    sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(unique(neighbors.begin(), neighbors.end()), neighbors.end());
+    return neighbors;
+}
+
+// Stencil-style halo exchange: every iteration, each rank sends one message
+// to each of its (up to 26) neighbors on a periodic 3D grid and waits for
+// theirs. With --connect=lazy the QP to a neighbor is created by the first
+// send to it, so the first exchange includes the connection setup; with
+// --connect=eager init connects every rank. Reported: the time of init and
+// of the first exchange, the mean time of the later exchanges, and the QPs
+// and pinned memory (buffers and queues) of the rank that uses the most.
+int run(Config config) {
+    MLOG_Assert(config.msg_size > 0 && config.iterations > 0,
+                "msg-size and iterations must be positive\n");
+    ibv::Device device;
+    ibv::DeviceConfig deviceConfig;
+    deviceConfig.lazy_connect = config.lazy_connect;
+    // a neighbor can be at most one exchange ahead
+    deviceConfig.min_recv_num = 2 * MAX_NEIGHBORS;
+    deviceConfig.max_recv_num = 4 * MAX_NEIGHBORS;
+    deviceConfig.max_cqe_num = deviceConfig.max_recv_num + MAX_NEIGHBORS;
+    deviceConfig.mr_size = config.msg_size * (1 + deviceConfig.max_recv_num);
+    double t0 = wtime();
+    ibv::init(NULL, &device, deviceConfig);
+    double init_time = wtime() - t0;
+    ibv::describeDevice(&device, result_context);
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    vector<int> neighbors = stencilNeighbors(rank, nranks);
+    int num_neighbors = (int) neighbors.size();
+    void *send_buf = device.mr_addr;
+    ibv::initRecvPool(&device, (char*) device.mr_addr + config.msg_size, config.msg_size,
+                      device.dev_mr->lkey);
+    vector<struct ibv_wc> wcs(16);
+    // messages received from each rank so far: a neighbor may already be
+    // one exchange ahead, so its next message can arrive before ours ends
+    vector<int> arrived(nranks, 0);
+    int round = 0;
+
+    auto exchange = [&]() {
+        ++round;
+        for (int peer : neighbors) {
+            int ret = ibv::postSend(&device, peer, send_buf, config.msg_size, device.dev_mr->lkey, NULL);
+            MLOG_Assert(ret == 0, "Post Send failed!");
+        }
+        int sent = 0, received = 0;
+        for (int peer : neighbors)
+            if (arrived[peer] >= round) ++received;
+        while (sent < num_neighbors || received < num_neighbors) {
+            int ne = ibv::tryPollCQBatch(&device, device.send_cq, wcs.data(), (int) wcs.size(),
+                                         [&](const struct ibv_wc &wc) {
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!");
+                ++sent;
+            });
+            ne += ibv::tryPollCQBatch(&device, device.recv_cq, wcs.data(), (int) wcs.size(),
+                                      [&](const struct ibv_wc &wc) {
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV &&
+                            wc.byte_len == (uint32_t) config.msg_size, "Recv completion failed!");
+                int src_rank = ibv::qpRank(&device, wc.qp_num);
+                if (++arrived[src_rank] == round) ++received;
+                ibv::releaseRecv(&device, wc);
+            });
+            ibv::refillRecvs(&device);
+            if (ne == 0) {
+                // serves the connection requests of the other ranks
+                int nspin = 0;
+                ibv::spinOrYield(&device, 0, &nspin);
+            }
+        }
+    };
+
+    ibv::barrier(&device);
+    t0 = wtime();
+    exchange();
+    double first_time = wtime() - t0;
+    t0 = wtime();
+    for (int i = 0; i < config.iterations; ++i)
+        exchange();
+    double exchange_time = (wtime() - t0) / config.iterations;
+
+    init_time = ibv::pmAllreduceMaxSeconds(init_time);
+    first_time = ibv::pmAllreduceMaxSeconds(first_time);
+    exchange_time = ibv::pmAllreduceMaxSeconds(exchange_time, 1e-9);
+    int num_qps = ibv::pmAllreduceMax(device.num_qps);
+    // in KB: an int of bytes overflows at 2 GB
+    int pinned_kb = ibv::pmAllreduceMax((int) ((device.pinned_bytes + 1023) / 1024));
+    num_neighbors = ibv::pmAllreduceMax(num_neighbors);
+    if (rank == 0) {
+        if (output_format != OutputFormat::TABLE) {
+            Record stats;
+            stats.set("nranks", nranks);
+            stats.set("neighbors", num_neighbors);
+            stats.set("init_s", init_time);
+            stats.set("first_exchange_s", first_time);
+            stats.set("exchange_us", exchange_time * 1e6);
+            stats.set("qps", num_qps);
+            stats.set("pinned_kb", pinned_kb);
+            emit_record(stats);
+        } else {
+            printf("%-10s %-10s %-12s %-12s %-12s %-10s %-10s\n", "Ranks", "Neighbors", "Init(s)",
+                   "First(s)", "Exchange(us)", "QPs", "Pinned(KB)");
+            printf("%-10d %-10d %-12.6f %-12.6f %-12.2f %-10d %-10d\n", nranks, num_neighbors, init_time,
+                   first_time, exchange_time * 1e6, num_qps, pinned_kb);
+        }
+    }
+
+    ibv::finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -8,6 +8,8 @@ struct Config {
     bool touch_data = true;
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
+    int batch = 1;
+    int signal_interval = 1;
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -19,8 +21,16 @@ Config parseArgs(int argc, char **argv) {
             {"min-msg-size", required_argument, 0, 'a'},
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
+            {"batch",        required_argument, 0, 'B'},
+            {"signal-interval", required_argument, 0, 'k'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
-    while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "t:B:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'a':
                 config.min_msg_size = atoi(optarg);
@@ -31,67 +41,121 @@ Config parseArgs(int argc, char **argv) {
             case 't':
                 config.touch_data = atoi(optarg);
                 break;
+            case 'B':
+                config.batch = atoi(optarg);
+                break;
+            case 'k':
+                config.signal_interval = atoi(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.batch", config.batch);
+    result_context.set("config.signal_interval", config.signal_interval);
+}
+
+// With --batch=B, every iteration issues a burst of B reads posted as one
+// linked chain.
 int run(Config config) {
+    MLOG_Assert(config.batch > 0, "batch must be positive\n");
     ibv::Device device;
     ibv::DeviceConfig deviceConfig;
-    deviceConfig.mr_size = config.max_msg_size;
+    // the data buffer, then a pool of receive buffers for the start/finish messages
+    deviceConfig.mr_size = config.max_msg_size + ibv::CACHE_LINE_SIZE * deviceConfig.max_recv_num;
+    deviceConfig.post_batch = config.batch;
+    deviceConfig.signal_interval = config.signal_interval;
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, config.batch);
+    deviceConfig.max_cqe_num = max(deviceConfig.max_cqe_num, config.batch);
     ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
     char value = 'a' + rank;
     char peer_value = 'a' + 1 - rank;
     volatile char *buf = (char*) device.mr_addr;
+    const ibv::RemoteMemRegion &remote_mr = ibv::remoteMR(&device, 1-rank);
     memset(device.mr_addr, 0, config.max_msg_size);
-    lcm_pm_barrier();
-    ibv::checkAndPostRecvs(&device, device.mr_addr, device.mr_size, device.dev_mr->lkey, device.mr_addr);
+    ibv::barrier(&device);
+    ibv::initRecvPool(&device, (char*) device.mr_addr + config.max_msg_size, ibv::CACHE_LINE_SIZE, device.dev_mr->lkey);
 
     if (rank == 0) {
         // wait for the start signal
-        struct ibv_wc wc = ibv::pollCQ(device.recv_cq);
+        struct ibv_wc wc = ibv::pollCQ(&device, device.recv_cq);
         MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!\b");
-        --device.posted_recv_num;
-        ibv::checkAndPostRecvs(&device, device.mr_addr, device.mr_size, device.dev_mr->lkey, device.mr_addr);
+        ibv::releaseRecv(&device, wc);
+        ibv::refillRecvs(&device);
 
         RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
             struct ibv_wc wc;
-            // post one read
+            // post a burst of reads
             if (config.touch_data) write_buffer((char*) device.mr_addr, msg_size, value);
-            int ret = ibv::postRead(&device, 1-rank, device.mr_addr, msg_size, device.dev_mr->lkey,
-                                     device.rmrs[1-rank].addr, device.rmrs[1-rank].rkey, NULL);
-            MLOG_Assert(ret == 0, "Post Read failed!");
+            for (int i = 0; i < config.batch; ++i) {
+                if (i == config.batch - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postRead(&device, 1-rank, device.mr_addr, msg_size, device.dev_mr->lkey,
+                                         remote_mr.addr, remote_mr.rkey, NULL);
+                MLOG_Assert(ret == 0, "Post Read failed!");
+            }
 
-            // wait for read to complete
-            wc = ibv::pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_READ, "Read completion failed! %d %d\n", wc.status, wc.opcode);
+            // wait for reads to complete
+            for (int i = 0; i < config.batch; ) {
+                wc = ibv::pollCQ(&device, device.send_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_READ, "Read completion failed! %d %d\n", wc.status, wc.opcode);
+                i += ibv::retireSends(&device, wc);
+            }
             if (config.touch_data) check_buffer((char*) device.mr_addr, msg_size, peer_value);
-        });
+        }, {0, 1}, {config.batch, true});
 
         // tell the other to finish
+        ibv::signalNext(&device, 1-rank);
         ibv::postSend(&device, 1-rank, device.mr_addr, ibv::CACHE_LINE_SIZE, device.dev_mr->lkey, NULL);
-        wc = ibv::pollCQ(device.send_cq);
+        ibv::flushSends(&device, 1-rank);
+        wc = ibv::pollCQ(&device, device.send_cq);
         MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!\n");
     } else {
         if (config.touch_data) write_buffer((char*) device.mr_addr, config.max_msg_size, value);
         // tell the other to start
+        ibv::signalNext(&device, 1-rank);
         ibv::postSend(&device, 1-rank, device.mr_addr, ibv::CACHE_LINE_SIZE, device.dev_mr->lkey, NULL);
-        struct ibv_wc wc = ibv::pollCQ(device.send_cq);
+        ibv::flushSends(&device, 1-rank);
+        struct ibv_wc wc = ibv::pollCQ(&device, device.send_cq);
         MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!\n");
         // wait for the finish signal
-        wc = ibv::pollCQ(device.recv_cq);
+        wc = ibv::pollCQ(&device, device.recv_cq);
         MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!\b");
-        --device.posted_recv_num;
-        ibv::checkAndPostRecvs(&device, device.mr_addr, device.mr_size, device.dev_mr->lkey, device.mr_addr);
+        ibv::releaseRecv(&device, wc);
+        ibv::refillRecvs(&device);
     }
 
-    lcm_pm_barrier();
+    ibv::barrier(&device);
     ibv::finalize(&device);
     return 0;
 }
@@ -99,6 +163,7 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
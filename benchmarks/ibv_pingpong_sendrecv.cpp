@@ -9,6 +9,11 @@ struct Config {
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
     int inline_size = 236;
+    int batch = 1;
+    int signal_interval = 1;
+    bool async_refill = false;
+    int recv_num = 0;
+    int recv_limit = 0;
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -21,8 +26,19 @@ Config parseArgs(int argc, char **argv) {
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
             {"inline-size",  required_argument, 0, 'i'},
+            {"batch",        required_argument, 0, 'B'},
+            {"signal-interval", required_argument, 0, 'k'},
+            {"recv-refill",  required_argument, 0, 'R'},
+            {"recv-num",     required_argument, 0, 'q'},
+            {"recv-limit",   required_argument, 0, 'l'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
-    while ((opt = getopt_long(argc, argv, "t:i:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "t:i:B:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'a':
                 config.min_msg_size = atoi(optarg);
@@ -36,19 +52,96 @@ Config parseArgs(int argc, char **argv) {
             case 'i':
                 config.inline_size = atoi(optarg);
                 break;
+            case 'B':
+                config.batch = atoi(optarg);
+                break;
+            case 'k':
+                config.signal_interval = atoi(optarg);
+                break;
+            case 'R':
+                if (strcmp(optarg, "inline") == 0) {
+                    config.async_refill = false;
+                } else if (strcmp(optarg, "async") == 0) {
+                    config.async_refill = true;
+                } else {
+                    fprintf(stderr, "Unknown receive refill mode %s (inline or async)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                config.recv_num = atoi(optarg);
+                break;
+            case 'l':
+                config.recv_limit = atoi(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.inline_size", config.inline_size);
+    result_context.set("config.batch", config.batch);
+    result_context.set("config.signal_interval", config.signal_interval);
+    result_context.set("config.recv_refill", config.async_refill ? "async" : "inline");
+    result_context.set("config.recv_num", config.recv_num);
+    result_context.set("config.recv_limit", config.recv_limit);
+}
+
+// With --batch=B, every ping and pong is a burst of B sends posted as one
+// linked chain.
+// --recv-num=N and --recv-limit=L size the receive pool (max_recv_num) and
+// its refill watermark (min_recv_num). With --recv-refill=async the pool is
+// refilled by a helper thread on IBV_EVENT_SRQ_LIMIT_REACHED instead of by
+// refillRecvs on the critical path; run both modes with the same N and L to
+// compare them (async defaults N to 2*L).
 int run(Config config) {
+    MLOG_Assert(config.batch > 0, "batch must be positive\n");
     ibv::Device device;
     ibv::DeviceConfig deviceConfig;
     deviceConfig.inline_size = config.inline_size;
-    deviceConfig.mr_size = config.max_msg_size * 2;
+    deviceConfig.post_batch = config.batch;
+    deviceConfig.signal_interval = config.signal_interval;
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, config.batch);
+    deviceConfig.min_recv_num = max(deviceConfig.min_recv_num, config.batch);
+    deviceConfig.max_recv_num = max(deviceConfig.max_recv_num, 2 * config.batch);
+    if (config.recv_limit > 0) deviceConfig.min_recv_num = config.recv_limit;
+    if (config.recv_num > 0)
+        deviceConfig.max_recv_num = config.recv_num;
+    else if (config.async_refill)
+        deviceConfig.max_recv_num = 2 * deviceConfig.min_recv_num;
+    deviceConfig.async_recv_refill = config.async_refill;
+    deviceConfig.max_cqe_num = deviceConfig.max_recv_num + 1;
+    // one send buffer and a pool of receive buffers
+    deviceConfig.mr_size = config.max_msg_size * (1 + deviceConfig.max_recv_num);
     ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    schedule.agree_max = ibv::pmAllreduceMax;
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
@@ -56,52 +149,68 @@ int run(Config config) {
     char peer_value = 'a' + 1 - rank;
     void *send_buf = (char*) device.mr_addr;
     void *recv_buf = (char*) device.mr_addr + config.max_msg_size;
-    ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
+    ibv::initRecvPool(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey);
 
     if (rank == 0) {
         RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
             struct ibv_wc wc;
-            // post one send
+            // post a burst of sends
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-            int ret = ibv::postSend(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey, NULL);
-            MLOG_Assert(ret == 0, "Post Send failed!");
+            for (int i = 0; i < config.batch; ++i) {
+                if (i == config.batch - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postSend(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey, NULL);
+                MLOG_Assert(ret == 0, "Post Send failed!");
+            }
 
-            // wait for send to complete
-            wc = ibv::pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!");
+            // wait for sends to complete
+            for (int i = 0; i < config.batch; ) {
+                wc = ibv::pollCQ(&device, device.send_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed!");
+                i += ibv::retireSends(&device, wc);
+            }
 
-            // wait for one recv to complete
-            wc = ibv::pollCQ(device.recv_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!");
+            // wait for a burst of recvs to complete
+            for (int i = 0; i < config.batch; ++i) {
+                wc = ibv::pollCQ(&device, device.recv_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!");
+                if (config.touch_data) check_buffer((char*) ibv::recvBuf(&device, wc), msg_size, peer_value);
+                ibv::releaseRecv(&device, wc);
+            }
             // optionally post recv buffers
-            --device.posted_recv_num;
-            ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
-            if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-        });
+            ibv::refillRecvs(&device);
+        }, {0, 1}, {config.batch, true});
     } else {
         RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
             int ne;
             struct ibv_wc wc;
-            // wait for one recv to complete
-            wc = ibv::pollCQ(device.recv_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV,
-                        "Recv completion failed!");
+            // wait for a burst of recvs to complete
+            for (int i = 0; i < config.batch; ++i) {
+                wc = ibv::pollCQ(&device, device.recv_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV,
+                            "Recv completion failed!");
+                if (config.touch_data) check_buffer((char*) ibv::recvBuf(&device, wc), msg_size, peer_value);
+                ibv::releaseRecv(&device, wc);
+            }
             // optionally post recv buffers
-            --device.posted_recv_num;
-            ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
-            if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
+            ibv::refillRecvs(&device);
 
-            // post one send
+            // post a burst of sends
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-            int ret = ibv::postSend(&device, 1 - rank, send_buf, msg_size,
-                          device.dev_mr->lkey, NULL);
-            MLOG_Assert(ret == 0, "Post Send failed!");
+            for (int i = 0; i < config.batch; ++i) {
+                if (i == config.batch - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postSend(&device, 1 - rank, send_buf, msg_size,
+                              device.dev_mr->lkey, NULL);
+                MLOG_Assert(ret == 0, "Post Send failed!");
+            }
 
-            // wait for send to complete
-            wc = ibv::pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND,
-                        "Send completion failed!");
-        });
+            // wait for sends to complete
+            for (int i = 0; i < config.batch; ) {
+                wc = ibv::pollCQ(&device, device.send_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND,
+                            "Send completion failed!");
+                i += ibv::retireSends(&device, wc);
+            }
+        }, {0, 1}, {config.batch, true});
     }
 
     ibv::finalize(&device);
@@ -111,6 +220,7 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
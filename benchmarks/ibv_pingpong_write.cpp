@@ -21,6 +21,12 @@ Config parseArgs(int argc, char **argv) {
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
             {"inline-size",  required_argument, 0, 'i'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
     while ((opt = getopt_long(argc, argv, "t:i:", long_options, NULL)) != -1) {
         switch (opt) {
@@ -36,19 +42,48 @@ Config parseArgs(int argc, char **argv) {
             case 'i':
                 config.inline_size = atoi(optarg);
                 break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.inline_size", config.inline_size);
+}
+
 int run(Config config) {
     ibv::Device device;
     ibv::DeviceConfig deviceConfig;
     deviceConfig.inline_size = config.inline_size;
     deviceConfig.mr_size = config.max_msg_size * 2;
     ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    schedule.agree_max = ibv::pmAllreduceMax;
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
@@ -56,11 +91,11 @@ int run(Config config) {
     char peer_value = 'a' + 1 - rank;
     void *send_buf = (char*) device.mr_addr;
     void *recv_buf = (char*) device.mr_addr + config.max_msg_size;
-    uintptr_t remote_recv_buf = (uintptr_t) device.rmrs[1-rank].addr + config.max_msg_size;
+    uintptr_t remote_recv_buf = (uintptr_t) ibv::remoteMR(&device, 1-rank).addr + config.max_msg_size;
     volatile char *buf = (char*) recv_buf;
     memset(send_buf, value, config.max_msg_size);
     memset(recv_buf, 0, config.max_msg_size);
-    lcm_pm_barrier();
+    ibv::barrier(&device);
     ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
 
     if (rank == 0) {
@@ -71,15 +106,17 @@ int run(Config config) {
             // post one write
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
             int ret = ibv::postWrite(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
-                                     remote_recv_buf, device.rmrs[1-rank].rkey, NULL);
+                                     remote_recv_buf, ibv::remoteMR(&device, 1-rank).rkey, NULL);
             MLOG_Assert(ret == 0, "Post Write failed!");
 
             // wait for write to complete
-            wc = ibv::pollCQ(device.send_cq);
+            wc = ibv::pollCQ(&device, device.send_cq);
             MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
 
             // wait for remote write to complete
-            while (!(buf[msg_size-1] == peer_value && buf[0] == peer_value)) continue;
+            int nspin = 0;
+            while (!(buf[msg_size-1] == peer_value && buf[0] == peer_value))
+                ibv::spinOrYield(&device, 0, &nspin);
             if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
         });
     } else {
@@ -87,7 +124,9 @@ int run(Config config) {
             int ne;
             struct ibv_wc wc;
             // wait for remote write to complete
-            while (!(buf[msg_size-1] == peer_value && buf[0] == peer_value)) continue;
+            int nspin = 0;
+            while (!(buf[msg_size-1] == peer_value && buf[0] == peer_value))
+                ibv::spinOrYield(&device, 0, &nspin);
             if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
 
             // post one write
@@ -95,16 +134,16 @@ int run(Config config) {
             buf[msg_size - 1] = value;
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
             int ret = ibv::postWrite(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
-                                   remote_recv_buf, device.rmrs[1-rank].rkey, NULL);
+                                   remote_recv_buf, ibv::remoteMR(&device, 1-rank).rkey, NULL);
             MLOG_Assert(ret == 0, "Post Write failed!");
 
             // wait for write to complete
-            wc = ibv::pollCQ(device.send_cq);
+            wc = ibv::pollCQ(&device, device.send_cq);
             MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
         });
     }
 
-    lcm_pm_barrier();
+    ibv::barrier(&device);
     ibv::finalize(&device);
     return 0;
 }
@@ -112,6 +151,7 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
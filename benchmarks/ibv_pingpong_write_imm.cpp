@@ -9,6 +9,8 @@ struct Config {
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
     int inline_size = 220;
+    int batch = 1;
+    int signal_interval = 1;
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -21,8 +23,16 @@ Config parseArgs(int argc, char **argv) {
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
             {"inline-size",  required_argument, 0, 'i'},
+            {"batch",        required_argument, 0, 'B'},
+            {"signal-interval", required_argument, 0, 'k'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
-    while ((opt = getopt_long(argc, argv, "t:i:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "t:i:B:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'a':
                 config.min_msg_size = atoi(optarg);
@@ -36,19 +46,65 @@ Config parseArgs(int argc, char **argv) {
             case 'i':
                 config.inline_size = atoi(optarg);
                 break;
+            case 'B':
+                config.batch = atoi(optarg);
+                break;
+            case 'k':
+                config.signal_interval = atoi(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+    result_context.set("config.inline_size", config.inline_size);
+    result_context.set("config.batch", config.batch);
+    result_context.set("config.signal_interval", config.signal_interval);
+}
+
+// With --batch=B, every ping and pong is a burst of B writes posted as one
+// linked chain.
 int run(Config config) {
+    MLOG_Assert(config.batch > 0, "batch must be positive\n");
     ibv::Device device;
     ibv::DeviceConfig deviceConfig;
     deviceConfig.inline_size = config.inline_size;
     deviceConfig.mr_size = config.max_msg_size * 2;
+    deviceConfig.post_batch = config.batch;
+    deviceConfig.signal_interval = config.signal_interval;
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, config.batch);
+    deviceConfig.min_recv_num = max(deviceConfig.min_recv_num, config.batch);
+    deviceConfig.max_recv_num = max(deviceConfig.max_recv_num, 2 * config.batch);
+    deviceConfig.max_cqe_num = deviceConfig.max_recv_num + 1;
     ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    schedule.agree_max = ibv::pmAllreduceMax;
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
@@ -56,57 +112,74 @@ int run(Config config) {
     char peer_value = 'a' + 1 - rank;
     void *send_buf = (char*) device.mr_addr;
     void *recv_buf = (char*) device.mr_addr + config.max_msg_size;
-    uintptr_t remote_recv_buf = (uintptr_t) device.rmrs[1-rank].addr + config.max_msg_size;
-    lcm_pm_barrier();
-    ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
+    uintptr_t remote_recv_buf = (uintptr_t) ibv::remoteMR(&device, 1-rank).addr + config.max_msg_size;
+    ibv::barrier(&device);
+    // the data arrives by RDMA write, the receives only take the immediates
+    ibv::initRecvPool(&device, recv_buf, 0, device.dev_mr->lkey);
 
     if (rank == 0) {
         RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
             struct ibv_wc wc;
-            // post one write
+            // post a burst of writes
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-            int ret = ibv::postWriteImm(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
-                                     remote_recv_buf, device.rmrs[1-rank].rkey, 77 + rank, NULL);
-            MLOG_Assert(ret == 0, "Post Write failed!");
+            for (int i = 0; i < config.batch; ++i) {
+                if (i == config.batch - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postWriteImm(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
+                                         remote_recv_buf, ibv::remoteMR(&device, 1-rank).rkey, 77 + rank, NULL);
+                MLOG_Assert(ret == 0, "Post Write failed!");
+            }
 
-            // wait for write to complete
-            wc = ibv::pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
+            // wait for writes to complete
+            for (int i = 0; i < config.batch; ) {
+                wc = ibv::pollCQ(&device, device.send_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
+                i += ibv::retireSends(&device, wc);
+            }
 
-            // wait for remote write to complete
-            wc = ibv::pollCQ(device.recv_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM, "Recv completion failed!");
+            // wait for remote writes to complete
+            for (int i = 0; i < config.batch; ++i) {
+                wc = ibv::pollCQ(&device, device.recv_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM, "Recv completion failed!");
+                ibv::releaseRecv(&device, wc);
+            }
             // optionally post recv buffers
-            --device.posted_recv_num;
-            ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
+            ibv::refillRecvs(&device);
             if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-        });
+        }, {0, 1}, {config.batch, true});
     } else {
         RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
             int ne;
             struct ibv_wc wc;
-            // wait for one recv to complete
-            wc = ibv::pollCQ(device.recv_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM,
-                      "Recv completion failed!");
+            // wait for a burst of recvs to complete
+            for (int i = 0; i < config.batch; ++i) {
+                wc = ibv::pollCQ(&device, device.recv_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM,
+                          "Recv completion failed!");
+                ibv::releaseRecv(&device, wc);
+            }
             // optionally post recv buffers
-            --device.posted_recv_num;
-            ibv::checkAndPostRecvs(&device, recv_buf, config.max_msg_size, device.dev_mr->lkey, recv_buf);
+            ibv::refillRecvs(&device);
             if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
 
-            // post one write
+            // post a burst of writes
             if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-            int ret = ibv::postWriteImm(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
-                                   remote_recv_buf, device.rmrs[1-rank].rkey, 77 + rank, NULL);
-            MLOG_Assert(ret == 0, "Post Write failed!");
+            for (int i = 0; i < config.batch; ++i) {
+                if (i == config.batch - 1) ibv::signalNext(&device, 1-rank);
+                int ret = ibv::postWriteImm(&device, 1-rank, send_buf, msg_size, device.dev_mr->lkey,
+                                       remote_recv_buf, ibv::remoteMR(&device, 1-rank).rkey, 77 + rank, NULL);
+                MLOG_Assert(ret == 0, "Post Write failed!");
+            }
 
-            // wait for write to complete
-            wc = ibv::pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
-        });
+            // wait for writes to complete
+            for (int i = 0; i < config.batch; ) {
+                wc = ibv::pollCQ(&device, device.send_cq);
+                MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Send completion failed!");
+                i += ibv::retireSends(&device, wc);
+            }
+        }, {0, 1}, {config.batch, true});
     }
 
-    lcm_pm_barrier();
+    ibv::barrier(&device);
     ibv::finalize(&device);
     return 0;
 }
@@ -114,6 +187,7 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
@@ -0,0 +1,199 @@
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+enum class QpnLayout { SEQUENTIAL, STRIDED, RANDOM };
+// HCA shared by this many processes: each one gets every STRIDE-th QPN.
+const uint32_t STRIDE = 64;
+
+struct Config {
+    vector<size_t> sizes = {1000, 10000, 100000};
+    QpnLayout layout = QpnLayout::STRIDED;
+    int lookups = 10000000;
+    // give up the modulo search beyond max_mod_factor * #QPs
+    int max_mod_factor = 4;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"sizes",        required_argument, 0, 'S'},
+            {"qpn",          required_argument, 0, 'q'},
+            {"lookups",      required_argument, 0, 'n'},
+            {"max-mod-factor", required_argument, 0, 'f'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'S':
+                config.sizes = parse_sizes(optarg);
+                break;
+            case 'q':
+                if (strcmp(optarg, "sequential") == 0) {
+                    config.layout = QpnLayout::SEQUENTIAL;
+                } else if (strcmp(optarg, "strided") == 0) {
+                    config.layout = QpnLayout::STRIDED;
+                } else if (strcmp(optarg, "random") == 0) {
+                    config.layout = QpnLayout::RANDOM;
+                } else {
+                    fprintf(stderr, "Unknown QPN layout %s (sequential, strided or random)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                config.lookups = atoi(optarg);
+                break;
+            case 'f':
+                config.max_mod_factor = atoi(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+const char *layoutName(QpnLayout layout) {
+    switch (layout) {
+        case QpnLayout::SEQUENTIAL: return "sequential";
+        case QpnLayout::STRIDED: return "strided";
+        default: return "random";
+    }
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.qpn", layoutName(config.layout));
+    result_context.set("config.lookups", config.lookups);
+    result_context.set("config.max_mod_factor", config.max_mod_factor);
+}
+
+// Distinct 24-bit QPNs, the one of rank i at index i.
+vector<uint32_t> makeQpns(size_t num, QpnLayout layout, mt19937 &gen) {
+    vector<uint32_t> qpns(num);
+    uint32_t first = 0x100 + gen() % 0x1000;
+    if (layout == QpnLayout::RANDOM) {
+        vector<uint32_t> all(1 << 24);
+        for (uint32_t i = 0; i < all.size(); ++i) all[i] = i;
+        for (size_t i = 0; i < num; ++i) {
+            swap(all[i], all[i + gen() % (all.size() - i)]);
+            qpns[i] = all[i];
+        }
+    } else {
+        uint32_t stride = layout == QpnLayout::STRIDED ? STRIDE : 1;
+        for (size_t i = 0; i < num; ++i)
+            qpns[i] = (first + i * stride) & 0xffffff;
+    }
+    return qpns;
+}
+
+// The former qp2rank: the smallest modulus (at least the number of QPs)
+// under which the QPNs do not collide, searched up to max_mod. Returns the
+// modulus, or 0 if there is none.
+int modSearch(const vector<uint32_t> &qpns, int max_mod, vector<int> *table) {
+    int n = (int) qpns.size();
+    for (int j = n; j <= max_mod; ++j) {
+        int *b = (int*) calloc(j, sizeof(int));
+        int i = 0;
+        for (; i < n; i++) {
+            int k = qpns[i] % j;
+            if (b[k]) break;
+            b[k] = 1;
+        }
+        free(b);
+        if (i == n) {
+            table->assign(j, 0);
+            for (i = 0; i < n; i++) (*table)[qpns[i] % j] = i;
+            return j;
+        }
+    }
+    return 0;
+}
+
+// Build time and lookup cost of the QPN -> rank map (ibv::Qp2Rank) at
+// every --sizes number of QPs, against the former modulo search. The
+// QPNs of one process are sequential, or strided as when STRIDE processes
+// share the HCA, or random. Lookups go in random order, as completions of
+// many peers would.
+int run(Config config) {
+    MLOG_Assert(config.lookups > 0, "lookups must be positive\n");
+    mt19937 gen(1);
+    bool header = false;
+    for (size_t num : config.sizes) {
+        MLOG_Assert(num > 0 && num < (1 << 23), "number of QPs must be in (0, 2^23)\n");
+        vector<uint32_t> qpns = makeQpns(num, config.layout, gen);
+        vector<uint32_t> order(config.lookups);
+        for (auto &qpn : order) qpn = qpns[gen() % num];
+
+        double t0 = wtime();
+        ibv::Qp2Rank table;
+        ibv::qp2rankInit(&table, (int) num);
+        for (size_t i = 0; i < num; ++i)
+            ibv::qp2rankInsert(&table, qpns[i], (int) i);
+        double build_time = wtime() - t0;
+        for (size_t i = 0; i < num; ++i)
+            MLOG_Assert(ibv::qp2rankLookup(table, qpns[i]) == (int) i, "Lookup of QPN %u failed\n", qpns[i]);
+        long sum = 0;
+        t0 = wtime();
+        for (uint32_t qpn : order)
+            sum += ibv::qp2rankLookup(table, qpn);
+        double lookup_time = (wtime() - t0) / config.lookups;
+        ibv::qp2rankFree(&table);
+
+        vector<int> mod_table;
+        t0 = wtime();
+        int mod = modSearch(qpns, config.max_mod_factor * (int) num, &mod_table);
+        double mod_build_time = wtime() - t0;
+        double mod_lookup_time = 0;
+        if (mod) {
+            t0 = wtime();
+            for (uint32_t qpn : order)
+                sum -= mod_table[qpn % mod];
+            mod_lookup_time = (wtime() - t0) / config.lookups;
+            MLOG_Assert(sum == 0, "The two maps disagree\n");
+        }
+
+        if (output_format != OutputFormat::TABLE) {
+            Record stats;
+            stats.set("qps", num);
+            stats.set("build_us", build_time * 1e6);
+            stats.set("lookup_ns", lookup_time * 1e9);
+            stats.set("mod", mod);
+            stats.set("mod_build_us", mod_build_time * 1e6);
+            if (mod) stats.set("mod_lookup_ns", mod_lookup_time * 1e9);
+            emit_record(stats);
+        } else {
+            if (!header) {
+                printf("%-10s %-12s %-12s %-12s %-14s %-14s\n", "QPs", "Build(us)", "Lookup(ns)",
+                       "Mod", "ModBuild(us)", "ModLookup(ns)");
+                header = true;
+            }
+            printf("%-10zu %-12.2f %-12.2f ", num, build_time * 1e6, lookup_time * 1e9);
+            // no collision-free modulus up to max-mod-factor * #QPs
+            if (mod) printf("%-12d %-14.2f %-14.2f\n", mod, mod_build_time * 1e6, mod_lookup_time * 1e9);
+            else printf("%-12s %-14.2f %-14s\n", "-", mod_build_time * 1e6, "-");
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <vector>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    vector<size_t> qps = {256, 1024, 4096};
+    vector<size_t> threads = {1, 2, 4, 8};
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"qps",          required_argument, 0, 'q'},
+            {"threads",      required_argument, 0, 'p'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'q':
+                config.qps = parse_sizes(optarg);
+                break;
+            case 'p':
+                config.threads = parse_sizes(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Connection setup time against the number of QPs and of setup threads
+// (DeviceConfig::setup_threads): every rank creates --qps RC QPs (up to
+// INIT) and connects them in pairs on its own port (RTR, then RTS), with
+// each --threads number of threads running ibv::parallelFor batches. The
+// speedup is relative to the first thread count of the list.
+int run(Config config) {
+    ibv::Device device;
+    ibv::DeviceConfig deviceConfig;
+    ibv::init(NULL, &device, deviceConfig);
+    ibv::describeDevice(&device, result_context);
+    int rank = lcm_pm_get_rank();
+
+    bool header = false;
+    for (size_t num : config.qps) {
+        MLOG_Assert(num > 0, "number of QPs must be positive\n");
+        vector<struct ibv_qp*> qps(num);
+        double base_time = 0;
+        for (size_t num_threads : config.threads) {
+            MLOG_Assert(num_threads > 0, "threads must be positive\n");
+            lcm_pm_barrier();
+            double t0 = wtime();
+            ibv::parallelFor((int) num, (int) num_threads, [&](int i) {
+                qps[i] = ibv::createQP(&device);
+            });
+            double create_time = wtime() - t0;
+            t0 = wtime();
+            // QP i to QP i^1; the last one of an odd count to itself
+            ibv::parallelFor((int) num, (int) num_threads, [&](int i) {
+                size_t peer = (size_t) (i ^ 1) < num ? i ^ 1 : i;
+                ibv::connectQP(&device, qps[i], qps[peer]->qp_num, device.port_attr.lid);
+            });
+            double connect_time = wtime() - t0;
+            for (struct ibv_qp *qp : qps)
+                ibv_destroy_qp(qp);
+
+            create_time = ibv::pmAllreduceMaxSeconds(create_time);
+            connect_time = ibv::pmAllreduceMaxSeconds(connect_time);
+            double total = create_time + connect_time;
+            if (base_time == 0) base_time = total;
+            if (rank == 0) {
+                if (output_format != OutputFormat::TABLE) {
+                    Record stats;
+                    stats.set("qps", num);
+                    stats.set("threads", num_threads);
+                    stats.set("create_ms", create_time * 1e3);
+                    stats.set("connect_ms", connect_time * 1e3);
+                    stats.set("total_ms", total * 1e3);
+                    stats.set("per_qp_us", total / num * 1e6);
+                    stats.set("speedup", base_time / total);
+                    emit_record(stats);
+                } else {
+                    if (!header) {
+                        printf("%-8s %-8s %-12s %-12s %-12s %-10s %-8s\n", "QPs", "Threads", "Create(ms)",
+                               "Connect(ms)", "Total(ms)", "QP(us)", "Speedup");
+                        header = true;
+                    }
+                    printf("%-8zu %-8zu %-12.3f %-12.3f %-12.3f %-10.2f %-8.2f\n", num, num_threads,
+                           create_time * 1e3, connect_time * 1e3, total * 1e3, total / num * 1e6,
+                           base_time / total);
+                }
+                fflush(stdout);
+            }
+        }
+    }
+
+    ibv::finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <vector>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    bool packed_wireup = true;
+    int rounds = 10;
+    int setup_threads = 1;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"wireup",       required_argument, 0, 'u'},
+            {"rounds",       required_argument, 0, 'r'},
+            {"setup-threads", required_argument, 0, 's'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "r:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'u':
+                if (strcmp(optarg, "packed") == 0) {
+                    config.packed_wireup = true;
+                } else if (strcmp(optarg, "pairwise") == 0) {
+                    config.packed_wireup = false;
+                } else {
+                    fprintf(stderr, "Unknown wire-up mode %s (packed or pairwise)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                config.rounds = atoi(optarg);
+                break;
+            case 's':
+                config.setup_threads = atoi(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.wireup", config.packed_wireup ? "packed" : "pairwise");
+    result_context.set("config.rounds", config.rounds);
+    result_context.set("config.setup_threads", config.setup_threads);
+}
+
+// Startup cost against the number of ranks: the time of ibv::init, with
+// the min/avg/max of every init phase over the ranks, and of the PMI
+// address exchange alone (exchangeAddrs), averaged over --rounds
+// repetitions. Run with --wireup=pairwise for the one key per
+// (rank, peer) baseline.
+int run(Config config) {
+    MLOG_Assert(config.rounds > 0, "rounds must be positive\n");
+    ibv::Device device;
+    ibv::DeviceConfig deviceConfig;
+    deviceConfig.packed_wireup = config.packed_wireup;
+    deviceConfig.setup_threads = config.setup_threads;
+    double t0 = wtime();
+    ibv::init(NULL, &device, deviceConfig);
+    double init_time = wtime() - t0;
+    // outside of the timing: the reduction is one more PMI exchange
+    ibv::reduceInitProfile(&device.init_profile);
+    ibv::describeDevice(&device, result_context);
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+
+    vector<ibv::PeerAddr> peers(nranks);
+    lcm_pm_barrier();
+    t0 = wtime();
+    for (int i = 0; i < config.rounds; ++i)
+        ibv::exchangeAddrs(&device, peers.data());
+    double wireup_time = (wtime() - t0) / config.rounds;
+    // the repeated exchanges must agree with the connections made by init
+    for (int i = 0; i < nranks; ++i) {
+        struct ibv_qp_attr attr;
+        struct ibv_qp_init_attr init_attr;
+        ibv_query_qp(device.qps[i], &attr, IBV_QP_DEST_QPN, &init_attr);
+        MLOG_Assert(peers[i].qpn == attr.dest_qp_num && peers[i].rkey == device.rmrs[i].rkey,
+                    "Wire-up of rank %d is inconsistent\n", i);
+    }
+
+    init_time = ibv::pmAllreduceMaxSeconds(init_time);
+    wireup_time = ibv::pmAllreduceMaxSeconds(wireup_time);
+    if (rank == 0) {
+        if (output_format != OutputFormat::TABLE) {
+            Record stats;
+            stats.set("nranks", nranks);
+            stats.set("init_s", init_time);
+            stats.set("wireup_s", wireup_time);
+            emit_record(stats);
+        } else {
+            printf("%-10s %-12s %-12s\n", "Ranks", "Init(s)", "Wireup(s)");
+            printf("%-10d %-12.6f %-12.6f\n", nranks, init_time, wireup_time);
+            printf("Startup breakdown of ibv::init over %d ranks:\n", nranks);
+            ibv::printInitProfile(device.init_profile, stdout);
+        }
+    }
+
+    ibv::finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -30,6 +30,12 @@ Config parseArgs(int argc, char **argv) {
             {"min-msg-size", required_argument, 0, 'a'},
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
     while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
         switch (opt) {
@@ -42,19 +48,49 @@ Config parseArgs(int argc, char **argv) {
             case 't':
                 config.touch_data = atoi(optarg);
                 break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+}
+
 void run(const Config &config) {
     int rank, nranks;
     MPI_CHECK(MPI_Init(0, 0));
     MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &nranks));
     MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
+    schedule.agree_max = [](int value) {
+        MPI_CHECK(MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD));
+        return value;
+    };
     char value = 'a' + rank;
     char peer_value = 'a' + 1 - rank;
     char *send_buf;
@@ -86,6 +122,7 @@ void run(const Config &config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
@@ -0,0 +1,151 @@
+#include <vector>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    vector<size_t> ranks = {256, 1024, 4096};
+    int keys_per_rank = 1;
+    int value_size = 40;        // about a packed wire-up blob
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"ranks",        required_argument, 0, 'r'},
+            {"keys-per-rank", required_argument, 0, 'k'},
+            {"value-size",   required_argument, 0, 'v'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                config.ranks = parse_sizes(optarg);
+                break;
+            case 'k':
+                config.keys_per_rank = atoi(optarg);
+                break;
+            case 'v':
+                config.value_size = atoi(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.keys_per_rank", config.keys_per_rank);
+    result_context.set("config.value_size", config.value_size);
+}
+
+void makeKey(char *key, size_t nranks, size_t rank, int k) {
+    sprintf(key, "ibvBench_kvs_%zu_%zu_%d", nranks, rank, k);
+}
+
+void makeValue(char *value, size_t rank, int k, int size) {
+    int len = sprintf(value, "%zx:%x:", rank, k);
+    for (; len < size; ++len) value[len] = 'A' + (rank + k + len) % 26;
+    value[len] = '\0';
+}
+
+// Cost of the PMI key-value store for a wire-up of --ranks emulated ranks,
+// spread round-robin over the processes. Every emulated rank publishes
+// --keys-per-rank keys, then reads the first key of every rank, as the
+// packed wire-up of ibv::exchangeAddrs does. The baseline is the same run
+// on the former store of the MPI backend (IBVB_PMI_MPI_FIXED=1).
+int run(Config config) {
+    MLOG_Assert(config.keys_per_rank > 0 && config.value_size > 0 && config.value_size < 240,
+                "keys-per-rank must be positive and value-size in (0, 240)\n");
+    lcm_pm_initialize();
+    int rank = lcm_pm_get_rank();
+    int nprocs = lcm_pm_get_size();
+    char key[256];
+    char value[256];
+    char expected[256];
+    bool header = false;
+    for (size_t nranks : config.ranks) {
+        MLOG_Assert(nranks >= (size_t) nprocs, "Cannot emulate %zu ranks on %d processes\n", nranks, nprocs);
+        lcm_pm_barrier();
+        double t0 = wtime();
+        for (size_t r = rank; r < nranks; r += nprocs) {
+            for (int k = 0; k < config.keys_per_rank; ++k) {
+                makeKey(key, nranks, r, k);
+                makeValue(value, r, k, config.value_size);
+                lcm_pm_publish(key, value);
+            }
+        }
+        double publish_time = wtime() - t0;
+        t0 = wtime();
+        lcm_pm_barrier();
+        double barrier_time = wtime() - t0;
+        size_t lookups = 0;
+        t0 = wtime();
+        for (size_t r = rank; r < nranks; r += nprocs) {
+            for (size_t i = 0; i < nranks; ++i) {
+                makeKey(key, nranks, i, 0);
+                lcm_pm_getname_rank((int) (i % nprocs), key, value);
+                ++lookups;
+            }
+        }
+        double get_time = wtime() - t0;
+        // the values must be right, outside of the timing
+        for (size_t i = 0; i < nranks; ++i) {
+            makeKey(key, nranks, i, 0);
+            lcm_pm_getname_rank((int) (i % nprocs), key, value);
+            makeValue(expected, i, 0, config.value_size);
+            MLOG_Assert(strcmp(value, expected) == 0, "Wrong value of key %s\n", key);
+        }
+
+        size_t num_keys = nranks * config.keys_per_rank;
+        publish_time = ibv::pmAllreduceMaxSeconds(publish_time);
+        barrier_time = ibv::pmAllreduceMaxSeconds(barrier_time);
+        get_time = ibv::pmAllreduceMaxSeconds(get_time);
+        double lookup = get_time / lookups;
+        if (rank == 0) {
+            if (output_format != OutputFormat::TABLE) {
+                Record stats;
+                stats.set("nranks", nranks);
+                stats.set("nprocs", nprocs);
+                stats.set("keys", num_keys);
+                stats.set("publish_ms", publish_time * 1e3);
+                stats.set("barrier_ms", barrier_time * 1e3);
+                stats.set("get_ms", get_time * 1e3);
+                stats.set("lookup_ns", lookup * 1e9);
+                emit_record(stats);
+            } else {
+                if (!header) {
+                    printf("%-8s %-9s %-12s %-12s %-10s %-11s\n", "Ranks", "Keys",
+                           "Publish(ms)", "Barrier(ms)", "Get(ms)", "Lookup(ns)");
+                    header = true;
+                }
+                printf("%-8zu %-9zu %-12.3f %-12.3f %-10.3f %-11.1f\n",
+                       nranks, num_keys, publish_time * 1e3, barrier_time * 1e3, get_time * 1e3,
+                       lookup * 1e9);
+            }
+            fflush(stdout);
+        }
+    }
+    lcm_pm_finalize();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
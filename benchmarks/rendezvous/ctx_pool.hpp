@@ -0,0 +1,165 @@
+#ifndef IBVBENCH_CTX_POOL_HPP
+#define IBVBENCH_CTX_POOL_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include "ibv_common.hpp"
+
+namespace ibv {
+
+// Threads with a cache of free slots; later threads use the global stack only.
+const int CTX_POOL_MAX_THREADS = 64;
+const int CTX_POOL_CACHE_SIZE = 32;
+
+// Dense id of the calling thread, -1 past CTX_POOL_MAX_THREADS.
+inline int ctxPoolThreadId() {
+    static int next_id = 0;
+    static thread_local int id = -2;
+    if (id == -2) {
+        id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        if (id >= CTX_POOL_MAX_THREADS) id = -1;
+    }
+    return id;
+}
+
+// Fixed-capacity pool of protocol contexts (SendCtx, RecvCtx, ...), one
+// cache line (or more) per object in a single block, so the per-message
+// malloc/free goes away. Every thread keeps up to CTX_POOL_CACHE_SIZE free
+// slots of its own; it exchanges them in halves with a global lock-free
+// stack (Treiber stack, the head is tagged against ABA). With heap = true
+// alloc/free fall back to new/delete, for comparison.
+template<typename T>
+struct CtxPool {
+    struct alignas(64) Cache {
+        uint32_t slots[CTX_POOL_CACHE_SIZE];
+        int num;
+    };
+
+    static size_t slotSize() {
+        return (sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    }
+
+    // Bytes of the block that holds capacity objects.
+    static size_t blockSize(uint32_t capacity) {
+        return (size_t) capacity * slotSize();
+    }
+
+    // mem: a caller-owned block of blockSize(capacity) bytes, e.g. in
+    // registered memory; NULL to allocate one.
+    void init(uint32_t capacity, bool heap = false, void *mem = NULL) {
+        this->heap = heap;
+        if (heap) return;
+        slot_size = slotSize();
+        this->capacity = capacity;
+        own_slots = mem == NULL;
+        int ret = 0;
+        if (own_slots)
+            ret = posix_memalign((void**) &slots, CACHE_LINE_SIZE, capacity * slot_size);
+        else
+            slots = (char*) mem;
+        MLOG_Assert(ret == 0, "Memory allocation failed!\n");
+        ret = posix_memalign((void**) &caches, CACHE_LINE_SIZE, CTX_POOL_MAX_THREADS * sizeof(Cache));
+        MLOG_Assert(ret == 0, "Memory allocation failed!\n");
+        for (int i = 0; i < CTX_POOL_MAX_THREADS; ++i)
+            caches[i].num = 0;
+        // all slots on the global stack, 0 first
+        next = (uint32_t*) malloc(capacity * sizeof(uint32_t));
+        for (uint32_t i = 0; i < capacity; ++i)
+            next[i] = i + 2 <= capacity ? i + 2 : 0;
+        head = capacity > 0 ? 1 : 0;
+    }
+
+    void fini() {
+        if (heap) return;
+        if (own_slots) ::free(slots);
+        ::free(caches);
+        ::free(next);
+    }
+
+    // NULL once all capacity objects are in use.
+    T *alloc() {
+        if (heap) return new T();
+        int tid = ctxPoolThreadId();
+        uint32_t slot;
+        if (tid >= 0) {
+            Cache &cache = caches[tid];
+            if (cache.num == 0) {
+                // refill half of the cache
+                uint32_t top;
+                while (cache.num < CTX_POOL_CACHE_SIZE / 2 && (top = pop()))
+                    cache.slots[cache.num++] = top - 1;
+                if (cache.num == 0) return NULL;
+            }
+            slot = cache.slots[--cache.num];
+        } else {
+            uint32_t top = pop();
+            if (!top) return NULL;
+            slot = top - 1;
+        }
+        return new (slots + (size_t) slot * slot_size) T();
+    }
+
+    void free(T *ctx) {
+        if (heap) {
+            delete ctx;
+            return;
+        }
+        ctx->~T();
+        uint32_t slot = (uint32_t) (((char*) ctx - slots) / slot_size);
+        int tid = ctxPoolThreadId();
+        if (tid >= 0) {
+            Cache &cache = caches[tid];
+            if (cache.num == CTX_POOL_CACHE_SIZE) {
+                // return half of the cache
+                while (cache.num > CTX_POOL_CACHE_SIZE / 2)
+                    push(cache.slots[--cache.num] + 1);
+            }
+            cache.slots[cache.num++] = slot;
+        } else {
+            push(slot + 1);
+        }
+    }
+
+    bool heap;
+    bool own_slots;
+    char *slots;
+    size_t slot_size;
+    uint32_t capacity;
+    Cache *caches;       // per thread id
+    // Global stack of slot + 1 (0: end), linked through next. The upper
+    // 32 bits of head count the updates.
+    uint32_t *next;
+    alignas(64) uint64_t head;
+
+private:
+    void push(uint32_t top) {
+        uint64_t old = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        uint64_t desired;
+        do {
+            __atomic_store_n(&next[top - 1], (uint32_t) old, __ATOMIC_RELAXED);
+            desired = ((old >> 32) + 1) << 32 | top;
+        } while (!__atomic_compare_exchange_n(&head, &old, desired, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    // 0 if the stack is empty
+    uint32_t pop() {
+        uint64_t old = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint64_t desired;
+        uint32_t top;
+        do {
+            top = (uint32_t) old;
+            if (!top) return 0;
+            // may be stale if another thread wins: the tag then fails the CAS
+            uint32_t below = __atomic_load_n(&next[top - 1], __ATOMIC_RELAXED);
+            desired = ((old >> 32) + 1) << 32 | below;
+        } while (!__atomic_compare_exchange_n(&head, &old, desired, true,
+                                              __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+        return top;
+    }
+};
+
+} // namespace ibv
+
+#endif//IBVBENCH_CTX_POOL_HPP
@@ -0,0 +1,169 @@
+#include <vector>
+#include <pthread.h>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+#include "lcm_archive.h"
+
+using namespace std;
+using namespace bench;
+
+struct Config {
+    vector<size_t> threads = {1, 2, 4, 8};
+    int pairs = 1000000;    // put/remove pairs per thread
+    int inflight = 64;      // keys every thread holds at once
+    int nbits = 10;         // initial size of the archive
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"threads",      required_argument, 0, 'p'},
+            {"pairs",        required_argument, 0, 'n'},
+            {"inflight",     required_argument, 0, 'i'},
+            {"nbits",        required_argument, 0, 'b'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                config.threads = parse_sizes(optarg);
+                break;
+            case 'n':
+                config.pairs = atoi(optarg);
+                break;
+            case 'i':
+                config.inflight = atoi(optarg);
+                break;
+            case 'b':
+                config.nbits = atoi(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.pairs", config.pairs);
+    result_context.set("config.inflight", config.inflight);
+    result_context.set("config.nbits", config.nbits);
+}
+
+struct Worker {
+    pthread_t thread;
+    int id;
+    const Config *config;
+    LCM_archive_t *archive;
+    pthread_barrier_t *barrier;
+    double time;
+    long stale_hits;    // removed keys that still resolve (generation wrapped)
+};
+
+void *work(void *arg) {
+    Worker *worker = (Worker*) arg;
+    const Config &config = *worker->config;
+    vector<LCM_archive_key_t> keys(config.inflight);
+    vector<LCM_archive_val_t> values(config.inflight);
+    worker->stale_hits = 0;
+    pthread_barrier_wait(worker->barrier);
+    double t0 = wtime();
+    uint64_t next = 1;
+    for (int done = 0; done < config.pairs; done += config.inflight) {
+        int num = min(config.inflight, config.pairs - done);
+        for (int i = 0; i < num; ++i) {
+            // never LCM_ARCHIVE_EMPTY
+            values[i] = (LCM_archive_val_t) worker->id << 48 | next++;
+            int ret = LCM_archive_put(worker->archive, values[i], &keys[i]);
+            MLOG_Assert(ret == LCM_SUCCESS, "Archive is full!\n");
+        }
+        for (int i = 0; i < num; ++i) {
+            LCM_archive_val_t val = LCM_archive_get(worker->archive, keys[i]);
+            MLOG_Assert(val == values[i], "Get of key %lu returned %lu instead of %lu\n", keys[i], val, values[i]);
+            val = LCM_archive_remove(worker->archive, keys[i]);
+            MLOG_Assert(val == values[i], "Remove of key %lu returned %lu instead of %lu\n", keys[i], val, values[i]);
+        }
+        // the entries may be reused by now: the generation must tell
+        for (int i = 0; i < num; ++i)
+            if (LCM_archive_get(worker->archive, keys[i]) != LCM_ARCHIVE_EMPTY) ++worker->stale_hits;
+    }
+    worker->time = wtime() - t0;
+    return NULL;
+}
+
+// Put/remove throughput of LCM_archive with every --threads number of
+// threads sharing one archive. Every thread puts --inflight keys, then
+// gets and removes them, until it has done --pairs pairs, and checks that
+// its removed keys no longer resolve: the run fails if one does. The
+// archive starts at 2^--nbits entries and grows as needed.
+int run(Config config) {
+    MLOG_Assert(config.pairs > 0 && config.inflight > 0, "pairs and inflight must be positive\n");
+    bool header = false;
+    for (size_t num_threads : config.threads) {
+        MLOG_Assert(num_threads > 0, "threads must be positive\n");
+        LCM_archive_t archive;
+        int ret = LCM_archive_init(&archive, config.nbits);
+        MLOG_Assert(ret == LCM_SUCCESS, "Initialize archive failed!\n");
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, num_threads);
+        vector<Worker> workers(num_threads);
+        for (size_t i = 0; i < num_threads; ++i) {
+            workers[i].id = (int) i;
+            workers[i].config = &config;
+            workers[i].archive = &archive;
+            workers[i].barrier = &barrier;
+            ret = pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+            MLOG_Assert(ret == 0, "Cannot start thread %lu!\n", i);
+        }
+        double time = 0;
+        long stale_hits = 0;
+        for (Worker &worker : workers) {
+            pthread_join(worker.thread, NULL);
+            time = max(time, worker.time);
+            stale_hits += worker.stale_hits;
+        }
+        pthread_barrier_destroy(&barrier);
+        MLOG_Assert(stale_hits == 0, "%ld removed keys still resolved with %zu threads\n",
+                    stale_hits, num_threads);
+        size_t capacity = LCM_archive_capacity(&archive);
+        LCM_archive_fini(&archive);
+
+        double pairs = (double) config.pairs * num_threads;
+        if (output_format != OutputFormat::TABLE) {
+            Record stats;
+            stats.set("threads", num_threads);
+            stats.set("time_ms", time * 1e3);
+            stats.set("mpairs_per_s", pairs / time / 1e6);
+            stats.set("pair_ns", time / config.pairs * 1e9);
+            stats.set("capacity", capacity);
+            stats.set("stale_hits", stale_hits);
+            emit_record(stats);
+        } else {
+            if (!header) {
+                printf("%-10s %-12s %-12s %-12s %-12s %-10s\n", "Threads", "Time(ms)", "Mpairs/s",
+                       "Pair(ns)", "Capacity", "Stale");
+                header = true;
+            }
+            printf("%-10zu %-12.2f %-12.3f %-12.2f %-12zu %-10ld\n", num_threads, time * 1e3,
+                   pairs / time / 1e6, time / config.pairs * 1e9, capacity, stale_hits);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
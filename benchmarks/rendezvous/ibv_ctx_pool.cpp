@@ -0,0 +1,181 @@
+#include <vector>
+#include <string>
+#include <pthread.h>
+#include "ibv_common.hpp"
+#include "bench_common.hpp"
+#include "ctx_pool.hpp"
+#include "rdv_write_ctx.hpp"
+
+using namespace std;
+using namespace bench;
+using namespace ibv;
+
+struct Config {
+    vector<size_t> threads = {1, 2, 4, 8};
+    int messages = 1000000;   // messages per thread
+    int inflight = 64;        // messages every thread keeps in flight
+    double message_us = 0;    // per-message time to report the allocator share against
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"threads",      required_argument, 0, 'p'},
+            {"messages",     required_argument, 0, 'n'},
+            {"inflight",     required_argument, 0, 'i'},
+            {"message-us",   required_argument, 0, 'm'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                config.threads = parse_sizes(optarg);
+                break;
+            case 'n':
+                config.messages = atoi(optarg);
+                break;
+            case 'i':
+                config.inflight = atoi(optarg);
+                break;
+            case 'm':
+                config.message_us = atof(optarg);
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.messages", config.messages);
+    result_context.set("config.inflight", config.inflight);
+    result_context.set("config.message_us", config.message_us);
+}
+
+struct Worker {
+    pthread_t thread;
+    const Config *config;
+    CtxPool<SendCtx> *send_ctx_pool;
+    CtxPool<RecvCtx> *recv_ctx_pool;
+    pthread_barrier_t *barrier;
+    double time;
+};
+
+void *work(void *arg) {
+    Worker *worker = (Worker*) arg;
+    const Config &config = *worker->config;
+    vector<SendCtx*> send_ctxs(config.inflight);
+    vector<RecvCtx*> recv_ctxs(config.inflight);
+    pthread_barrier_wait(worker->barrier);
+    double t0 = wtime();
+    for (int done = 0; done < config.messages; done += config.inflight) {
+        int num = min(config.inflight, config.messages - done);
+        // what postRTS and handleRTS allocate for every message
+        for (int i = 0; i < num; ++i) {
+            send_ctxs[i] = worker->send_ctx_pool->alloc();
+            recv_ctxs[i] = worker->recv_ctx_pool->alloc();
+            MLOG_Assert(send_ctxs[i] != NULL && recv_ctxs[i] != NULL, "Context pool is empty!\n");
+            send_ctxs[i]->size = recv_ctxs[i]->size = (uint32_t) i;
+        }
+        // and the completion handlers free
+        for (int i = 0; i < num; ++i) {
+            MLOG_Assert(send_ctxs[i]->size == (uint32_t) i && recv_ctxs[i]->size == (uint32_t) i,
+                        "Context %d was handed out twice!\n", i);
+            worker->recv_ctx_pool->free(recv_ctxs[i]);
+            worker->send_ctx_pool->free(send_ctxs[i]);
+        }
+    }
+    worker->time = wtime() - t0;
+    return NULL;
+}
+
+// Allocator cost per rendezvous message: one SendCtx and one RecvCtx
+// allocated and freed, from the heap (new/delete, --ctx-alloc=heap of the
+// rendezvous benchmarks) and from ibv::CtxPool. Every --threads number of
+// threads shares one pool (or the heap); each thread keeps --inflight
+// messages in flight until it has done --messages of them. With
+// --message-us=T (e.g. the latency ibv_pingpong_rdv_* reports at the same
+// size) the Share columns give the allocator time as a fraction of T.
+// This is the allocator in isolation: a real heap is also fragmented and
+// cold, so the heap numbers are a lower bound.
+int run(Config config) {
+    MLOG_Assert(config.messages > 0 && config.inflight > 0, "messages and inflight must be positive\n");
+    bool header = false;
+    for (size_t num_threads : config.threads) {
+        MLOG_Assert(num_threads > 0, "threads must be positive\n");
+        double msg_ns[2];
+        for (int heap = 1; heap >= 0; --heap) {
+            CtxPool<SendCtx> send_ctx_pool;
+            CtxPool<RecvCtx> recv_ctx_pool;
+            uint32_t capacity = (uint32_t) (num_threads * (config.inflight + 2 * CTX_POOL_CACHE_SIZE));
+            send_ctx_pool.init(capacity, heap);
+            recv_ctx_pool.init(capacity, heap);
+            pthread_barrier_t barrier;
+            pthread_barrier_init(&barrier, NULL, num_threads);
+            vector<Worker> workers(num_threads);
+            for (size_t i = 0; i < num_threads; ++i) {
+                workers[i].config = &config;
+                workers[i].send_ctx_pool = &send_ctx_pool;
+                workers[i].recv_ctx_pool = &recv_ctx_pool;
+                workers[i].barrier = &barrier;
+                int ret = pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+                MLOG_Assert(ret == 0, "Cannot start thread %lu!\n", i);
+            }
+            double time = 0;
+            for (Worker &worker : workers) {
+                pthread_join(worker.thread, NULL);
+                time = max(time, worker.time);
+            }
+            pthread_barrier_destroy(&barrier);
+            send_ctx_pool.fini();
+            recv_ctx_pool.fini();
+            msg_ns[heap] = time / config.messages * 1e9;
+        }
+
+        double heap_share = config.message_us > 0 ? msg_ns[1] / (config.message_us * 1e3) * 100 : 0;
+        double pool_share = config.message_us > 0 ? msg_ns[0] / (config.message_us * 1e3) * 100 : 0;
+        if (output_format != OutputFormat::TABLE) {
+            Record stats;
+            stats.set("threads", num_threads);
+            stats.set("heap_msg_ns", msg_ns[1]);
+            stats.set("pool_msg_ns", msg_ns[0]);
+            stats.set("speedup", msg_ns[1] / msg_ns[0]);
+            if (config.message_us > 0) {
+                stats.set("heap_share_pct", heap_share);
+                stats.set("pool_share_pct", pool_share);
+            }
+            emit_record(stats);
+        } else {
+            if (!header) {
+                printf("%-10s %-14s %-14s %-10s", "Threads", "Heap(ns/msg)", "Pool(ns/msg)", "Speedup");
+                if (config.message_us > 0)
+                    printf(" %-14s %-14s", "Heap share(%)", "Pool share(%)");
+                printf("\n");
+                header = true;
+            }
+            printf("%-10zu %-14.2f %-14.2f %-10.2f", num_threads, msg_ns[1], msg_ns[0], msg_ns[1] / msg_ns[0]);
+            if (config.message_us > 0)
+                printf(" %-14.3f %-14.3f", heap_share, pool_share);
+            printf("\n");
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "bench_common.hpp"
+#include "ibv_common.hpp"
+#include "p2p_engine.hpp"
+using namespace std;
+using namespace bench;
+using namespace ibv;
+
+struct Config {
+    bool touch_data = true;
+    int min_msg_size = 8;
+    int max_msg_size = 64 * 1024;
+    // eager thresholds to sweep; 0: rendezvous only
+    vector<size_t> thresholds = {0, 256, 1024, 4096, 16384};
+    RdvProtocol protocol = RdvProtocol::WRITE_IMM;
+};
+
+Config parseArgs(int argc, char **argv) {
+    Config config;
+    int opt;
+    opterr = 0;
+
+    struct option long_options[] = {
+            {"min-msg-size", required_argument, 0, 'a'},
+            {"max-msg-size", required_argument, 0, 'b'},
+            {"touch-data",   required_argument, 0, 't'},
+            {"thresholds",   required_argument, 0, 'e'},
+            {"rdv",          required_argument, 0, 'r'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                config.min_msg_size = atoi(optarg);
+                break;
+            case 'b':
+                config.max_msg_size = atoi(optarg);
+                break;
+            case 't':
+                config.touch_data = atoi(optarg);
+                break;
+            case 'e':
+                config.thresholds = parse_sizes(optarg);
+                break;
+            case 'r':
+                if (strcmp(optarg, "write") == 0) {
+                    config.protocol = RdvProtocol::WRITE;
+                } else if (strcmp(optarg, "write_imm") == 0) {
+                    config.protocol = RdvProtocol::WRITE_IMM;
+                } else if (strcmp(optarg, "read") == 0) {
+                    config.protocol = RdvProtocol::READ;
+                } else {
+                    fprintf(stderr, "Unknown rendezvous protocol %s (write, write_imm or read)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
+    return config;
+}
+
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.rdv", rdvProtocolName(config.protocol));
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+}
+
+// Pingpong through the p2p engine (p2p_engine.hpp) at every message size
+// and every eager threshold of --thresholds: messages up to the threshold
+// go eager, larger ones take the --rdv rendezvous. Every threshold is swept
+// over all message sizes (config.eager_threshold in the records). Per size,
+// the threshold with the lowest latency is the best one. The recommended
+// cut-over is the threshold with the lowest latency relative to the best,
+// summed over all sizes. With --output, the sweep records are followed by a
+// best_eager_threshold record per size and a recommended_eager_threshold one.
+int run(Config config) {
+    MLOG_Assert(!config.thresholds.empty(), "No eager threshold to sweep\n");
+    P2PConfig p2pConfig;
+    p2pConfig.max_eager_size = max((uint32_t) config.thresholds.back(), (uint32_t) 1);
+    p2pConfig.eager_threshold = p2pConfig.max_eager_size;
+    p2pConfig.protocol = config.protocol;
+    Device device;
+    DeviceConfig deviceConfig;
+    // the bounce sends plus one RDMA operation
+    deviceConfig.max_send_num = p2pConfig.num_bounce + 1;
+    deviceConfig.max_cqe_num = max(deviceConfig.max_send_num, deviceConfig.max_recv_num) + 1;
+    size_t region_size = p2pRegionSize(p2pConfig, deviceConfig);
+    deviceConfig.mr_size = region_size + config.max_msg_size * 2;
+    init(NULL, &device, deviceConfig);
+    describeDevice(&device, result_context);
+    schedule.agree_max = pmAllreduceMax;
+    int rank = lcm_pm_get_rank();
+    int nranks = lcm_pm_get_size();
+    MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
+    char value = 'a' + rank;
+    char peer_value = 'a' + 1 - rank;
+
+    char *ptr = (char*) device.mr_addr;
+    P2P p2p;
+    p2pInit(&p2p, &device, ptr, p2pConfig);
+    ptr += region_size;
+    char *send_buf = ptr;
+    ptr += config.max_msg_size;
+    char *recv_buf = ptr;
+
+    auto pingpong = [&](int msg_size, bool first) {
+        P2PRequest req;
+        if (first) {
+            if (config.touch_data) write_buffer(send_buf, msg_size, value);
+            p2pPostSend(&p2p, 1 - rank, send_buf, msg_size, device.dev_mr, &req);
+            p2pWait(&p2p, &req);
+        }
+        p2pPostRecv(&p2p, recv_buf, msg_size, device.dev_mr, &req);
+        p2pWait(&p2p, &req);
+        MLOG_Assert(req.size == (uint32_t) msg_size, "Received %u bytes instead of %d\n", req.size, msg_size);
+        if (config.touch_data) check_buffer(recv_buf, msg_size, peer_value);
+        if (!first) {
+            if (config.touch_data) write_buffer(send_buf, msg_size, value);
+            p2pPostSend(&p2p, 1 - rank, send_buf, msg_size, device.dev_mr, &req);
+            p2pWait(&p2p, &req);
+        }
+    };
+
+    size_t num_thresholds = config.thresholds.size();
+    // latency (us) of every size at thresholds[j], on rank 0
+    vector<vector<double>> latency(num_thresholds);
+    for (size_t j = 0; j < num_thresholds; ++j) {
+        p2p.config.eager_threshold = config.thresholds[j];
+        result_context.set("config.eager_threshold", config.thresholds[j]);
+        if (rank == 0 && output_format == OutputFormat::TABLE)
+            printf("Eager threshold: %zu\n", config.thresholds[j]);
+        Traffic traffic;
+        traffic.latencies = &latency[j];
+        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, rank == 0, [&](int msg_size, int iter) {
+            pingpong(msg_size, rank == 0);
+        }, {0, 1}, traffic);
+    }
+
+    if (rank == 0) {
+        // the best threshold per size, and the one closest to it overall
+        vector<size_t> sizes = sweep_sizes(config.min_msg_size, config.max_msg_size);
+        vector<int> best(sizes.size(), 0);
+        vector<double> score(num_thresholds, 0);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            for (size_t j = 1; j < num_thresholds; ++j)
+                if (latency[j][i] < latency[best[i]][i]) best[i] = j;
+            for (size_t j = 0; j < num_thresholds; ++j)
+                score[j] += latency[j][i] / latency[best[i]][i];
+        }
+        size_t recommended = min_element(score.begin(), score.end()) - score.begin();
+        if (output_format != OutputFormat::TABLE) {
+            // the summary is over all thresholds
+            result_context.erase("config.eager_threshold");
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                Record stats;
+                stats.set("msg_size", sizes[i]);
+                stats.set("best_eager_threshold", config.thresholds[best[i]]);
+                stats.set("best_latency_us", latency[best[i]][i]);
+                emit_record(stats);
+            }
+            Record stats;
+            stats.set("recommended_eager_threshold", config.thresholds[recommended]);
+            emit_record(stats);
+        } else {
+            printf("Latency (us) per eager threshold, rendezvous: %s\n", rdvProtocolName(config.protocol));
+            printf("%-10s", "Size");
+            for (size_t threshold : config.thresholds) printf(" %-10zu", threshold);
+            printf(" %-10s\n", "Best");
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                printf("%-10zu", sizes[i]);
+                for (size_t j = 0; j < num_thresholds; ++j) printf(" %-10.2f", latency[j][i]);
+                printf(" %-10zu\n", config.thresholds[best[i]]);
+            }
+            printf("Recommended eager threshold: %zu\n", config.thresholds[recommended]);
+        }
+        fflush(stdout);
+    }
+
+    p2pFini(&p2p);
+    finalize(&device);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    init(false);
+    Config config = parseArgs(argc, argv);
+    reportConfig(config);
+    run(config);
+    finalize();
+    return 0;
+}
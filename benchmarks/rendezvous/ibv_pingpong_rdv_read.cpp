@@ -1,13 +1,20 @@
 #include "bench_common.hpp"
 #include "ibv_common.hpp"
+#include "ctx_pool.hpp"
 using namespace std;
 using namespace bench;
 using namespace ibv;
 
 struct Config {
     bool touch_data = true;
+    bool ctx_pool = true;
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
+    // chunk sizes to sweep; 0: the whole message in one RDMA operation
+    vector<size_t> chunk_sizes = {0};
+    int pipeline_depth = 4;
+    // rendezvous transfers in flight per direction to sweep
+    vector<size_t> windows = {1};
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -19,6 +26,16 @@ Config parseArgs(int argc, char **argv) {
             {"min-msg-size", required_argument, 0, 'a'},
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
+            {"ctx-alloc",    required_argument, 0, 'A'},
+            {"chunk-size",   required_argument, 0, 'c'},
+            {"pipeline-depth", required_argument, 0, 'D'},
+            {"window",       required_argument, 0, 'w'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
     while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
         switch (opt) {
@@ -31,13 +48,60 @@ Config parseArgs(int argc, char **argv) {
             case 't':
                 config.touch_data = atoi(optarg);
                 break;
+            case 'A':
+                if (strcmp(optarg, "pool") == 0) {
+                    config.ctx_pool = true;
+                } else if (strcmp(optarg, "heap") == 0) {
+                    config.ctx_pool = false;
+                } else {
+                    fprintf(stderr, "Unknown context allocator %s (pool or heap)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                config.chunk_sizes = parse_sizes(optarg);
+                break;
+            case 'D':
+                config.pipeline_depth = atoi(optarg);
+                break;
+            case 'w':
+                config.windows = parse_sizes(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.ctx_alloc", config.ctx_pool ? "pool" : "heap");
+    result_context.set("config.pipeline_depth", config.pipeline_depth);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+}
+
 struct SendCtx {
     void *buf;
     uint32_t size;
@@ -51,6 +115,12 @@ struct RecvCtx {
     ibv_mr *mr;
     void *user_context;
     uintptr_t send_ctx;
+    uintptr_t send_buf;
+    uint32_t rkey;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint32_t posted_chunks;  // reads posted
+    uint32_t done_chunks;    // reads completed
 };
 
 struct RTSMsg {
@@ -58,156 +128,243 @@ struct RTSMsg {
     uintptr_t send_buf; // 8 bytes
     uint32_t size; // 4 bytes
     uint32_t rkey; // 4 bytes
+    uint32_t chunk_size; // 4 bytes
 };
 
 struct FINMsg {
     uintptr_t send_ctx;
 };
 
+// A control message in registered memory, one per send until it completes.
+union CtrlMsg {
+    RTSMsg rts;
+    FINMsg fin;
+};
+
 enum MsgType {
     MSG_RTS,
     MSG_FIN
 };
 
-RTSMsg *rtsMsg;
-FINMsg *finMsg;
-void *control_recv_buf;
+// protocol contexts, at most CTX_POOL_CAPACITY in flight
+const int CTX_POOL_CAPACITY = 1024;
+CtxPool<SendCtx> send_ctx_pool;
+CtxPool<RecvCtx> recv_ctx_pool;
+CtxPool<CtrlMsg> ctrl_pool;
+// chunk reads in flight per transfer
+int pipeline_depth;
 
-struct ibv_wc pollRecvCQ(Device *device) {
-    struct ibv_wc wc = pollCQ(device->recv_cq);
-    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv RTS completion failed!\n");
-    --device->posted_recv_num;
-    checkAndPostRecvs(device, control_recv_buf, CACHE_LINE_SIZE, device->dev_mr->lkey, control_recv_buf);
-    return wc;
+inline uint32_t numChunks(uint32_t size, uint32_t chunk_size) {
+    if (chunk_size == 0 || chunk_size >= size) return 1;
+    return (size + chunk_size - 1) / chunk_size;
 }
 
-void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
-    SendCtx *ctx = (SendCtx*) malloc(sizeof(SendCtx));
+CtrlMsg *allocCtrl() {
+    CtrlMsg *msg = ctrl_pool.alloc();
+    MLOG_Assert(msg != NULL, "Too many control messages in flight!\n");
+    return msg;
+}
+
+// The slot goes back to ctrl_pool when the send completes.
+void postCtrl(Device *device, int rank, CtrlMsg *msg, uint32_t size, uint32_t imm) {
+    int ret = postSendImm(device, rank, msg, size, device->dev_mr->lkey, imm, msg);
+    MLOG_Assert(ret == 0, "");
+}
+
+void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, uint32_t chunk_size,
+             void *user_context) {
+    SendCtx *ctx = send_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many sends in flight!\n");
     ctx->buf = buf;
     ctx->size = size;
     ctx->mr = mr;
     ctx->user_context = user_context;
-    rtsMsg->send_ctx = (uintptr_t) ctx;
-    rtsMsg->send_buf = (uintptr_t) buf;
-    rtsMsg->size = size;
-    rtsMsg->rkey = mr->rkey;
-    int ret = postSendImm(device, rank, rtsMsg, sizeof(RTSMsg), device->dev_mr->lkey, MSG_RTS, ctx);
+    CtrlMsg *msg = allocCtrl();
+    msg->rts.send_ctx = (uintptr_t) ctx;
+    msg->rts.send_buf = (uintptr_t) buf;
+    msg->rts.size = size;
+    msg->rts.rkey = mr->rkey;
+    msg->rts.chunk_size = chunk_size == 0 ? size : chunk_size;
+    postCtrl(device, rank, msg, sizeof(RTSMsg), MSG_RTS);
+}
+
+// Post the read of the next chunk.
+void postChunk(Device *device, int rank, RecvCtx *ctx) {
+    uint32_t offset = ctx->posted_chunks++ * ctx->chunk_size;
+    uint32_t length = min(ctx->chunk_size, ctx->size - offset);
+    int ret = postRead(device, rank, (char*) ctx->buf + offset, length, ctx->mr->lkey,
+                       ctx->send_buf + offset, ctx->rkey, ctx);
     MLOG_Assert(ret == 0, "");
 }
 
 void handleRTS(Device *device, struct ibv_wc wc, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
     MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == MSG_RTS, "");
-    RTSMsg *recvRTSMsg = (RTSMsg*) wc.wr_id;
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
+    RTSMsg *recvRTSMsg = (RTSMsg*) recvBuf(device, wc);
+    int src_rank = ibv::qpRank(device, wc.qp_num);
     MLOG_Assert(recvRTSMsg->size <= size, "");
-    RecvCtx *ctx = (RecvCtx*) malloc(sizeof(RecvCtx));
+    RecvCtx *ctx = recv_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many receives in flight!\n");
     ctx->buf = buf;
-    ctx->size = size;
+    ctx->size = recvRTSMsg->size;
     ctx->mr = mr;
     ctx->user_context = user_context;
     ctx->send_ctx = recvRTSMsg->send_ctx;
-    int ret = postRead(device, src_rank, buf, size, mr->lkey,
-                       recvRTSMsg->send_buf, recvRTSMsg->rkey, ctx);
-    MLOG_Assert(ret == 0, "");
+    ctx->send_buf = recvRTSMsg->send_buf;
+    ctx->rkey = recvRTSMsg->rkey;
+    ctx->chunk_size = recvRTSMsg->chunk_size;
+    ctx->num_chunks = numChunks(ctx->size, ctx->chunk_size);
+    ctx->posted_chunks = ctx->done_chunks = 0;
+    while (ctx->posted_chunks < ctx->num_chunks && (int) ctx->posted_chunks < pipeline_depth)
+        postChunk(device, src_rank, ctx);
 }
 
-int handleReadCompletion(Device *device, struct ibv_wc wc) {
+// A chunk has landed at [*chunk, *chunk + *length): read the next one, or
+// send the FIN after the last one. Return true for the last one.
+bool handleReadCompletion(Device *device, struct ibv_wc wc, char **chunk, uint32_t *length) {
     MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_READ, "");
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
+    int src_rank = ibv::qpRank(device, wc.qp_num);
     RecvCtx *ctx = (RecvCtx*) wc.wr_id;
-    finMsg->send_ctx = ctx->send_ctx;
-    delete ctx;
-    return postSendImm(device, src_rank, finMsg, sizeof(FINMsg),
-                       device->dev_mr->lkey, MSG_FIN, NULL);
+    // reads complete in order
+    uint32_t offset = ctx->done_chunks * ctx->chunk_size;
+    *chunk = (char*) ctx->buf + offset;
+    *length = min(ctx->chunk_size, ctx->size - offset);
+    if (ctx->posted_chunks < ctx->num_chunks) postChunk(device, src_rank, ctx);
+    if (++ctx->done_chunks < ctx->num_chunks) return false;
+    CtrlMsg *msg = allocCtrl();
+    msg->fin.send_ctx = ctx->send_ctx;
+    recv_ctx_pool.free(ctx);
+    postCtrl(device, src_rank, msg, sizeof(FINMsg), MSG_FIN);
+    return true;
 }
 
-void handleFIN(struct ibv_wc wc) {
+void handleFIN(Device *device, struct ibv_wc wc) {
     MLOG_Assert(wc.imm_data == MSG_FIN, "Recv FIN failed");
-    // we cannot do this because the next RTS message might have overwritten the buffer
-//    FINMsg *recvFINMsg = (FINMsg*) wc.wr_id;
-//    SendCtx *ctx = (SendCtx*) recvFINMsg->send_ctx;
-    SendCtx *ctx = (SendCtx*) rtsMsg->send_ctx;
-    delete ctx;
+    // every receive has its own slot: the next RTS cannot overwrite it
+    FINMsg *recvFINMsg = (FINMsg*) recvBuf(device, wc);
+    SendCtx *ctx = (SendCtx*) recvFINMsg->send_ctx;
+    send_ctx_pool.free(ctx);
 }
 
+// Rendezvous pingpong with --chunk-size: the receiver reads the message in
+// chunks, with up to --pipeline-depth reads in flight (and at most as many
+// as the QP allows), checks each chunk as its read completes and sends
+// the FIN after the last one. With --window, every ping and pong is a
+// burst of that many concurrent transfers, each from its own buffer. Every
+// window and chunk size of the lists is swept over all message sizes.
 int run(Config config) {
+    MLOG_Assert(config.pipeline_depth > 0, "pipeline-depth must be positive\n");
+    MLOG_Assert(config.windows.front() > 0 && config.windows.back() <= CTX_POOL_CAPACITY,
+                "window must be in [1, %d]\n", CTX_POOL_CAPACITY);
+    pipeline_depth = config.pipeline_depth;
+    int max_window = config.windows.back();
     ibv::Device device;
     ibv::DeviceConfig deviceConfig;
-    deviceConfig.mr_size = CACHE_LINE_SIZE * 3 + config.max_msg_size * 2;
+    // the RTSs, the reads of a window of pipelines and the FINs
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, max_window * (config.pipeline_depth + 2));
+    // the RTSs or FINs
+    deviceConfig.min_recv_num = deviceConfig.max_recv_num = max(deviceConfig.max_recv_num, max_window * 2);
+    deviceConfig.max_cqe_num = max(deviceConfig.max_send_num, deviceConfig.max_recv_num) + 1;
+    // every control message in flight holds a send WR
+    int ctrl_capacity = deviceConfig.max_send_num;
+    size_t ctrl_size = CtxPool<CtrlMsg>::blockSize(ctrl_capacity);
+    size_t recv_slots_size = (size_t) deviceConfig.max_recv_num * CACHE_LINE_SIZE;
+    deviceConfig.mr_size = ctrl_size + recv_slots_size + (size_t) max_window * config.max_msg_size * 2;
     ibv::init(NULL, &device, deviceConfig);
+    describeDevice(&device, result_context);
+    schedule.agree_max = pmAllreduceMax;
+    send_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
+    recv_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
     char value = 'a' + rank;
     char peer_value = 'a' + 1 - rank;
 
-    MLOG_Assert(sizeof(RTSMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(sizeof(FINMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(device.mr_size >= CACHE_LINE_SIZE * 3 + config.max_msg_size * 2, "");
+    MLOG_Assert(sizeof(CtrlMsg) <= CACHE_LINE_SIZE, "");
     char *ptr = (char*) device.mr_addr;
-    rtsMsg = (RTSMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    finMsg = (FINMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    control_recv_buf = (void*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    void *send_buf = ptr;
-    ptr += config.max_msg_size;
-    void *recv_buf = ptr;
-    checkAndPostRecvs(&device, control_recv_buf, CACHE_LINE_SIZE, device.dev_mr->lkey, control_recv_buf);
-
-    if (rank == 0) {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
-          struct ibv_wc wc;
-          // post one rendezvous send
-          if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-          postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-          // wait for send RTS to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for recv FIN to complete
-          wc = pollRecvCQ(&device);
-          handleFIN(wc);
-
-          // receive a rendezvous recv
-          // wait for RTS, post RDMA_Read
-          wc = pollRecvCQ(&device);
-          handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-          // wait for send RDMA_Read to complete, post FIN
-          wc = pollCQ(device.send_cq);
-          handleReadCompletion(&device, wc);
-          // wait for send FIN to complete, check buffer
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send FIN completion failed!\n");
-          if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-        });
-    } else {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
-          struct ibv_wc wc;
-          // receive a rendezvous recv
-          // wait for RTS, post RDMA_Read
-          wc = pollRecvCQ(&device);
-          handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-          // wait for send RDMA_Read to complete, post FIN
-          wc = pollCQ(device.send_cq);
-          handleReadCompletion(&device, wc);
-          // wait for send FIN to complete, check buffer
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send FIN completion failed!\n");
-          if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-
-          // post one rendezvous send
-          if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-          postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-          // wait for send RTS to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for recv FIN to complete
-          wc = pollRecvCQ(&device);
-          handleFIN(wc);
-        });
+    ctrl_pool.init(ctrl_capacity, false, ptr);
+    ptr += ctrl_size;
+    initRecvPool(&device, ptr, CACHE_LINE_SIZE, device.dev_mr->lkey);
+    ptr += recv_slots_size;
+    char *send_buf = ptr;
+    ptr += (size_t) max_window * config.max_msg_size;
+    char *recv_buf = ptr;
+
+    // transfers completed and not yet accounted to a burst: the peer may
+    // start its burst before this rank has left the previous one
+    int sends_done = 0, recvs_done = 0;
+    // RTSs seen so far: picks the receive buffer
+    uint64_t rts_count = 0;
+    for (size_t window : config.windows) {
+        result_context.set("config.window", window);
+        if (rank == 0 && output_format == OutputFormat::TABLE && config.windows.size() > 1)
+            printf("Window: %lu\n", window);
+        for (size_t chunk_size : config.chunk_sizes) {
+            result_context.set("config.chunk_size", chunk_size);
+            if (rank == 0 && output_format == OutputFormat::TABLE && config.chunk_sizes.size() > 1)
+                printf("Chunk size: %lu\n", chunk_size);
+
+            struct ibv_wc wcs[16];
+            auto progress = [&]() {
+                tryPollCQBatch(&device, device.send_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Send completion failed! %d %d\n", wc.status, wc.opcode);
+                    if (wc.opcode == IBV_WC_SEND) {
+                        ctrl_pool.free((CtrlMsg*) wc.wr_id);
+                    } else {
+                        // check every chunk as it lands
+                        char *chunk;
+                        uint32_t length;
+                        if (handleReadCompletion(&device, wc, &chunk, &length)) ++recvs_done;
+                        if (config.touch_data) check_buffer(chunk, length, peer_value);
+                    }
+                });
+                tryPollCQBatch(&device, device.recv_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!\n");
+                    if (wc.imm_data == MSG_RTS) {
+                        char *buf = recv_buf + rts_count++ % max_window * config.max_msg_size;
+                        handleRTS(&device, wc, buf, config.max_msg_size, device.dev_mr, NULL);
+                    } else {
+                        handleFIN(&device, wc);
+                        ++sends_done;
+                    }
+                    releaseRecv(&device, wc);
+                });
+                int ret = refillRecvs(&device);
+                MLOG_Assert(ret == 0, "Post Recv failed!\n");
+            };
+            // post a window of rendezvous sends and wait for their FINs
+            auto rdv_send = [&](int msg_size) {
+                for (size_t i = 0; i < window; ++i) {
+                    char *buf = send_buf + i * config.max_msg_size;
+                    if (config.touch_data) write_buffer(buf, msg_size, value);
+                    postRTS(&device, 1-rank, buf, msg_size, device.dev_mr, chunk_size, NULL);
+                }
+                while (sends_done < (int) window) progress();
+                sends_done -= window;
+            };
+            // receive a window of rendezvous sends
+            auto rdv_recv = [&](int msg_size) {
+                while (recvs_done < (int) window) progress();
+                recvs_done -= window;
+            };
+
+            if (rank == 0) {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
+                    rdv_send(msg_size);
+                    rdv_recv(msg_size);
+                }, {0, 1}, {(int) window, true});
+            } else {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
+                    rdv_recv(msg_size);
+                    rdv_send(msg_size);
+                }, {0, 1}, {(int) window, true});
+            }
+        }
     }
 
+    ctrl_pool.fini();
+    send_ctx_pool.fini();
+    recv_ctx_pool.fini();
     ibv::finalize(&device);
     return 0;
 }
@@ -215,7 +372,8 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
-}
\ No newline at end of file
+}
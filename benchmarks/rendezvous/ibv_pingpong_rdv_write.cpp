@@ -1,13 +1,21 @@
 #include "bench_common.hpp"
 #include "ibv_common.hpp"
+#include "ctx_pool.hpp"
+#include "rdv_write_ctx.hpp"
 using namespace std;
 using namespace bench;
 using namespace ibv;
 
 struct Config {
     bool touch_data = true;
+    bool ctx_pool = true;
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
+    // chunk sizes to sweep; 0: the whole message in one RDMA operation
+    vector<size_t> chunk_sizes = {0};
+    int pipeline_depth = 4;
+    // rendezvous transfers in flight per direction to sweep
+    vector<size_t> windows = {1};
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -19,6 +27,16 @@ Config parseArgs(int argc, char **argv) {
             {"min-msg-size", required_argument, 0, 'a'},
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
+            {"ctx-alloc",    required_argument, 0, 'A'},
+            {"chunk-size",   required_argument, 0, 'c'},
+            {"pipeline-depth", required_argument, 0, 'D'},
+            {"window",       required_argument, 0, 'w'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
     while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
         switch (opt) {
@@ -31,31 +49,64 @@ Config parseArgs(int argc, char **argv) {
             case 't':
                 config.touch_data = atoi(optarg);
                 break;
+            case 'A':
+                if (strcmp(optarg, "pool") == 0) {
+                    config.ctx_pool = true;
+                } else if (strcmp(optarg, "heap") == 0) {
+                    config.ctx_pool = false;
+                } else {
+                    fprintf(stderr, "Unknown context allocator %s (pool or heap)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                config.chunk_sizes = parse_sizes(optarg);
+                break;
+            case 'D':
+                config.pipeline_depth = atoi(optarg);
+                break;
+            case 'w':
+                config.windows = parse_sizes(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
-struct SendCtx {
-    void *buf;
-    uint32_t size;
-    ibv_mr *mr;
-    void *user_context;
-    uintptr_t recv_ctx; // 8 bytes
-};
-
-struct RecvCtx {
-    void *buf;
-    uint32_t size;
-    ibv_mr *mr;
-    void *user_context;
-};
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.ctx_alloc", config.ctx_pool ? "pool" : "heap");
+    result_context.set("config.pipeline_depth", config.pipeline_depth);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+}
 
 struct RTSMsg {
     uintptr_t send_ctx; // 8 bytes
-    uint32_t size; // 8 bytes
+    uint32_t size; // 4 bytes
+    uint32_t chunk_size; // 4 bytes
 };
 
 struct RTRMsg {
@@ -66,7 +117,15 @@ struct RTRMsg {
 };
 
 struct FINMsg {
-    uintptr_t recv_ctx;
+    uintptr_t recv_ctx; // 8 bytes
+    uintptr_t send_ctx; // 8 bytes, for the completion of the FIN
+};
+
+// A control message in registered memory, one per send until it completes.
+union CtrlMsg {
+    RTSMsg rts;
+    RTRMsg rtr;
+    FINMsg fin;
 };
 
 enum MsgType {
@@ -75,173 +134,279 @@ enum MsgType {
     MSG_FIN
 };
 
-RTSMsg *rtsMsg;
-RTRMsg *rtrMsg;
-FINMsg *finMsg;
-void *control_recv_buf;
-
-struct ibv_wc pollRecvCQ(Device *device) {
-    struct ibv_wc wc = pollCQ(device->recv_cq);
-    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv RTS completion failed!\n");
-    --device->posted_recv_num;
-    checkAndPostRecvs(device, control_recv_buf, CACHE_LINE_SIZE, device->dev_mr->lkey, control_recv_buf);
-    return wc;
+// Immediate data of the control messages: the type in the low 8 bits, the
+// chunk a FIN stands for above them.
+inline uint32_t makeImm(MsgType type, uint32_t chunk = 0) {
+    return type | chunk << 8;
+}
+
+// wr_id of a FIN: its CtrlMsg | WR_FIN (CtrlMsgs are cache-line aligned)
+const uint64_t WR_FIN = 1;
+
+// protocol contexts, at most CTX_POOL_CAPACITY in flight
+const int CTX_POOL_CAPACITY = 1024;
+CtxPool<SendCtx> send_ctx_pool;
+CtxPool<RecvCtx> recv_ctx_pool;
+CtxPool<CtrlMsg> ctrl_pool;
+// chunk writes in flight per transfer
+int pipeline_depth;
+
+inline uint32_t numChunks(uint32_t size, uint32_t chunk_size) {
+    if (chunk_size == 0 || chunk_size >= size) return 1;
+    return (size + chunk_size - 1) / chunk_size;
 }
 
-void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
-    SendCtx *ctx = (SendCtx*) malloc(sizeof(SendCtx));
+CtrlMsg *allocCtrl() {
+    CtrlMsg *msg = ctrl_pool.alloc();
+    MLOG_Assert(msg != NULL, "Too many control messages in flight!\n");
+    return msg;
+}
+
+// The slot goes back to ctrl_pool when the send completes.
+void postCtrl(Device *device, int rank, CtrlMsg *msg, uint32_t size, uint32_t imm, uint64_t tag = 0) {
+    int ret = postSendImm(device, rank, msg, size, device->dev_mr->lkey, imm, (void*) ((uint64_t) msg | tag));
+    MLOG_Assert(ret == 0, "\n");
+}
+
+void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, uint32_t chunk_size,
+             void *user_context) {
+    SendCtx *ctx = send_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many sends in flight!\n");
     ctx->buf = buf;
     ctx->size = size;
     ctx->mr = mr;
     ctx->user_context = user_context;
-    rtsMsg->send_ctx = (uintptr_t) ctx;
-    rtsMsg->size = size;
-    int ret = postSendImm(device, rank, rtsMsg, sizeof(RTSMsg), device->dev_mr->lkey, MSG_RTS, NULL);
-    MLOG_Assert(ret == 0, "\n");
+    ctx->chunk_size = chunk_size == 0 ? size : chunk_size;
+    ctx->num_chunks = numChunks(size, chunk_size);
+    ctx->posted_chunks = ctx->done_chunks = ctx->fin_chunks = 0;
+    CtrlMsg *msg = allocCtrl();
+    msg->rts.send_ctx = (uintptr_t) ctx;
+    msg->rts.size = size;
+    msg->rts.chunk_size = ctx->chunk_size;
+    postCtrl(device, rank, msg, sizeof(RTSMsg), makeImm(MSG_RTS));
 }
 
 void handleRTS(Device *device, struct ibv_wc wc, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
-    MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == MSG_RTS, "");
-    RTSMsg *recvRTSMsg = (RTSMsg*) wc.wr_id;
+    MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == makeImm(MSG_RTS), "");
+    RTSMsg *recvRTSMsg = (RTSMsg*) recvBuf(device, wc);
     MLOG_Assert(recvRTSMsg->size <= size, "");
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
-    RecvCtx *ctx = (RecvCtx*) malloc(sizeof(RecvCtx));
-    ctx->size = size;
+    int src_rank = ibv::qpRank(device, wc.qp_num);
+    RecvCtx *ctx = recv_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many receives in flight!\n");
+    ctx->size = recvRTSMsg->size;
     ctx->buf = buf;
     ctx->mr = mr;
     ctx->user_context = user_context;
-    rtrMsg->send_ctx = recvRTSMsg->send_ctx;
-    rtrMsg->recv_ctx = (uintptr_t) ctx;
-    rtrMsg->remote_addr = (uintptr_t) buf;
-    rtrMsg->rkey = mr->rkey;
-    int ret= postSendImm(device, src_rank, rtrMsg, sizeof(RTRMsg),
-                         device->dev_mr->lkey, MSG_RTR, NULL);
+    ctx->chunk_size = recvRTSMsg->chunk_size;
+    ctx->num_chunks = numChunks(ctx->size, ctx->chunk_size);
+    ctx->done_chunks = 0;
+    CtrlMsg *msg = allocCtrl();
+    msg->rtr.send_ctx = recvRTSMsg->send_ctx;
+    msg->rtr.recv_ctx = (uintptr_t) ctx;
+    msg->rtr.remote_addr = (uintptr_t) buf;
+    msg->rtr.rkey = mr->rkey;
+    postCtrl(device, src_rank, msg, sizeof(RTRMsg), makeImm(MSG_RTR));
+}
+
+// Post the write of the next chunk.
+void postChunk(Device *device, int rank, SendCtx *ctx) {
+    uint32_t offset = ctx->posted_chunks++ * ctx->chunk_size;
+    uint32_t length = min(ctx->chunk_size, ctx->size - offset);
+    int ret = postWrite(device, rank, (char*) ctx->buf + offset, length, ctx->mr->lkey,
+                        ctx->remote_addr + offset, ctx->rkey, ctx);
     MLOG_Assert(ret == 0, "\n");
 }
 
 void handleRTR(Device *device, struct ibv_wc wc) {
-    MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == MSG_RTR, "");
-    RTRMsg *recvRTRMsg = (RTRMsg*) wc.wr_id;
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
+    MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == makeImm(MSG_RTR), "");
+    RTRMsg *recvRTRMsg = (RTRMsg*) recvBuf(device, wc);
+    int src_rank = ibv::qpRank(device, wc.qp_num);
     SendCtx *ctx = (SendCtx*)recvRTRMsg->send_ctx;
     ctx->recv_ctx = recvRTRMsg->recv_ctx;
-    int ret = postWrite(device, src_rank, ctx->buf, ctx->size, ctx->mr->lkey,
-                        recvRTRMsg->remote_addr, recvRTRMsg->rkey, ctx);
-
-    MLOG_Assert(ret == 0, "\n");
+    ctx->remote_addr = recvRTRMsg->remote_addr;
+    ctx->rkey = recvRTRMsg->rkey;
+    while (ctx->posted_chunks < ctx->num_chunks && (int) ctx->posted_chunks < pipeline_depth)
+        postChunk(device, src_rank, ctx);
 }
 
+// A chunk is written: tell the receiver with a FIN and write the next one.
 void handleWriteCompletion(Device *device, struct ibv_wc wc) {
     MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "Write completion failed! %d %d\n", wc.status, wc.opcode);
     SendCtx *ctx = (SendCtx*) wc.wr_id;
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
-    finMsg->recv_ctx = ctx->recv_ctx;
-    delete ctx;
-    int ret = postSendImm(device, src_rank, finMsg, sizeof(FINMsg),
-                         device->dev_mr->lkey, MSG_FIN, NULL);
-    MLOG_Assert(ret == 0, "\n");
+    int src_rank = ibv::qpRank(device, wc.qp_num);
+    CtrlMsg *msg = allocCtrl();
+    msg->fin.recv_ctx = ctx->recv_ctx;
+    msg->fin.send_ctx = (uintptr_t) ctx;
+    postCtrl(device, src_rank, msg, sizeof(FINMsg), makeImm(MSG_FIN, ctx->done_chunks++), WR_FIN);
+    if (ctx->posted_chunks < ctx->num_chunks) postChunk(device, src_rank, ctx);
+}
+
+// A control message is sent. A send transfer is complete once all of its
+// FINs are: until then the sender has to keep progressing, as a FIN may
+// wait for a receive buffer at the peer.
+void handleCtrlCompletion(struct ibv_wc wc) {
+    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send completion failed! %d %d\n", wc.status, wc.opcode);
+    CtrlMsg *msg = (CtrlMsg*) (wc.wr_id & ~WR_FIN);
+    if (wc.wr_id & WR_FIN) {
+        SendCtx *ctx = (SendCtx*) msg->fin.send_ctx;
+        if (++ctx->fin_chunks == ctx->num_chunks) {
+            *(bool*) ctx->user_context = true;
+            send_ctx_pool.free(ctx);
+        }
+    }
+    ctrl_pool.free(msg);
 }
 
-void handleFIN(struct ibv_wc wc) {
-    MLOG_Assert(wc.imm_data == MSG_FIN, "Recv FIN failed");
-    FINMsg *recvFINMsg = (FINMsg*) wc.wr_id;
+// A chunk has landed at [*chunk, *chunk + *length); the transfer is
+// complete with the FIN of its last chunk.
+void handleFIN(Device *device, struct ibv_wc wc, char **chunk, uint32_t *length) {
+    MLOG_Assert((wc.imm_data & 0xff) == MSG_FIN, "Recv FIN failed");
+    FINMsg *recvFINMsg = (FINMsg*) recvBuf(device, wc);
     RecvCtx *ctx = (RecvCtx*) recvFINMsg->recv_ctx;
-    delete ctx;
+    uint32_t offset = (wc.imm_data >> 8) * ctx->chunk_size;
+    *chunk = (char*) ctx->buf + offset;
+    *length = min(ctx->chunk_size, ctx->size - offset);
+    if (++ctx->done_chunks < ctx->num_chunks) return;
+    *(bool*) ctx->user_context = true;
+    recv_ctx_pool.free(ctx);
 }
 
+// Rendezvous pingpong with --chunk-size: the sender writes the message in
+// chunks, with up to --pipeline-depth writes in flight, and sends a FIN
+// for every chunk once its write completes; a send is done once all of its
+// FINs are. The receiver checks each chunk as its FIN arrives. With
+// --window, every ping and pong is a burst of that many concurrent
+// transfers, each from its own buffer. Every window and chunk size of the
+// lists is swept over all message sizes.
 int run(Config config) {
+    MLOG_Assert(config.pipeline_depth > 0, "pipeline-depth must be positive\n");
+    MLOG_Assert(config.windows.front() > 0 && config.windows.back() <= CTX_POOL_CAPACITY,
+                "window must be in [1, %d]\n", CTX_POOL_CAPACITY);
+    pipeline_depth = config.pipeline_depth;
+    int max_window = config.windows.back();
     Device device;
     DeviceConfig deviceConfig;
-    deviceConfig.mr_size = CACHE_LINE_SIZE * 4 + config.max_msg_size * 2;
+    // Send WRs complete in order: a FIN still in flight holds back the
+    // write posted after it, so a transfer has at most pipeline_depth
+    // writes and as many FINs in flight, after its RTS. The peer's next
+    // window may start meanwhile: one RTR for each of its transfers.
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, max_window * (2 * config.pipeline_depth + 2));
+    // the RTSs or RTRs, and the FINs of one round of writes; more FINs wait
+    // at the sender (RNR) until the slots are reposted
+    deviceConfig.min_recv_num = deviceConfig.max_recv_num =
+            max(deviceConfig.max_recv_num, max_window * (config.pipeline_depth + 1));
+    deviceConfig.max_cqe_num = max(deviceConfig.max_send_num, deviceConfig.max_recv_num) + 1;
+    // every control message in flight holds a send WR
+    int ctrl_capacity = deviceConfig.max_send_num;
+    size_t ctrl_size = CtxPool<CtrlMsg>::blockSize(ctrl_capacity);
+    size_t recv_slots_size = (size_t) deviceConfig.max_recv_num * CACHE_LINE_SIZE;
+    deviceConfig.mr_size = ctrl_size + recv_slots_size + (size_t) max_window * config.max_msg_size * 2;
     init(NULL, &device, deviceConfig);
+    describeDevice(&device, result_context);
+    schedule.agree_max = pmAllreduceMax;
+    send_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
+    recv_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
     char value = 'a' + rank;
     char peer_value = 'a' + 1 - rank;
 
-    MLOG_Assert(sizeof(RTSMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(sizeof(RTRMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(sizeof(FINMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(device.mr_size >= CACHE_LINE_SIZE * 4 + config.max_msg_size * 2, "");
+    MLOG_Assert(sizeof(CtrlMsg) <= CACHE_LINE_SIZE, "");
     char *ptr = (char*) device.mr_addr;
-    rtsMsg = (RTSMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    rtrMsg = (RTRMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    finMsg = (FINMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    control_recv_buf = (void*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    void *send_buf = ptr;
-    ptr += config.max_msg_size;
-    void *recv_buf = ptr;
-    checkAndPostRecvs(&device, control_recv_buf, CACHE_LINE_SIZE, device.dev_mr->lkey, control_recv_buf);
-
-    if (rank == 0) {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
-            struct ibv_wc wc;
-            // post one rendezvous send
-            if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-            postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-            // wait for send to complete
-            wc = pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-            // wait for one recv to complete
-            wc = pollRecvCQ(&device);
-            handleRTR(&device, wc);
-            // wait for write to complete
-            wc = pollCQ(device.send_cq);
-            handleWriteCompletion(&device, wc);
-            // wait for FIN to complete
-            wc = pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send FIN completion failed!\n");
-
-            // receive a rendezvous recv
-            // wait for RTS, post RTR
-            wc = pollRecvCQ(&device);
-            handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-            // wait for send to complete
-            wc = pollCQ(device.send_cq);
-            MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTR completion failed! %d %d\n", wc.status, wc.opcode);
-            // wait for FIN, check buffer
-            wc = pollRecvCQ(&device);
-            handleFIN(wc);
-            if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-        });
-    } else {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
-          struct ibv_wc wc;
-          // receive a rendezvous recv
-          // wait for RTS, post RTR
-          wc = pollRecvCQ(&device);
-          handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTR completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for FIN, check buffer
-          wc = pollRecvCQ(&device);
-          handleFIN(wc);
-          if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-
-          // post one rendezvous send
-          if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-          postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for one recv to complete
-          wc = pollRecvCQ(&device);
-          handleRTR(&device, wc);
-          // wait for write to complete
-          wc = pollCQ(device.send_cq);
-          handleWriteCompletion(&device, wc);
-          // wait for FIN to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send FIN completion failed!\n");
-        });
+    ctrl_pool.init(ctrl_capacity, false, ptr);
+    ptr += ctrl_size;
+    initRecvPool(&device, ptr, CACHE_LINE_SIZE, device.dev_mr->lkey);
+    ptr += recv_slots_size;
+    char *send_buf = ptr;
+    ptr += (size_t) max_window * config.max_msg_size;
+    char *recv_buf = ptr;
+
+    // completion flags of the transfers, by buffer. The peer may start its
+    // next window before this rank has left the previous one, so receives
+    // complete in the order of the RTSs.
+    bool *send_done = new bool[max_window]();
+    bool *recv_done = new bool[max_window]();
+    // RTSs seen so far and receives accounted to a window: pick the buffer
+    uint64_t rts_count = 0, recv_count = 0;
+    for (size_t window : config.windows) {
+        result_context.set("config.window", window);
+        if (rank == 0 && output_format == OutputFormat::TABLE && config.windows.size() > 1)
+            printf("Window: %lu\n", window);
+        for (size_t chunk_size : config.chunk_sizes) {
+            result_context.set("config.chunk_size", chunk_size);
+            if (rank == 0 && output_format == OutputFormat::TABLE && config.chunk_sizes.size() > 1)
+                printf("Chunk size: %lu\n", chunk_size);
+
+            struct ibv_wc wcs[16];
+            auto progress = [&]() {
+                tryPollCQBatch(&device, device.send_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Send completion failed! %d %d\n", wc.status, wc.opcode);
+                    if (wc.opcode == IBV_WC_SEND)
+                        handleCtrlCompletion(wc);
+                    else
+                        handleWriteCompletion(&device, wc);
+                });
+                tryPollCQBatch(&device, device.recv_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "Recv completion failed!\n");
+                    if (wc.imm_data == makeImm(MSG_RTS)) {
+                        int slot = rts_count++ % max_window;
+                        handleRTS(&device, wc, recv_buf + slot * config.max_msg_size, config.max_msg_size,
+                                  device.dev_mr, &recv_done[slot]);
+                    } else if (wc.imm_data == makeImm(MSG_RTR)) {
+                        handleRTR(&device, wc);
+                    } else {
+                        // check every chunk as it lands
+                        char *chunk;
+                        uint32_t length;
+                        handleFIN(&device, wc, &chunk, &length);
+                        if (config.touch_data) check_buffer(chunk, length, peer_value);
+                    }
+                    releaseRecv(&device, wc);
+                });
+                int ret = refillRecvs(&device);
+                MLOG_Assert(ret == 0, "Post Recv failed!\n");
+            };
+            // post a window of rendezvous sends and wait for their writes
+            auto rdv_send = [&](int msg_size) {
+                for (size_t i = 0; i < window; ++i) {
+                    char *buf = send_buf + i * config.max_msg_size;
+                    if (config.touch_data) write_buffer(buf, msg_size, value);
+                    postRTS(&device, 1-rank, buf, msg_size, device.dev_mr, chunk_size, &send_done[i]);
+                }
+                for (size_t i = 0; i < window; ++i) {
+                    while (!send_done[i]) progress();
+                    send_done[i] = false;
+                }
+            };
+            // receive a window of rendezvous sends
+            auto rdv_recv = [&](int msg_size) {
+                for (size_t i = 0; i < window; ++i) {
+                    int slot = recv_count++ % max_window;
+                    while (!recv_done[slot]) progress();
+                    recv_done[slot] = false;
+                }
+            };
+
+            if (rank == 0) {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
+                    rdv_send(msg_size);
+                    rdv_recv(msg_size);
+                }, {0, 1}, {(int) window, true});
+            } else {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
+                    rdv_recv(msg_size);
+                    rdv_send(msg_size);
+                }, {0, 1}, {(int) window, true});
+            }
+        }
     }
 
+    delete[] send_done;
+    delete[] recv_done;
+    ctrl_pool.fini();
+    send_ctx_pool.fini();
+    recv_ctx_pool.fini();
     finalize(&device);
     return 0;
 }
@@ -249,7 +414,8 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include "bench_common.hpp"
 #include "ibv_common.hpp"
+#include "ctx_pool.hpp"
 #include "lcm_archive.h"
 using namespace std;
 using namespace bench;
@@ -7,8 +8,14 @@ using namespace ibv;
 
 struct Config {
     bool touch_data = true;
+    bool ctx_pool = true;
     int min_msg_size = 8;
     int max_msg_size = 64 * 1024;
+    // chunk sizes to sweep; 0: the whole message in one RDMA operation
+    vector<size_t> chunk_sizes = {0};
+    int pipeline_depth = 4;
+    // rendezvous transfers in flight per direction to sweep
+    vector<size_t> windows = {1};
 };
 
 Config parseArgs(int argc, char **argv) {
@@ -20,6 +27,16 @@ Config parseArgs(int argc, char **argv) {
             {"min-msg-size", required_argument, 0, 'a'},
             {"max-msg-size", required_argument, 0, 'b'},
             {"touch-data",   required_argument, 0, 't'},
+            {"ctx-alloc",    required_argument, 0, 'A'},
+            {"chunk-size",   required_argument, 0, 'c'},
+            {"pipeline-depth", required_argument, 0, 'D'},
+            {"window",       required_argument, 0, 'w'},
+            {"sizes",        required_argument, 0, 'S'},
+            {"iterations",   required_argument, 0, 'n'},
+            {"warmup",       required_argument, 0, 'W'},
+            {"time-budget",  required_argument, 0, 'T'},
+            {"output",       required_argument, 0, 'o'},
+            {0,              0,                 0, 0},
     };
     while ((opt = getopt_long(argc, argv, "t:", long_options, NULL)) != -1) {
         switch (opt) {
@@ -32,18 +49,72 @@ Config parseArgs(int argc, char **argv) {
             case 't':
                 config.touch_data = atoi(optarg);
                 break;
+            case 'A':
+                if (strcmp(optarg, "pool") == 0) {
+                    config.ctx_pool = true;
+                } else if (strcmp(optarg, "heap") == 0) {
+                    config.ctx_pool = false;
+                } else {
+                    fprintf(stderr, "Unknown context allocator %s (pool or heap)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                config.chunk_sizes = parse_sizes(optarg);
+                break;
+            case 'D':
+                config.pipeline_depth = atoi(optarg);
+                break;
+            case 'w':
+                config.windows = parse_sizes(optarg);
+                break;
+            case 'S':
+                schedule.sizes = parse_sizes(optarg);
+                break;
+            case 'n':
+                schedule.iterations = schedule.iterations_large = atoi(optarg);
+                break;
+            case 'W':
+                schedule.warmup = schedule.warmup_large = atoi(optarg);
+                break;
+            case 'T':
+                schedule.time_budget = atof(optarg) / 1000;
+                break;
+            case 'o':
+                setOutputFormat(optarg);
+                break;
             default:
                 break;
         }
     }
+    if (!schedule.sizes.empty()) {
+        config.min_msg_size = schedule.sizes.front();
+        config.max_msg_size = schedule.sizes.back();
+    }
     return config;
 }
 
+// Fields of the result records that describe this run.
+void reportConfig(const Config &config) {
+    result_context.set("config.touch_data", config.touch_data);
+    result_context.set("config.ctx_alloc", config.ctx_pool ? "pool" : "heap");
+    result_context.set("config.pipeline_depth", config.pipeline_depth);
+    result_context.set("config.min_msg_size", config.min_msg_size);
+    result_context.set("config.max_msg_size", config.max_msg_size);
+}
+
 struct SendCtx {
     void *buf;
     uint32_t size;
     ibv_mr *mr;
     void *user_context;
+    uintptr_t remote_addr;
+    uint32_t rkey;
+    uint32_t recv_ctx_key;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint32_t posted_chunks;  // writes posted
+    uint32_t done_chunks;    // writes completed
 };
 
 struct RecvCtx {
@@ -51,18 +122,28 @@ struct RecvCtx {
     uint32_t size;
     ibv_mr *mr;
     void *user_context;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint32_t done_chunks;    // writes landed
 };
 
 struct RTSMsg {
     uintptr_t send_ctx; // 8 bytes
-    uint32_t size; // 8 bytes
+    uint32_t size; // 4 bytes
+    uint32_t chunk_size; // 4 bytes
 };
 
 struct RTRMsg {
     uintptr_t send_ctx; // 8 bytes
     uintptr_t remote_addr; // 8 bytes
     uint32_t rkey; // 4 bytes
-    uint16_t recv_ctx_key; // 2 bytes
+    uint32_t recv_ctx_key; // 4 bytes
+};
+
+// A control message in registered memory, one per send until it completes.
+union CtrlMsg {
+    RTSMsg rts;
+    RTRMsg rtr;
 };
 
 enum MsgType {
@@ -71,159 +152,250 @@ enum MsgType {
 };
 
 LCM_archive_t recv_ctx_archive;
-RTSMsg *rtsMsg;
-RTRMsg *rtrMsg;
-void *control_recv_buf;
-
-struct ibv_wc pollRecvCQ(Device *device) {
-    struct ibv_wc wc = pollCQ(device->recv_cq);
-    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Recv RTS completion failed!\n");
-    --device->posted_recv_num;
-    checkAndPostRecvs(device, control_recv_buf, CACHE_LINE_SIZE, device->dev_mr->lkey, control_recv_buf);
-    return wc;
+// protocol contexts, at most CTX_POOL_CAPACITY in flight
+const int CTX_POOL_CAPACITY = 1024;
+CtxPool<SendCtx> send_ctx_pool;
+CtxPool<RecvCtx> recv_ctx_pool;
+CtxPool<CtrlMsg> ctrl_pool;
+// chunk writes in flight per transfer
+int pipeline_depth;
+
+inline uint32_t numChunks(uint32_t size, uint32_t chunk_size) {
+    if (chunk_size == 0 || chunk_size >= size) return 1;
+    return (size + chunk_size - 1) / chunk_size;
+}
+
+CtrlMsg *allocCtrl() {
+    CtrlMsg *msg = ctrl_pool.alloc();
+    MLOG_Assert(msg != NULL, "Too many control messages in flight!\n");
+    return msg;
+}
+
+// The slot goes back to ctrl_pool when the send completes.
+void postCtrl(Device *device, int rank, CtrlMsg *msg, uint32_t size, uint32_t imm) {
+    int ret = postSendImm(device, rank, msg, size, device->dev_mr->lkey, imm, msg);
+    MLOG_Assert(ret == 0, "\n");
 }
 
-void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
-    SendCtx *ctx = (SendCtx*) malloc(sizeof(SendCtx));
+void postRTS(Device *device, int rank, void *buf, uint32_t size, struct ibv_mr *mr, uint32_t chunk_size,
+             void *user_context) {
+    SendCtx *ctx = send_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many sends in flight!\n");
     ctx->buf = buf;
     ctx->size = size;
     ctx->mr = mr;
     ctx->user_context = user_context;
-    rtsMsg->send_ctx = (uintptr_t) ctx;
-    rtsMsg->size = size;
-    int ret = postSendImm(device, rank, rtsMsg, sizeof(RTSMsg), device->dev_mr->lkey, MSG_RTS, NULL);
-    MLOG_Assert(ret == 0, "\n");
+    ctx->chunk_size = chunk_size == 0 ? size : chunk_size;
+    ctx->num_chunks = numChunks(size, chunk_size);
+    ctx->posted_chunks = ctx->done_chunks = 0;
+    CtrlMsg *msg = allocCtrl();
+    msg->rts.send_ctx = (uintptr_t) ctx;
+    msg->rts.size = size;
+    msg->rts.chunk_size = ctx->chunk_size;
+    postCtrl(device, rank, msg, sizeof(RTSMsg), MSG_RTS);
 }
 
 void handleRTS(Device *device, struct ibv_wc wc, void *buf, uint32_t size, struct ibv_mr *mr, void *user_context) {
     MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == MSG_RTS, "");
-    RTSMsg *recvRTSMsg = (RTSMsg*) wc.wr_id;
+    RTSMsg *recvRTSMsg = (RTSMsg*) recvBuf(device, wc);
     MLOG_Assert(recvRTSMsg->size <= size, "");
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
-    RecvCtx *ctx = (RecvCtx*) malloc(sizeof(RecvCtx));
+    int src_rank = ibv::qpRank(device, wc.qp_num);
+    RecvCtx *ctx = recv_ctx_pool.alloc();
+    MLOG_Assert(ctx != NULL, "Too many receives in flight!\n");
     uint64_t ctx_key;
-    int ret = LCM_archive_put(recv_ctx_archive, (uintptr_t)ctx, &ctx_key);
+    int ret = LCM_archive_put(&recv_ctx_archive, (uintptr_t)ctx, &ctx_key);
     MLOG_Assert(ret == LCM_SUCCESS, "Archive is full!\n");
-    ctx->size = size;
+    ctx->size = recvRTSMsg->size;
     ctx->buf = buf;
     ctx->mr = mr;
     ctx->user_context = user_context;
-    rtrMsg->send_ctx = recvRTSMsg->send_ctx;
-    rtrMsg->remote_addr = (uintptr_t) buf;
-    rtrMsg->rkey = mr->rkey;
-    rtrMsg->recv_ctx_key = (uint16_t) ctx_key;
-    ret= postSendImm(device, src_rank, rtrMsg, sizeof(RTRMsg),
-                         device->dev_mr->lkey, MSG_RTR, NULL);
+    ctx->chunk_size = recvRTSMsg->chunk_size;
+    ctx->num_chunks = numChunks(ctx->size, ctx->chunk_size);
+    ctx->done_chunks = 0;
+    CtrlMsg *msg = allocCtrl();
+    msg->rtr.send_ctx = recvRTSMsg->send_ctx;
+    msg->rtr.remote_addr = (uintptr_t) buf;
+    msg->rtr.rkey = mr->rkey;
+    msg->rtr.recv_ctx_key = (uint32_t) ctx_key;
+    postCtrl(device, src_rank, msg, sizeof(RTRMsg), MSG_RTR);
+}
+
+// Post the write of the next chunk. Its immediate data is the archive key
+// of the RecvCtx.
+void postChunk(Device *device, int rank, SendCtx *ctx) {
+    uint32_t offset = ctx->posted_chunks++ * ctx->chunk_size;
+    uint32_t length = min(ctx->chunk_size, ctx->size - offset);
+    int ret = postWriteImm(device, rank, (char*) ctx->buf + offset, length, ctx->mr->lkey,
+                           ctx->remote_addr + offset, ctx->rkey, ctx->recv_ctx_key, ctx);
     MLOG_Assert(ret == 0, "\n");
 }
 
 void handleRTR(Device *device, struct ibv_wc wc) {
     MLOG_Assert(wc.opcode == IBV_WC_RECV && wc.imm_data == MSG_RTR, "");
-    RTRMsg *recvRTRMsg = (RTRMsg*) wc.wr_id;
-    int src_rank = device->qp2rank[wc.qp_num % device->qp2rank_mod];
+    RTRMsg *recvRTRMsg = (RTRMsg*) recvBuf(device, wc);
+    int src_rank = ibv::qpRank(device, wc.qp_num);
     SendCtx *ctx = (SendCtx*)recvRTRMsg->send_ctx;
-    int ret = postWriteImm(device, src_rank, ctx->buf, ctx->size, ctx->mr->lkey,
-                           recvRTRMsg->remote_addr, recvRTRMsg->rkey, recvRTRMsg->recv_ctx_key, NULL);
-    MLOG_Assert(ret == 0, "\n");
-    delete ctx;
+    ctx->remote_addr = recvRTRMsg->remote_addr;
+    ctx->rkey = recvRTRMsg->rkey;
+    ctx->recv_ctx_key = recvRTRMsg->recv_ctx_key;
+    while (ctx->posted_chunks < ctx->num_chunks && (int) ctx->posted_chunks < pipeline_depth)
+        postChunk(device, src_rank, ctx);
+}
+
+// A chunk is written: write the next one. Return true once the last chunk
+// is written.
+bool handleWriteCompletion(Device *device, struct ibv_wc wc) {
+    MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "WriteImm completion failed!\n");
+    SendCtx *ctx = (SendCtx*) wc.wr_id;
+    if (ctx->posted_chunks < ctx->num_chunks) postChunk(device, ibv::qpRank(device, wc.qp_num), ctx);
+    if (++ctx->done_chunks < ctx->num_chunks) return false;
+    send_ctx_pool.free(ctx);
+    return true;
 }
 
-void handleWriteImm(struct ibv_wc wc) {
+// A chunk has landed at [*chunk, *chunk + *length). Return true for the
+// last one of its transfer.
+bool handleWriteImm(struct ibv_wc wc, char **chunk, uint32_t *length) {
     MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM, "Recv WriteImm failed");
     uint64_t ctx_key = wc.imm_data;
-    RecvCtx *ctx = (RecvCtx*) LCM_archive_remove(recv_ctx_archive, ctx_key);
-    delete ctx;
+    RecvCtx *ctx = (RecvCtx*) LCM_archive_get(&recv_ctx_archive, ctx_key);
+    MLOG_Assert(ctx != NULL, "Stale key %lu\n", ctx_key);
+    // the writes of a transfer land in order
+    uint32_t offset = ctx->done_chunks * ctx->chunk_size;
+    *chunk = (char*) ctx->buf + offset;
+    *length = min(ctx->chunk_size, ctx->size - offset);
+    if (++ctx->done_chunks < ctx->num_chunks) return false;
+    LCM_archive_remove(&recv_ctx_archive, ctx_key);
+    recv_ctx_pool.free(ctx);
+    return true;
 }
 
+// Rendezvous pingpong with --chunk-size: the sender writes the message in
+// chunks with immediate data, up to --pipeline-depth of them in flight.
+// The receiver checks each chunk as its completion arrives. With
+// --window, every ping and pong is a burst of that many concurrent
+// transfers, each from its own buffer. Every window and chunk size of the
+// lists is swept over all message sizes.
 int run(Config config) {
+    MLOG_Assert(config.pipeline_depth > 0, "pipeline-depth must be positive\n");
+    MLOG_Assert(config.windows.front() > 0 && config.windows.back() <= CTX_POOL_CAPACITY,
+                "window must be in [1, %d]\n", CTX_POOL_CAPACITY);
+    pipeline_depth = config.pipeline_depth;
+    int max_window = config.windows.back();
     Device device;
     DeviceConfig deviceConfig;
-    deviceConfig.mr_size = CACHE_LINE_SIZE * 3 + config.max_msg_size * 2;
+    // the RTSs and writes of a window of pipelines
+    deviceConfig.max_send_num = max(deviceConfig.max_send_num, max_window * (config.pipeline_depth + 1));
+    // the RTSs or RTRs, and the writes, each consuming a receive
+    deviceConfig.min_recv_num = deviceConfig.max_recv_num =
+            max(deviceConfig.max_recv_num, max_window * (config.pipeline_depth + 1));
+    deviceConfig.max_cqe_num = max(deviceConfig.max_send_num, deviceConfig.max_recv_num) + 1;
+    // every control message in flight holds a send WR
+    int ctrl_capacity = deviceConfig.max_send_num;
+    size_t ctrl_size = CtxPool<CtrlMsg>::blockSize(ctrl_capacity);
+    size_t recv_slots_size = (size_t) deviceConfig.max_recv_num * CACHE_LINE_SIZE;
+    deviceConfig.mr_size = ctrl_size + recv_slots_size + (size_t) max_window * config.max_msg_size * 2;
     init(NULL, &device, deviceConfig);
+    describeDevice(&device, result_context);
+    schedule.agree_max = pmAllreduceMax;
+    send_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
+    recv_ctx_pool.init(CTX_POOL_CAPACITY, !config.ctx_pool);
     int rank = lcm_pm_get_rank();
     int nranks = lcm_pm_get_size();
     MLOG_Assert(nranks == 2, "This benchmark requires exactly two processes\n");
     char value = 'a' + rank;
     char peer_value = 'a' + 1 - rank;
 
-    MLOG_Assert(sizeof(RTSMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(sizeof(RTRMsg) <= CACHE_LINE_SIZE, "");
-    MLOG_Assert(device.mr_size >= CACHE_LINE_SIZE * 3 + config.max_msg_size * 2, "");
+    MLOG_Assert(sizeof(CtrlMsg) <= CACHE_LINE_SIZE, "");
     char *ptr = (char*) device.mr_addr;
-    rtsMsg = (RTSMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    rtrMsg = (RTRMsg*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    control_recv_buf = (void*) ptr;
-    ptr += CACHE_LINE_SIZE;
-    void *send_buf = ptr;
-    ptr += config.max_msg_size;
-    void *recv_buf = ptr;
-    checkAndPostRecvs(&device, control_recv_buf, CACHE_LINE_SIZE, device.dev_mr->lkey, control_recv_buf);
-
-    int ret = LCM_archive_init(&recv_ctx_archive, 10); // 1024 entry
+    ctrl_pool.init(ctrl_capacity, false, ptr);
+    ptr += ctrl_size;
+    initRecvPool(&device, ptr, CACHE_LINE_SIZE, device.dev_mr->lkey);
+    ptr += recv_slots_size;
+    char *send_buf = ptr;
+    ptr += (size_t) max_window * config.max_msg_size;
+    char *recv_buf = ptr;
+
+    int ret = LCM_archive_init(&recv_ctx_archive, 10); // 1024 entry, grows on demand
     MLOG_Assert(ret == LCM_SUCCESS, "Initialize archive failed!\n");
 
-    if (rank == 0) {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
-          struct ibv_wc wc;
-          // post one rendezvous send
-          if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-          postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for one recv to complete
-          wc = pollRecvCQ(&device);
-          handleRTR(&device, wc);
-          // wait for write to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "WriteImm completion failed!\n");
-
-          // receive a rendezvous recv
-          // wait for RTS, post RTR
-          wc = pollRecvCQ(&device);
-          handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTR completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for FIN, check buffer
-          wc = pollRecvCQ(&device);
-          handleWriteImm(wc);
-          if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-        });
-    } else {
-        RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
-          struct ibv_wc wc;
-          // receive a rendezvous recv
-          // wait for RTS, post RTR
-          wc = pollRecvCQ(&device);
-          handleRTS(&device, wc, recv_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTR completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for FIN, check buffer
-          wc = pollRecvCQ(&device);
-          handleWriteImm(wc);
-          if (config.touch_data) check_buffer((char*) recv_buf, msg_size, peer_value);
-
-          // post one rendezvous send
-          if (config.touch_data) write_buffer((char*) send_buf, msg_size, value);
-          postRTS(&device, 1-rank, send_buf, msg_size, device.dev_mr, NULL);
-          // wait for send to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_SEND, "Send RTS completion failed! %d %d\n", wc.status, wc.opcode);
-          // wait for one recv to complete
-          wc = pollRecvCQ(&device);
-          handleRTR(&device, wc);
-          // wait for write to complete
-          wc = pollCQ(device.send_cq);
-          MLOG_Assert(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RDMA_WRITE, "WriteImm completion failed!\n");
-        });
+    // transfers completed and not yet accounted to a burst: the peer may
+    // start its burst before this rank has left the previous one
+    int sends_done = 0, recvs_done = 0;
+    // RTSs seen so far: picks the receive buffer
+    uint64_t rts_count = 0;
+    for (size_t window : config.windows) {
+        result_context.set("config.window", window);
+        if (rank == 0 && output_format == OutputFormat::TABLE && config.windows.size() > 1)
+            printf("Window: %lu\n", window);
+        for (size_t chunk_size : config.chunk_sizes) {
+            result_context.set("config.chunk_size", chunk_size);
+            if (rank == 0 && output_format == OutputFormat::TABLE && config.chunk_sizes.size() > 1)
+                printf("Chunk size: %lu\n", chunk_size);
+
+            struct ibv_wc wcs[16];
+            auto progress = [&]() {
+                tryPollCQBatch(&device, device.send_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Send completion failed! %d %d\n", wc.status, wc.opcode);
+                    if (wc.opcode == IBV_WC_SEND)
+                        ctrl_pool.free((CtrlMsg*) wc.wr_id);
+                    else if (handleWriteCompletion(&device, wc))
+                        ++sends_done;
+                });
+                tryPollCQBatch(&device, device.recv_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+                    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Recv completion failed!\n");
+                    if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                        // check every chunk as it lands
+                        char *chunk;
+                        uint32_t length;
+                        if (handleWriteImm(wc, &chunk, &length)) ++recvs_done;
+                        if (config.touch_data) check_buffer(chunk, length, peer_value);
+                    } else if (wc.imm_data == MSG_RTS) {
+                        char *buf = recv_buf + rts_count++ % max_window * config.max_msg_size;
+                        handleRTS(&device, wc, buf, config.max_msg_size, device.dev_mr, NULL);
+                    } else {
+                        handleRTR(&device, wc);
+                    }
+                    releaseRecv(&device, wc);
+                });
+                int ret = refillRecvs(&device);
+                MLOG_Assert(ret == 0, "Post Recv failed!\n");
+            };
+            // post a window of rendezvous sends and wait for their writes
+            auto rdv_send = [&](int msg_size) {
+                for (size_t i = 0; i < window; ++i) {
+                    char *buf = send_buf + i * config.max_msg_size;
+                    if (config.touch_data) write_buffer(buf, msg_size, value);
+                    postRTS(&device, 1-rank, buf, msg_size, device.dev_mr, chunk_size, NULL);
+                }
+                while (sends_done < (int) window) progress();
+                sends_done -= window;
+            };
+            // receive a window of rendezvous sends
+            auto rdv_recv = [&](int msg_size) {
+                while (recvs_done < (int) window) progress();
+                recvs_done -= window;
+            };
+
+            if (rank == 0) {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, true, [&](int msg_size, int iter) {
+                    rdv_send(msg_size);
+                    rdv_recv(msg_size);
+                }, {0, 1}, {(int) window, true});
+            } else {
+                RUN_VARY_MSG({config.min_msg_size, config.max_msg_size}, false, [&](int msg_size, int iter) {
+                    rdv_recv(msg_size);
+                    rdv_send(msg_size);
+                }, {0, 1}, {(int) window, true});
+            }
+        }
     }
 
-    ret = LCM_archive_fini(&recv_ctx_archive); // 1024 entry
+    ret = LCM_archive_fini(&recv_ctx_archive);
     MLOG_Assert(ret == LCM_SUCCESS, "Finalize archive failed!\n");
+    ctrl_pool.fini();
+    send_ctx_pool.fini();
+    recv_ctx_pool.fini();
     finalize(&device);
     return 0;
 }
@@ -231,7 +403,8 @@ int run(Config config) {
 int main(int argc, char **argv) {
     init(false);
     Config config = parseArgs(argc, argv);
+    reportConfig(config);
     run(config);
     finalize();
     return 0;
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #ifdef __cplusplus
@@ -11,114 +12,262 @@ extern "C" {
 
 /**
  * Used to map address to key with less bits.
+ *
+ * A key is a 32-bit immediate: the entry index in the low
+ * LCM_ARCHIVE_INDEX_BITS bits and its generation above them. The entries
+ * live in segments that double in size and are never moved, so the table
+ * grows without blocking get/remove. Free entries wait in a lock-free FIFO
+ * queue (Michael-Scott, with the links tagged against ABA), so an entry is
+ * reused only after all other free ones. remove bumps the generation of the
+ * entry with a CAS: a stale key (removed, maybe reused since) gets
+ * LCM_ARCHIVE_EMPTY from get and remove, until the generation wraps after
+ * 2^LCM_ARCHIVE_GEN_BITS reuses of the entry, i.e. after that many rounds
+ * through the free entries.
  */
 #define LCM_SUCCESS 1
 #define LCM_RETRY 0
 
-#define LCM_ARCHIVE_NTRY 3
 #define LCM_ARCHIVE_EMPTY 0
+#define LCM_ARCHIVE_INDEX_BITS 24
+#define LCM_ARCHIVE_GEN_BITS (32 - LCM_ARCHIVE_INDEX_BITS)
+#define LCM_ARCHIVE_INDEX_MASK ((1u << LCM_ARCHIVE_INDEX_BITS) - 1)
+#define LCM_ARCHIVE_GEN_MASK ((1u << LCM_ARCHIVE_GEN_BITS) - 1)
+#define LCM_ARCHIVE_MAX_SEGMENTS (LCM_ARCHIVE_INDEX_BITS + 1)
 
 typedef uint64_t LCM_archive_key_t;
 typedef uintptr_t LCM_archive_val_t;
 
 struct LCM_archive_entry_t {
     LCM_archive_val_t val;   // 8 bytes
-    char padding[64-sizeof(LCM_archive_val_t)];
+    uint64_t next;           // 8 bytes, free queue: tag << 32 | (index + 1) of the entry behind (0: none)
+    uint32_t gen;            // 4 bytes, bumped by every remove
+    char padding[64-sizeof(LCM_archive_val_t)-sizeof(uint64_t)-sizeof(uint32_t)];
 };
 
 struct LCM_archive_t {
-    volatile struct LCM_archive_entry_t* ptr;
+    // segment 0 holds 2^nbits entries, segment s > 0 the 2^(nbits+s-1)
+    // entries from index 2^(nbits+s-1) on
+    struct LCM_archive_entry_t* volatile segments[LCM_ARCHIVE_MAX_SEGMENTS];
     int nbits;
+    uint32_t next_index;     // entries below it have been handed out once
+    // tag << 32 | (index + 1) of the first and last entry of the free queue.
+    // The first one is a dummy: it is handed out once another one is queued.
+    uint64_t free_head;
+    uint64_t free_tail;
 };
 typedef struct LCM_archive_t LCM_archive_t;
 
 static int LCM_archive_init(LCM_archive_t* archive, int nbits);
 static int LCM_archive_fini(LCM_archive_t* archive);
 
-static inline int LCM_archive_put(LCM_archive_t archive,
-                                            LCM_archive_val_t value,
-                                            LCM_archive_key_t* key);
-static inline LCM_archive_val_t LCM_archive_get(LCM_archive_t archive,
-                                                 LCM_archive_key_t key);
-static inline LCM_archive_val_t LCM_archive_remove(LCM_archive_t archive,
-                                                    LCM_archive_key_t key);
+static inline int LCM_archive_put(LCM_archive_t* archive,
+                                  LCM_archive_val_t value,
+                                  LCM_archive_key_t* key);
+static inline LCM_archive_val_t LCM_archive_get(LCM_archive_t* archive,
+                                                LCM_archive_key_t key);
+static inline LCM_archive_val_t LCM_archive_remove(LCM_archive_t* archive,
+                                                   LCM_archive_key_t key);
 
 #ifdef __cplusplus
 }
 #endif
 
+static inline struct LCM_archive_entry_t* LCM_archive_alloc_segment(size_t num)
+{
+    struct LCM_archive_entry_t* seg;
+    int ret = posix_memalign((void **) &seg, 64, num * sizeof(struct LCM_archive_entry_t));
+    MLOG_Assert(ret == 0, "Memory allocation failed!\n");
+    memset(seg, 0, num * sizeof(struct LCM_archive_entry_t));
+    return seg;
+}
+
 static int LCM_archive_init(LCM_archive_t* archive, int nbits)
 {
     assert(sizeof(struct LCM_archive_entry_t) == 64);
-    size_t cap = 1 << nbits;
-    int ret = posix_memalign((void **) &archive->ptr, 64, cap * sizeof(struct LCM_archive_entry_t));
-    MLOG_Assert(ret == 0, "Memory allocation failed!\n");
+    MLOG_Assert(nbits > 0 && nbits <= LCM_ARCHIVE_INDEX_BITS, "Archive nbits out of range!\n");
     archive->nbits = nbits;
-
-    // Initialize all with EMPTY and clear lock.
-    for (size_t i = 0; i < cap; i++) {
-        // First are control.
-        archive->ptr[i].val = LCM_ARCHIVE_EMPTY;
-    }
+    for (int i = 0; i < LCM_ARCHIVE_MAX_SEGMENTS; i++)
+        archive->segments[i] = NULL;
+    archive->segments[0] = LCM_archive_alloc_segment((size_t) 1 << nbits);
+    // entry 0 starts as the dummy of the free queue
+    archive->next_index = 1;
+    archive->free_head = archive->free_tail = 1;
     return LCM_SUCCESS;
 }
 
 static int LCM_archive_fini(LCM_archive_t* archive)
 {
-    free((void*) archive->ptr);
-    archive->ptr = NULL;
+    for (int i = 0; i < LCM_ARCHIVE_MAX_SEGMENTS; i++) {
+        free((void*) archive->segments[i]);
+        archive->segments[i] = NULL;
+    }
     archive->nbits = 0;
     return LCM_SUCCESS;
 }
 
-static inline int LCM_archive_put(LCM_archive_t archive,
+// Number of entries the archive has grown to.
+static inline size_t LCM_archive_capacity(LCM_archive_t* archive)
+{
+    int num = 0;
+    while (num < LCM_ARCHIVE_MAX_SEGMENTS && archive->segments[num]) ++num;
+    return (size_t) 1 << (archive->nbits + (num > 0 ? num - 1 : 0));
+}
+
+static inline int LCM_archive_segment(int nbits, uint32_t index, uint32_t* offset)
+{
+    if (index < (1u << nbits)) {
+        *offset = index;
+        return 0;
+    }
+    int high = 31 - __builtin_clz(index);
+    *offset = index - (1u << high);
+    return high - nbits + 1;
+}
+
+// NULL if the segment of index is not there (yet)
+static inline struct LCM_archive_entry_t* LCM_archive_entry(LCM_archive_t* archive, uint32_t index)
+{
+    uint32_t offset;
+    int seg = LCM_archive_segment(archive->nbits, index, &offset);
+    struct LCM_archive_entry_t* entries = __atomic_load_n(&archive->segments[seg], __ATOMIC_ACQUIRE);
+    return entries ? &entries[offset] : NULL;
+}
+
+// For an index that has been handed out, so its segment is there.
+static inline struct LCM_archive_entry_t* LCM_archive_slot(LCM_archive_t* archive, uint32_t index)
+{
+    uint32_t offset;
+    int seg = LCM_archive_segment(archive->nbits, index, &offset);
+    return &__atomic_load_n(&archive->segments[seg], __ATOMIC_ACQUIRE)[offset];
+}
+
+// A fresh index, with its segment allocated; LCM_ARCHIVE_INDEX_MASK + 1 once
+// the index space is used up.
+static inline uint32_t LCM_archive_grow(LCM_archive_t* archive)
+{
+    uint32_t index = __atomic_fetch_add(&archive->next_index, 1, __ATOMIC_RELAXED);
+    if (index > LCM_ARCHIVE_INDEX_MASK) {
+        __atomic_store_n(&archive->next_index, LCM_ARCHIVE_INDEX_MASK + 1, __ATOMIC_RELAXED);
+        return LCM_ARCHIVE_INDEX_MASK + 1;
+    }
+    uint32_t offset;
+    int seg = LCM_archive_segment(archive->nbits, index, &offset);
+    if (!__atomic_load_n(&archive->segments[seg], __ATOMIC_ACQUIRE)) {
+        // racing threads allocate, one of them wins
+        struct LCM_archive_entry_t* expected = NULL;
+        struct LCM_archive_entry_t* fresh =
+                LCM_archive_alloc_segment((size_t) 1 << (archive->nbits + seg - 1));
+        if (!__atomic_compare_exchange_n(&archive->segments[seg], &expected, fresh, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            free(fresh);
+    }
+    return index;
+}
+
+// Append an entry to the free queue.
+static inline void LCM_archive_push(LCM_archive_t* archive, uint32_t index)
+{
+    struct LCM_archive_entry_t* entry = LCM_archive_slot(archive, index);
+    // keep the tag: a thread that still sees the entry as the tail fails its CAS
+    uint64_t next = __atomic_load_n(&entry->next, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->next, next >> 32 << 32, __ATOMIC_RELAXED);
+    uint64_t tail;
+    while (true) {
+        tail = __atomic_load_n(&archive->free_tail, __ATOMIC_ACQUIRE);
+        struct LCM_archive_entry_t* last = LCM_archive_slot(archive, (uint32_t) tail - 1);
+        next = __atomic_load_n(&last->next, __ATOMIC_ACQUIRE);
+        if (tail != __atomic_load_n(&archive->free_tail, __ATOMIC_ACQUIRE)) continue;
+        if ((uint32_t) next == 0) {
+            if (__atomic_compare_exchange_n(&last->next, &next, ((next >> 32) + 1) << 32 | (index + 1),
+                                            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                break;
+        } else {
+            // the tail lags behind: help it along
+            __atomic_compare_exchange_n(&archive->free_tail, &tail, ((tail >> 32) + 1) << 32 | (uint32_t) next,
+                                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_compare_exchange_n(&archive->free_tail, &tail, ((tail >> 32) + 1) << 32 | (index + 1),
+                                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// index + 1 of the oldest free entry (the dummy, replaced by the entry
+// behind it), 0 if there is none
+static inline uint32_t LCM_archive_pop(LCM_archive_t* archive)
+{
+    while (true) {
+        uint64_t head = __atomic_load_n(&archive->free_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&archive->free_tail, __ATOMIC_ACQUIRE);
+        // may be stale if another thread wins: the tag then fails the CAS
+        uint64_t next = __atomic_load_n(&LCM_archive_slot(archive, (uint32_t) head - 1)->next, __ATOMIC_ACQUIRE);
+        if (head != __atomic_load_n(&archive->free_head, __ATOMIC_ACQUIRE)) continue;
+        if ((uint32_t) head == (uint32_t) tail) {
+            if ((uint32_t) next == 0) return 0;
+            __atomic_compare_exchange_n(&archive->free_tail, &tail, ((tail >> 32) + 1) << 32 | (uint32_t) next,
+                                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&archive->free_head, &head,
+                                               ((head >> 32) + 1) << 32 | (uint32_t) next,
+                                               false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return (uint32_t) head;
+        }
+    }
+}
+
+static inline int LCM_archive_put(LCM_archive_t* archive,
                                   LCM_archive_val_t value,
                                   LCM_archive_key_t* key_ptr)
 {
-    LCM_archive_key_t key = (value >> 6) & ((1 << archive.nbits) - 1);
-    for (int i = 1; i <= LCM_ARCHIVE_NTRY; ++i) {
-        MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive try (%lu, %lu)\n", key, value);
-        if (archive.ptr[key].val == LCM_ARCHIVE_EMPTY) {
-            if (__sync_bool_compare_and_swap(&(archive.ptr[key].val), LCM_ARCHIVE_EMPTY,
-                                             value)) {
-                *key_ptr = key;
-                MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive (%lu, %lu) succeed!\n", key, value);
-                return LCM_SUCCESS;
-            }
+    uint32_t index;
+    uint32_t top = LCM_archive_pop(archive);
+    if (top) {
+        index = top - 1;
+    } else {
+        index = LCM_archive_grow(archive);
+        if (index > LCM_ARCHIVE_INDEX_MASK) {
+            MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive %lu RETRY!\n", value);
+            return LCM_RETRY;
         }
-        // quadratic probe
-        key += i * i;
     }
-    MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive %lu RETRY!\n", value);
-    return LCM_RETRY;
+    // the entry is ours until it is removed
+    struct LCM_archive_entry_t* entry = LCM_archive_slot(archive, index);
+    __atomic_store_n(&entry->val, value, __ATOMIC_RELAXED);
+    uint32_t gen = __atomic_load_n(&entry->gen, __ATOMIC_RELAXED);
+    // publish val before the key travels to another thread
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *key_ptr = (LCM_archive_key_t) (gen & LCM_ARCHIVE_GEN_MASK) << LCM_ARCHIVE_INDEX_BITS | index;
+    MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive (%lu, %lu) succeed!\n", *key_ptr, value);
+    return LCM_SUCCESS;
 }
 
-static inline LCM_archive_val_t LCM_archive_get(LCM_archive_t archive,
+static inline LCM_archive_val_t LCM_archive_get(LCM_archive_t* archive,
                                                 LCM_archive_key_t key)
 {
-    return archive.ptr[key].val;
+    uint32_t index = (uint32_t) key & LCM_ARCHIVE_INDEX_MASK;
+    struct LCM_archive_entry_t* entry = LCM_archive_entry(archive, index);
+    if (!entry) return LCM_ARCHIVE_EMPTY;
+    LCM_archive_val_t val = __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE);
+    uint32_t gen = __atomic_load_n(&entry->gen, __ATOMIC_ACQUIRE);
+    if ((gen & LCM_ARCHIVE_GEN_MASK) != (uint32_t) (key >> LCM_ARCHIVE_INDEX_BITS))
+        return LCM_ARCHIVE_EMPTY;
+    return val;
 }
 
-static inline LCM_archive_val_t LCM_archive_remove(LCM_archive_t archive,
+static inline LCM_archive_val_t LCM_archive_remove(LCM_archive_t* archive,
                                                    LCM_archive_key_t key)
 {
-    // A key will be hold by only one thread
-    // so no data race should occur here
-    LCM_archive_val_t val = archive.ptr[key].val;
-    archive.ptr[key].val = LCM_ARCHIVE_EMPTY;
+    uint32_t index = (uint32_t) key & LCM_ARCHIVE_INDEX_MASK;
+    struct LCM_archive_entry_t* entry = LCM_archive_entry(archive, index);
+    if (!entry) return LCM_ARCHIVE_EMPTY;
+    LCM_archive_val_t val = __atomic_load_n(&entry->val, __ATOMIC_ACQUIRE);
+    uint32_t gen = __atomic_load_n(&entry->gen, __ATOMIC_ACQUIRE);
+    // only the remover of the current generation wins
+    if ((gen & LCM_ARCHIVE_GEN_MASK) != (uint32_t) (key >> LCM_ARCHIVE_INDEX_BITS) ||
+        !__atomic_compare_exchange_n(&entry->gen, &gen, gen + 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return LCM_ARCHIVE_EMPTY;
+    __atomic_store_n(&entry->val, LCM_ARCHIVE_EMPTY, __ATOMIC_RELAXED);
+    LCM_archive_push(archive, index);
     MLOG_DBG_Log(MLOG_LOG_DEBUG, "Archive remove (%lu, %lu)\n", key, val);
-//    LCM_archive_val_t old;
-//    while (true) {
-//        old = __sync_val_compare_and_swap(&(archive.ptr[key].val), val,
-//                                          LCM_ARCHIVE_EMPTY);
-//        if (old == val) {
-//            // succeeded!
-//            break;
-//        } else {
-//            // failed! Try again!
-//            val = old;
-//        }
-//    }
     return val;
 }
 
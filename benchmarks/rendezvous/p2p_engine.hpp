@@ -0,0 +1,352 @@
+#ifndef IBVBENCH_P2P_ENGINE_HPP
+#define IBVBENCH_P2P_ENGINE_HPP
+
+#include <deque>
+#include <vector>
+#include "ibv_common.hpp"
+#include "lcm_archive.h"
+
+namespace ibv {
+
+// Point-to-point messages over a Device. Messages up to the eager threshold
+// are copied into a registered bounce buffer and sent; the receiver copies
+// them out of its receive slot. Larger ones take a rendezvous: RTS, then
+// the payload moves between the user buffers (inside a registered MR) with
+// the selected RDMA flavour. Receives match the incoming messages from any
+// source in arrival order (no tags).
+enum class RdvProtocol {
+    WRITE,      // RTS, RTR, RDMA Write, FIN
+    WRITE_IMM,  // RTS, RTR, RDMA Write with immediate data
+    READ,       // RTS, RDMA Read, FIN
+};
+
+inline const char *rdvProtocolName(RdvProtocol protocol) {
+    switch (protocol) {
+        case RdvProtocol::WRITE: return "write";
+        case RdvProtocol::WRITE_IMM: return "write_imm";
+        default: return "read";
+    }
+}
+
+struct P2PConfig {
+    // size of the bounce buffers and receive slots: the threshold can move
+    // anywhere below it at runtime
+    uint32_t max_eager_size = 8192;
+    uint32_t eager_threshold = 8192;   // eager iff size <= eager_threshold
+    RdvProtocol protocol = RdvProtocol::WRITE_IMM;
+    // eager and control messages in flight
+    int num_bounce = 16;
+};
+
+struct P2PRequest {
+    void *buf;
+    uint32_t size;      // receive: capacity when posted, message size once done
+    struct ibv_mr *mr;  // holds buf (rendezvous only)
+    int rank;           // receive: the source once matched
+    volatile bool done;
+    // rendezvous state
+    RdvProtocol protocol;
+    uintptr_t peer_req;
+};
+
+enum P2PMsgType { P2P_EAGER, P2P_RTS, P2P_RTR, P2P_FIN };
+
+struct P2PCtrlMsg {
+    uint64_t req;       // request of the sender of this message
+    uint64_t peer_req;  // request of its receiver (RTR, FIN)
+    uint64_t addr;      // RTS (read), RTR (write): the buffer to access
+    uint32_t rkey;
+    uint32_t size;
+    uint32_t protocol;  // RTS
+    uint32_t imm;       // RTR of write_imm: immediate data of the write
+};
+
+// A control message waiting for a bounce slot.
+struct P2PPendingCtrl {
+    int rank;
+    P2PMsgType type;
+    P2PCtrlMsg msg;
+};
+
+// wr_id of send WRs: a bounce slot, or the request of an RDMA operation
+const uint64_t P2P_WR_BOUNCE = 1;
+const uint64_t P2P_WR_RDMA = 2;
+const uint64_t P2P_WR_MASK = 3;
+
+struct P2P {
+    Device *device;
+    P2PConfig config;
+    char *bounce;
+    uint32_t slot_size;
+    std::vector<int> free_bounce;
+    std::deque<P2PRequest*> posted_recvs;
+    // eager messages and RTSs without a receive yet, still holding their
+    // receive slot (max_recv_num bounds them)
+    std::deque<struct ibv_wc> unexpected;
+    // control messages sent while no bounce slot was free, in order; sent
+    // by p2pProgress once the completions at hand are handled
+    std::deque<P2PPendingCtrl> pending_ctrl;
+    // receives of write_imm transfers by immediate data
+    LCM_archive_t imm_reqs;
+};
+
+inline uint32_t p2pSlotSize(const P2PConfig &config) {
+    uint32_t size = std::max(config.max_eager_size, (uint32_t) sizeof(P2PCtrlMsg));
+    return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+// Registered memory p2pInit takes: the bounce buffers and the receive pool.
+inline size_t p2pRegionSize(const P2PConfig &config, const DeviceConfig &device_config) {
+    return (size_t) (config.num_bounce + device_config.max_recv_num) * p2pSlotSize(config);
+}
+
+// region: p2pRegionSize bytes of device->dev_mr. The send queue of a QP
+// must fit num_bounce sends plus the RDMA operations in flight to it, and
+// every send WR must be signaled (no signal_interval or post_batch).
+inline void p2pInit(P2P *p, Device *device, void *region, const P2PConfig &config) {
+    MLOG_Assert(config.eager_threshold <= config.max_eager_size, "Eager threshold above the bounce buffer size\n");
+    MLOG_Assert(device->config.signal_interval <= 1 && device->config.post_batch <= 1,
+                "The p2p engine needs every send WR signaled and posted alone\n");
+    p->device = device;
+    p->config = config;
+    p->slot_size = p2pSlotSize(config);
+    p->bounce = (char*) region;
+    p->free_bounce.clear();
+    p->pending_ctrl.clear();
+    for (int i = config.num_bounce - 1; i >= 0; --i)
+        p->free_bounce.push_back(i);
+    initRecvPool(device, p->bounce + (size_t) config.num_bounce * p->slot_size,
+                 p->slot_size, device->dev_mr->lkey);
+    int ret = LCM_archive_init(&p->imm_reqs, 10); // 1024 entry, grows on demand
+    MLOG_Assert(ret == LCM_SUCCESS, "Initialize archive failed!\n");
+}
+
+inline void p2pFini(P2P *p) {
+    MLOG_Assert(p->posted_recvs.empty() && p->unexpected.empty(), "Unmatched messages left\n");
+    MLOG_Assert(p->pending_ctrl.empty(), "Control messages left unsent\n");
+    LCM_archive_fini(&p->imm_reqs);
+}
+
+inline int p2pProgress(P2P *p);
+
+// A free bounce slot, after the queued control messages; progress the
+// sends while there is none. Not from the completion handlers: p2pSendCtrl
+// queues the message there instead.
+inline int p2pGetBounce(P2P *p) {
+    while (p->free_bounce.empty() || !p->pending_ctrl.empty()) p2pProgress(p);
+    int slot = p->free_bounce.back();
+    p->free_bounce.pop_back();
+    return slot;
+}
+
+inline char *p2pBounceBuf(P2P *p, int slot) {
+    return p->bounce + (size_t) slot * p->slot_size;
+}
+
+inline void p2pSendBounce(P2P *p, int rank, int slot, uint32_t size, P2PMsgType type) {
+    int ret = postSendImm(p->device, rank, p2pBounceBuf(p, slot), size, p->device->dev_mr->lkey,
+                          type, (void*) ((uint64_t) slot << 2 | P2P_WR_BOUNCE));
+    MLOG_Assert(ret == 0, "Post Send failed!\n");
+}
+
+// Send a control message, or queue it until a bounce slot is free: it may
+// come from a completion handler, where the completions that free the
+// slots are still to be handled by the current batch.
+inline void p2pSendCtrl(P2P *p, int rank, P2PMsgType type, const P2PCtrlMsg &msg) {
+    if (p->free_bounce.empty() || !p->pending_ctrl.empty()) {
+        p->pending_ctrl.push_back({rank, type, msg});
+        return;
+    }
+    int slot = p->free_bounce.back();
+    p->free_bounce.pop_back();
+    memcpy(p2pBounceBuf(p, slot), &msg, sizeof(msg));
+    p2pSendBounce(p, rank, slot, sizeof(msg), type);
+}
+
+// Send the queued control messages while bounce slots are free.
+inline void p2pFlushCtrl(P2P *p) {
+    while (!p->pending_ctrl.empty() && !p->free_bounce.empty()) {
+        const P2PPendingCtrl &pending = p->pending_ctrl.front();
+        int slot = p->free_bounce.back();
+        p->free_bounce.pop_back();
+        memcpy(p2pBounceBuf(p, slot), &pending.msg, sizeof(pending.msg));
+        p2pSendBounce(p, pending.rank, slot, sizeof(pending.msg), pending.type);
+        p->pending_ctrl.pop_front();
+    }
+}
+
+inline void *p2pRdmaContext(P2PRequest *req) {
+    return (void*) ((uintptr_t) req | P2P_WR_RDMA);
+}
+
+// Eager sends are done on return: the payload is in the bounce buffer.
+inline void p2pPostSend(P2P *p, int rank, void *buf, uint32_t size, struct ibv_mr *mr, P2PRequest *req) {
+    req->buf = buf;
+    req->size = size;
+    req->mr = mr;
+    req->rank = rank;
+    req->done = false;
+    int slot = p2pGetBounce(p);
+    if (size <= p->config.eager_threshold) {
+        memcpy(p2pBounceBuf(p, slot), buf, size);
+        p2pSendBounce(p, rank, slot, size, P2P_EAGER);
+        req->done = true;
+        return;
+    }
+    req->protocol = p->config.protocol;
+    P2PCtrlMsg msg = {};
+    msg.req = (uintptr_t) req;
+    msg.addr = (uintptr_t) buf;
+    msg.rkey = mr->rkey;
+    msg.size = size;
+    msg.protocol = (uint32_t) req->protocol;
+    memcpy(p2pBounceBuf(p, slot), &msg, sizeof(msg));
+    p2pSendBounce(p, rank, slot, sizeof(msg), P2P_RTS);
+}
+
+// Start the receive of an eager message or an RTS still in its receive slot.
+inline void p2pMatch(P2P *p, P2PRequest *req, const struct ibv_wc &wc) {
+    Device *device = p->device;
+    req->rank = qpRank(device, wc.qp_num);
+    if (wc.imm_data == P2P_EAGER) {
+        MLOG_Assert(wc.byte_len <= req->size, "Message of %u bytes truncated to %u\n", wc.byte_len, req->size);
+        memcpy(req->buf, recvBuf(device, wc), wc.byte_len);
+        req->size = wc.byte_len;
+        releaseRecv(device, wc);
+        req->done = true;
+        return;
+    }
+    P2PCtrlMsg rts;
+    memcpy(&rts, recvBuf(device, wc), sizeof(rts));
+    releaseRecv(device, wc);
+    MLOG_Assert(rts.size <= req->size, "Message of %u bytes truncated to %u\n", rts.size, req->size);
+    req->size = rts.size;
+    req->protocol = (RdvProtocol) rts.protocol;
+    req->peer_req = rts.req;
+    if (req->protocol == RdvProtocol::READ) {
+        int ret = postRead(device, req->rank, req->buf, req->size, req->mr->lkey,
+                           rts.addr, rts.rkey, p2pRdmaContext(req));
+        MLOG_Assert(ret == 0, "Post Read failed!\n");
+        return;
+    }
+    P2PCtrlMsg rtr = {};
+    rtr.req = (uintptr_t) req;
+    rtr.peer_req = rts.req;
+    rtr.addr = (uintptr_t) req->buf;
+    rtr.rkey = req->mr->rkey;
+    if (req->protocol == RdvProtocol::WRITE_IMM) {
+        uint64_t key;
+        int ret = LCM_archive_put(&p->imm_reqs, (uintptr_t) req, &key);
+        MLOG_Assert(ret == LCM_SUCCESS, "Archive is full!\n");
+        rtr.imm = (uint32_t) key;
+    }
+    p2pSendCtrl(p, req->rank, P2P_RTR, rtr);
+}
+
+inline void p2pPostRecv(P2P *p, void *buf, uint32_t size, struct ibv_mr *mr, P2PRequest *req) {
+    req->buf = buf;
+    req->size = size;
+    req->mr = mr;
+    req->rank = -1;
+    req->done = false;
+    if (p->unexpected.empty()) {
+        p->posted_recvs.push_back(req);
+        return;
+    }
+    struct ibv_wc wc = p->unexpected.front();
+    p->unexpected.pop_front();
+    p2pMatch(p, req, wc);
+}
+
+inline void p2pHandleSend(P2P *p, const struct ibv_wc &wc) {
+    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Send completion failed! %d %d\n", wc.status, wc.opcode);
+    if ((wc.wr_id & P2P_WR_MASK) == P2P_WR_BOUNCE) {
+        p->free_bounce.push_back((int) (wc.wr_id >> 2));
+        return;
+    }
+    P2PRequest *req = (P2PRequest*) (wc.wr_id & ~P2P_WR_MASK);
+    // read: the receiver lets the sender go; write: the sender tells the
+    // receiver the payload is in place
+    if (req->protocol != RdvProtocol::WRITE_IMM) {
+        P2PCtrlMsg fin = {};
+        fin.req = (uintptr_t) req;
+        fin.peer_req = req->peer_req;
+        p2pSendCtrl(p, req->rank, P2P_FIN, fin);
+    }
+    req->done = true;
+}
+
+inline void p2pHandleRecv(P2P *p, const struct ibv_wc &wc) {
+    Device *device = p->device;
+    MLOG_Assert(wc.status == IBV_WC_SUCCESS, "Recv completion failed! %d %d\n", wc.status, wc.opcode);
+    if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        P2PRequest *req = (P2PRequest*) LCM_archive_remove(&p->imm_reqs, wc.imm_data);
+        MLOG_Assert(req != NULL, "Stale key %u\n", wc.imm_data);
+        releaseRecv(device, wc);
+        req->done = true;
+        return;
+    }
+    switch (wc.imm_data) {
+        case P2P_EAGER:
+        case P2P_RTS:
+            if (p->posted_recvs.empty()) {
+                p->unexpected.push_back(wc);
+            } else {
+                P2PRequest *req = p->posted_recvs.front();
+                p->posted_recvs.pop_front();
+                p2pMatch(p, req, wc);
+            }
+            break;
+        case P2P_RTR: {
+            P2PCtrlMsg rtr;
+            memcpy(&rtr, recvBuf(device, wc), sizeof(rtr));
+            releaseRecv(device, wc);
+            P2PRequest *req = (P2PRequest*) rtr.peer_req;
+            req->peer_req = rtr.req;
+            int ret;
+            if (req->protocol == RdvProtocol::WRITE_IMM)
+                ret = postWriteImm(device, req->rank, req->buf, req->size, req->mr->lkey,
+                                   rtr.addr, rtr.rkey, rtr.imm, p2pRdmaContext(req));
+            else
+                ret = postWrite(device, req->rank, req->buf, req->size, req->mr->lkey,
+                                rtr.addr, rtr.rkey, p2pRdmaContext(req));
+            MLOG_Assert(ret == 0, "Post Write failed!\n");
+            break;
+        }
+        case P2P_FIN: {
+            P2PCtrlMsg fin;
+            memcpy(&fin, recvBuf(device, wc), sizeof(fin));
+            releaseRecv(device, wc);
+            ((P2PRequest*) fin.peer_req)->done = true;
+            break;
+        }
+        default:
+            MLOG_Assert(false, "Unknown message type %u\n", wc.imm_data);
+    }
+}
+
+// Handle the completions at hand; return their number.
+inline int p2pProgress(P2P *p) {
+    struct ibv_wc wcs[16];
+    int n = tryPollCQBatch(p->device, p->device->send_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+        p2pHandleSend(p, wc);
+    });
+    n += tryPollCQBatch(p->device, p->device->recv_cq, wcs, 16, [&](const struct ibv_wc &wc) {
+        p2pHandleRecv(p, wc);
+    });
+    int ret = refillRecvs(p->device);
+    MLOG_Assert(ret == 0, "Post Recv failed!\n");
+    p2pFlushCtrl(p);
+    return n;
+}
+
+inline void p2pWait(P2P *p, P2PRequest *req) {
+    int nspin = 0;
+    while (!req->done) {
+        if (p2pProgress(p) == 0) spinOrYield(p->device, 0, &nspin);
+    }
+}
+
+} // namespace ibv
+
+#endif//IBVBENCH_P2P_ENGINE_HPP
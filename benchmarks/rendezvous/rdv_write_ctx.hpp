@@ -0,0 +1,39 @@
+#ifndef IBVBENCH_RDV_WRITE_CTX_HPP
+#define IBVBENCH_RDV_WRITE_CTX_HPP
+
+#include <stdint.h>
+#include "ibv_common.hpp"
+
+namespace ibv {
+
+// Contexts of a rendezvous transfer through RDMA writes: the ones of
+// ibv_pingpong_rdv_write, and the ones ibv_ctx_pool allocates.
+// user_context is a bool set once the transfer completes.
+struct SendCtx {
+    void *buf;
+    uint32_t size;
+    ibv_mr *mr;
+    void *user_context;
+    uintptr_t recv_ctx; // 8 bytes
+    uintptr_t remote_addr;
+    uint32_t rkey;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint32_t posted_chunks;  // writes posted
+    uint32_t done_chunks;    // writes completed (and FIN posted)
+    uint32_t fin_chunks;     // FINs completed
+};
+
+struct RecvCtx {
+    void *buf;
+    uint32_t size;
+    ibv_mr *mr;
+    void *user_context;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint32_t done_chunks;    // FINs received
+};
+
+} // namespace ibv
+
+#endif//IBVBENCH_RDV_WRITE_CTX_HPP
@@ -0,0 +1,37 @@
+if(NOT TARGET PMIx::pmix)
+  find_package(PkgConfig QUIET)
+  pkg_check_modules(PC_PMIX QUIET pmix)
+
+  find_path(
+          PMIX_INCLUDE_DIR pmix.h
+          HINTS ${PMIX_ROOT}
+                ENV PMIX_ROOT
+                ${PC_PMIX_INCLUDEDIR}
+                ${PC_PMIX_INCLUDE_DIRS}
+                ENV C_INCLUDE_PATH
+          PATH_SUFFIXES include
+  )
+
+  find_library(
+          PMIX_LIBRARY
+          NAMES pmix libpmix
+          HINTS ${PMIX_ROOT}
+                ENV PMIX_ROOT
+                ${PC_PMIX_LIBDIR}
+                ${PC_PMIX_LIBRARY_DIRS}
+                ENV LD_LIBRARY_PATH
+          PATH_SUFFIXES lib lib64
+  )
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(
+          PMIx DEFAULT_MSG PMIX_LIBRARY PMIX_INCLUDE_DIR
+  )
+  mark_as_advanced(PMIX_ROOT PMIX_LIBRARY PMIX_INCLUDE_DIR)
+
+  if(PMIx_FOUND)
+    add_library(PMIx::pmix INTERFACE IMPORTED)
+    target_include_directories(PMIx::pmix SYSTEM INTERFACE ${PMIX_INCLUDE_DIR})
+    target_link_libraries(PMIx::pmix INTERFACE ${PMIX_LIBRARY})
+  endif()
+endif()
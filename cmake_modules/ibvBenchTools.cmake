@@ -1,7 +1,24 @@
 function(add_ibv_executable EXEC)
     add_executable(${EXEC} ${ARGN})
-    target_link_libraries(${EXEC} PRIVATE Fabric::IBV)
+    target_link_libraries(${EXEC} PRIVATE Fabric::${IBVB_FABRIC} Threads::Threads)
     #    set_target_properties(${EXEC} PROPERTIES RUNTIME_OUTPUT_DIRECTORY "${CMAKE_BINARY_DIR}/bin")
     install(TARGETS ${EXEC} DESTINATION "${CMAKE_INSTALL_PREFIX}/bin")
 endfunction()
 
+
+# Smoke run of EXEC with two ranks on this host, started by ibvbench-run
+# (LCM_PM_BACKEND=file) or by the PMIx server IBVB_PMIX_LAUNCHER
+# (LCM_PM_BACKEND=pmix). With IBVB_FABRIC=SHM it needs no InfiniBand hardware.
+function(add_ibv_smoke_test NAME EXEC)
+    if(TARGET ibvbench-run)
+        add_test(NAME ${NAME} COMMAND ibvbench-run -n 2 $<TARGET_FILE:${EXEC}> ${ARGN})
+    elseif(LCM_PM_BACKEND STREQUAL "pmix" AND IBVB_PMIX_LAUNCHER)
+        add_test(NAME ${NAME} COMMAND ${IBVB_PMIX_LAUNCHER} -n 2 $<TARGET_FILE:${EXEC}> ${ARGN})
+        # two ranks on a host with fewer cores, also in a container running as root
+        set_tests_properties(${NAME} PROPERTIES ENVIRONMENT
+                "OMPI_ALLOW_RUN_AS_ROOT=1;OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1;OMPI_MCA_rmaps_base_oversubscribe=1;PRTE_MCA_rmaps_default_mapping_policy=:oversubscribe")
+    else()
+        return()
+    endif()
+    set_tests_properties(${NAME} PROPERTIES TIMEOUT 120)
+endfunction()
@@ -0,0 +1,168 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "pmi_file.h"
+
+/**
+ * ibvbench-run -n N [--kvs-slots=S] program [args...]
+ *
+ * Starts N ranks of program on this host for the "file" PMI backend: it
+ * creates the shared-memory segment of pmi_file.h, forks the ranks with
+ * their rank and size in the environment, and waits for them. Once a rank
+ * fails, the others are terminated. The exit status is the one of the first
+ * rank that failed (128 + signal if it was killed), or 0.
+ */
+
+static pid_t *g_pids = NULL;
+static int g_nranks = 0;
+static volatile sig_atomic_t g_signal = 0;
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s -n N [--kvs-slots=S] program [args...]\n", name);
+  exit(2);
+}
+
+static void on_signal(int sig)
+{
+  g_signal = sig;
+}
+
+static void kill_ranks(int sig)
+{
+  for (int i = 0; i < g_nranks; ++i)
+    if (g_pids[i] > 0) kill(g_pids[i], sig);
+}
+
+int main(int argc, char **argv)
+{
+  int nranks = 0;
+  long nslots = 0;
+  struct option long_options[] = {
+          {"np",        required_argument, 0, 'n'},
+          {"kvs-slots", required_argument, 0, 's'},
+          {0,           0,                 0, 0},
+  };
+  int opt;
+  // "+": the options of the program are its own
+  while ((opt = getopt_long(argc, argv, "+n:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        nranks = atoi(optarg);
+        break;
+      case 's':
+        nslots = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (nranks <= 0 || optind >= argc) usage(argv[0]);
+  if (nslots <= 0) {
+    nslots = lcm_pm_file_default_slots(nranks);
+  } else {
+    uint32_t pow2 = 1;
+    while (pow2 < nslots && pow2 < (1u << 30)) pow2 <<= 1;
+    nslots = pow2;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/ibvbench-pmi-%d", (int) getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create the PMI segment %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  // sparse: only the entries that are used take memory
+  size_t size = lcm_pm_file_size(nslots);
+  if (ftruncate(fd, size) != 0) {
+    fprintf(stderr, "Cannot size the PMI segment %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    return 1;
+  }
+  lcm_pm_file_t *file = mmap(NULL, sizeof(lcm_pm_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    fprintf(stderr, "Cannot map the PMI segment %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    return 1;
+  }
+  file->size = nranks;
+  file->nslots = nslots;
+  file->arrived = 0;
+  file->sense = 0;
+  __atomic_store_n(&file->magic, LCM_PM_FILE_MAGIC, __ATOMIC_RELEASE);
+  munmap(file, sizeof(lcm_pm_file_t));
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  char value[32];
+  setenv(LCM_PM_FILE_ENV_NAME, name, 1);
+  snprintf(value, sizeof(value), "%d", nranks);
+  setenv(LCM_PM_FILE_ENV_SIZE, value, 1);
+  g_pids = calloc(nranks, sizeof(pid_t));
+  g_nranks = nranks;
+  int status = 0;
+  int running = 0;
+  for (int i = 0; i < nranks; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      snprintf(value, sizeof(value), "%d", i);
+      setenv(LCM_PM_FILE_ENV_RANK, value, 1);
+      execvp(argv[optind], argv + optind);
+      fprintf(stderr, "Cannot start %s: %s\n", argv[optind], strerror(errno));
+      _exit(127);
+    }
+    if (pid < 0) {
+      fprintf(stderr, "Cannot fork rank %d: %s\n", i, strerror(errno));
+      status = 1;
+      kill_ranks(SIGTERM);
+      break;
+    }
+    g_pids[i] = pid;
+    ++running;
+  }
+
+  while (running > 0) {
+    int wstatus;
+    pid_t pid = waitpid(-1, &wstatus, 0);
+    if (pid < 0) {
+      if (errno != EINTR) break;
+      if (g_signal) {
+        kill_ranks(g_signal);
+        if (!status) status = 128 + g_signal;
+        g_signal = 0;
+      }
+      continue;
+    }
+    int rank;
+    for (rank = 0; rank < nranks && g_pids[rank] != pid; ++rank)
+      continue;
+    if (rank == nranks) continue;
+    g_pids[rank] = 0;
+    --running;
+    int code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    if (code && !status) {
+      fprintf(stderr, "ibvbench-run: rank %d exited with status %d\n", rank, code);
+      status = code;
+      kill_ranks(SIGTERM);
+    }
+  }
+  shm_unlink(name);
+  free(g_pids);
+  return status;
+}
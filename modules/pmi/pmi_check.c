@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "pmi_wrapper.h"
+
+/**
+ * pmi_check [--missing=rank|any]
+ *
+ * Check of the lcm_pm backend, run by every rank of a job: each rank
+ * publishes a key, and after the barrier reads the key of every rank with
+ * lcm_pm_getname_rank and lcm_pm_getname. With --missing each rank instead
+ * looks up, before the barrier, a key the next rank never publishes, with
+ * lcm_pm_getname_rank (rank) or lcm_pm_getname (any). The backend has to
+ * fail the lookup (exit) rather than wait for the key.
+ */
+
+static void expect(int rank, const char *value)
+{
+  char expected[256];
+  snprintf(expected, sizeof(expected), "value_of_%d", rank);
+  if (strcmp(value, expected) != 0) {
+    fprintf(stderr, "Rank %d: key of rank %d is \"%s\", expected \"%s\"\n", lcm_pm_get_rank(), rank,
+            value, expected);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *missing = NULL;
+  if (argc > 1 && strncmp(argv[1], "--missing=", 10) == 0)
+    missing = argv[1] + 10;
+  lcm_pm_initialize();
+  int rank = lcm_pm_get_rank();
+  int size = lcm_pm_get_size();
+  char key[256];
+  char value[256];
+  if (missing) {
+    snprintf(key, sizeof(key), "pmi_check_missing_%d", (rank + 1) % size);
+    if (strcmp(missing, "any") == 0)
+      lcm_pm_getname(key, value);
+    else
+      lcm_pm_getname_rank((rank + 1) % size, key, value);
+    fprintf(stderr, "Rank %d: found the unpublished key %s\n", rank, key);
+    return 1;
+  }
+  snprintf(key, sizeof(key), "pmi_check_%d", rank);
+  snprintf(value, sizeof(value), "value_of_%d", rank);
+  lcm_pm_publish(key, value);
+  lcm_pm_barrier();
+  for (int i = 0; i < size; ++i) {
+    snprintf(key, sizeof(key), "pmi_check_%d", i);
+    lcm_pm_getname_rank(i, key, value);
+    expect(i, value);
+    lcm_pm_getname(key, value);
+    expect(i, value);
+  }
+  lcm_pm_barrier();
+  lcm_pm_finalize();
+  return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef LCI_PMI_FILE_H
+#define LCI_PMI_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Layout of the shared-memory segment behind the "file" backend
+ * (pmi_wrapper_file.c), set up by the launcher (ibvbench-run.c).
+ *
+ * The launcher creates a POSIX shm object, names it in LCM_PM_FILE_ENV_NAME
+ * and starts the ranks with LCM_PM_FILE_ENV_RANK/SIZE. The key-value store is
+ * an open-addressing table of fixed-size entries: publish claims an entry with
+ * a CAS and marks it ready once key and value are written, so the segment
+ * needs no lock. The barrier is sense-reversing: the last rank to arrive
+ * flips the sense, which the others wait on with a futex.
+ */
+#define LCM_PM_FILE_ENV_NAME "IBVB_PMI_FILE"
+#define LCM_PM_FILE_ENV_RANK "IBVB_PMI_RANK"
+#define LCM_PM_FILE_ENV_SIZE "IBVB_PMI_SIZE"
+
+#define LCM_PM_FILE_MAGIC 0x69627662
+#define LCM_PM_FILE_STRING_LIMIT 256
+
+#define LCM_PM_FILE_EMPTY 0
+#define LCM_PM_FILE_BUSY 1
+#define LCM_PM_FILE_READY 2
+
+typedef struct lcm_pm_file_entry_t {
+  volatile uint32_t state;
+  uint32_t hash;
+  char key[LCM_PM_FILE_STRING_LIMIT];
+  char value[LCM_PM_FILE_STRING_LIMIT];
+} lcm_pm_file_entry_t;
+
+typedef struct lcm_pm_file_t {
+  uint32_t magic;
+  uint32_t size;              // number of ranks
+  uint32_t nslots;            // entries of the table, a power of two
+  char padding0[52];
+  volatile uint32_t arrived;  // ranks in the current barrier
+  volatile uint32_t sense;    // futex word, flipped by the last arrival
+  char padding1[56];
+  lcm_pm_file_entry_t entries[];
+} lcm_pm_file_t;
+
+static inline size_t lcm_pm_file_size(uint32_t nslots)
+{
+  return sizeof(lcm_pm_file_t) + (size_t) nslots * sizeof(lcm_pm_file_entry_t);
+}
+
+// Table entries for n ranks: room for a few rounds of the pairwise wire-up
+// (one key per (rank, peer) pair) at a load factor of at most one half.
+static inline uint32_t lcm_pm_file_default_slots(int n)
+{
+  uint64_t want = 32 * (uint64_t) n * n;
+  uint32_t nslots = 1 << 16;
+  while (nslots < want && nslots < (1u << 30)) nslots <<= 1;
+  return nslots;
+}
+
+#endif
@@ -11,6 +11,9 @@ int lcm_pm_get_rank();
 int lcm_pm_get_size();
 void lcm_pm_publish(char *key, char *value);
 void lcm_pm_getname(char *key, char *value);
+// The value of key, published by rank. Lets a backend fetch it from that
+// rank alone (PMIx direct modex); the others ignore the rank.
+void lcm_pm_getname_rank(int rank, char *key, char *value);
 void lcm_pm_barrier();
 void lcm_pm_finalize();
 
@@ -0,0 +1,195 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "pmi_wrapper.h"
+#include "pmi_file.h"
+
+// Iterations a rank spins on the barrier sense before it sleeps on the futex.
+#define LCM_PM_FILE_SPIN 4096
+
+static lcm_pm_file_t *g_file = NULL;
+static size_t g_file_size = 0;
+static int g_rank = 0;
+static int g_size = 1;
+static uint32_t g_sense = 0;
+
+static uint32_t hash_key(const char *key)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *key; ++key) {
+    hash ^= (unsigned char) *key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void futex_wait(volatile uint32_t *addr, uint32_t expected)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(volatile uint32_t *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, __INT32_MAX__, NULL, NULL, 0);
+}
+
+static void *map_file(const char *name, size_t *size)
+{
+  int fd = shm_open(name, O_RDWR, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open the PMI segment %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(lcm_pm_file_t)) {
+    fprintf(stderr, "The PMI segment %s is too small\n", name);
+    exit(1);
+  }
+  *size = st.st_size;
+  void *ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    fprintf(stderr, "Cannot map the PMI segment %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  return ptr;
+}
+
+void lcm_pm_initialize()
+{
+  if (g_file) return;
+  char *name = getenv(LCM_PM_FILE_ENV_NAME);
+  if (name == NULL) {
+    // not started by ibvbench-run: a singleton with a private table
+    uint32_t nslots = 1024;
+    g_file_size = lcm_pm_file_size(nslots);
+    g_file = mmap(NULL, g_file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (g_file == MAP_FAILED) {
+      fprintf(stderr, "Cannot get memory for the PMI table\n");
+      exit(1);
+    }
+    g_file->magic = LCM_PM_FILE_MAGIC;
+    g_file->size = 1;
+    g_file->nslots = nslots;
+    g_rank = 0;
+    g_size = 1;
+    return;
+  }
+  g_file = map_file(name, &g_file_size);
+  if (g_file->magic != LCM_PM_FILE_MAGIC ||
+      g_file_size < lcm_pm_file_size(g_file->nslots)) {
+    fprintf(stderr, "%s is not a PMI segment of ibvbench-run\n", name);
+    exit(1);
+  }
+  char *rank = getenv(LCM_PM_FILE_ENV_RANK);
+  char *size = getenv(LCM_PM_FILE_ENV_SIZE);
+  g_rank = rank ? atoi(rank) : 0;
+  g_size = size ? atoi(size) : (int) g_file->size;
+  if (g_size != (int) g_file->size || g_rank < 0 || g_rank >= g_size) {
+    fprintf(stderr, "Rank %d of %d does not fit the PMI segment of %u ranks\n",
+            g_rank, g_size, g_file->size);
+    exit(1);
+  }
+}
+
+int lcm_pm_initialized() {
+  return g_file != NULL;
+}
+
+int lcm_pm_get_rank() {
+  return g_rank;
+}
+
+int lcm_pm_get_size() {
+  return g_size;
+}
+
+void lcm_pm_publish(char* key, char* value)
+{
+  if (strlen(key) >= LCM_PM_FILE_STRING_LIMIT || strlen(value) >= LCM_PM_FILE_STRING_LIMIT) {
+    fprintf(stderr, "PMI key %s or its value exceeds %d characters\n", key, LCM_PM_FILE_STRING_LIMIT - 1);
+    exit(1);
+  }
+  uint32_t hash = hash_key(key);
+  uint32_t mask = g_file->nslots - 1;
+  for (uint32_t i = 0; i <= mask; ++i) {
+    lcm_pm_file_entry_t *entry = &g_file->entries[(hash + i) & mask];
+    uint32_t state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+    // a lost CAS leaves the state of the winner in state
+    if (state == LCM_PM_FILE_EMPTY &&
+        __atomic_compare_exchange_n(&entry->state, &state, LCM_PM_FILE_BUSY, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      entry->hash = hash;
+      strcpy(entry->key, key);
+      strcpy(entry->value, value);
+      __atomic_store_n(&entry->state, LCM_PM_FILE_READY, __ATOMIC_RELEASE);
+      return;
+    }
+    while (state == LCM_PM_FILE_BUSY)
+      state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      // republished: visible to the others after the next barrier
+      strcpy(entry->value, value);
+      return;
+    }
+  }
+  fprintf(stderr, "The PMI table of %u entries is full (see ibvbench-run --kvs-slots)\n", g_file->nslots);
+  exit(1);
+}
+
+void lcm_pm_getname(char* key, char* value)
+{
+  uint32_t hash = hash_key(key);
+  uint32_t mask = g_file->nslots - 1;
+  for (uint32_t i = 0; i <= mask; ++i) {
+    lcm_pm_file_entry_t *entry = &g_file->entries[(hash + i) & mask];
+    uint32_t state;
+    while ((state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE)) == LCM_PM_FILE_BUSY)
+      continue;
+    if (state == LCM_PM_FILE_EMPTY) break;
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      strcpy(value, entry->value);
+      return;
+    }
+  }
+  fprintf(stderr, "Rank %d: no PMI key %s\n", g_rank, key);
+  exit(1);
+}
+
+void lcm_pm_getname_rank(int rank, char* key, char* value)
+{
+  (void) rank;
+  lcm_pm_getname(key, value);
+}
+
+void lcm_pm_barrier() {
+  if (g_size == 1) return;
+  g_sense = !g_sense;
+  if (__atomic_add_fetch(&g_file->arrived, 1, __ATOMIC_ACQ_REL) == (uint32_t) g_size) {
+    __atomic_store_n(&g_file->arrived, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_file->sense, g_sense, __ATOMIC_RELEASE);
+    futex_wake(&g_file->sense);
+    return;
+  }
+  for (int i = 0; i < LCM_PM_FILE_SPIN; ++i)
+    if (__atomic_load_n(&g_file->sense, __ATOMIC_ACQUIRE) == g_sense) return;
+  while (__atomic_load_n(&g_file->sense, __ATOMIC_ACQUIRE) != g_sense)
+    futex_wait(&g_file->sense, !g_sense);
+}
+
+void lcm_pm_finalize() {
+  // the launcher removes the segment
+  munmap(g_file, g_file_size);
+  g_file = NULL;
+}
@@ -1,79 +1,254 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "pmi_wrapper.h"
 #include <mpi.h>
 
+/**
+ * The key-value store: entries point into an arena of large blocks, and an
+ * open-addressing index over the entries (by the hash of the key) serves
+ * lcm_pm_getname. The barrier exchanges the keys published since the last
+ * one as packed "key\0value\0" strings.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct Block_t {
+  struct Block_t *next;
+  size_t used;
+  size_t capacity;
+  char data[];
+} Block_t;
+
 typedef struct Entry_t {
   char *key;
   char *value;
+  unsigned hash;
 } Entry_t;
 
 typedef struct Archive_t {
   Entry_t *ptr;
   int size;
   int capacity;
+  int *index;          // entry of each slot, -1 if empty
+  int index_capacity;  // a power of two, at least twice the size
+  Block_t *arena;
 } Archive_t;
 Archive_t l_archive, g_archive;
-const int STRING_LIMIT=256;
+
+static void *checked_alloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "Cannot get %zu bytes of memory for archive\n", size);
+    exit(1);
+  }
+  return ptr;
+}
+
+static unsigned hash_key(const char *key) {
+  // FNV-1a
+  unsigned hash = 2166136261u;
+  for (; *key; ++key) {
+    hash ^= (unsigned char) *key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static char* arena_strdup(Archive_t *archive, const char *str) {
+  size_t len = strlen(str) + 1;
+  Block_t *block = archive->arena;
+  if (block == NULL || block->used + len > block->capacity) {
+    size_t capacity = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+    block = checked_alloc(NULL, sizeof(Block_t) + capacity);
+    block->next = archive->arena;
+    block->used = 0;
+    block->capacity = capacity;
+    archive->arena = block;
+  }
+  char *ret = block->data + block->used;
+  memcpy(ret, str, len);
+  block->used += len;
+  return ret;
+}
+
+static void index_reset(Archive_t *archive, int capacity) {
+  archive->index_capacity = capacity;
+  archive->index = checked_alloc(archive->index, capacity * sizeof(int));
+  memset(archive->index, -1, capacity * sizeof(int));
+}
+
+// slot of key in the index: its entry, or the empty slot it would take
+static int index_find(Archive_t *archive, const char *key, unsigned hash) {
+  int mask = archive->index_capacity - 1;
+  for (int slot = hash & mask;; slot = (slot + 1) & mask) {
+    int i = archive->index[slot];
+    if (i < 0 || (archive->ptr[i].hash == hash && strcmp(archive->ptr[i].key, key) == 0))
+      return slot;
+  }
+}
 
 void archive_init(Archive_t *archive) {
   archive->capacity = 8;
   archive->size = 0;
-  archive->ptr = malloc(archive->capacity * sizeof(struct Entry_t));
-  if (archive->ptr == NULL) {
-    fprintf(stderr, "Cannot get more memory for archive of capacity %d",
-            archive->capacity);
-    exit(1);
-  }
+  archive->ptr = checked_alloc(NULL, archive->capacity * sizeof(struct Entry_t));
+  archive->index = NULL;
+  index_reset(archive, 2 * archive->capacity);
+  archive->arena = NULL;
 }
 
 void archive_fina(Archive_t *archive) {
-  for (int i = 0; i < archive->size; ++i) {
-    free(archive->ptr[i].key);
-    free(archive->ptr[i].value);
+  while (archive->arena) {
+    Block_t *next = archive->arena->next;
+    free(archive->arena);
+    archive->arena = next;
   }
   free(archive->ptr);
+  free(archive->index);
   archive->ptr = NULL;
+  archive->index = NULL;
   archive->size = 0;
   archive->capacity = 0;
+  archive->index_capacity = 0;
 }
 
+// Drops the entries, keeps one arena block for the next ones.
 void archive_clear(Archive_t *archive) {
   archive->size = 0;
+  memset(archive->index, -1, archive->index_capacity * sizeof(int));
+  if (archive->arena) {
+    while (archive->arena->next) {
+      Block_t *next = archive->arena->next;
+      archive->arena->next = next->next;
+      free(next);
+    }
+    archive->arena->used = 0;
+  }
 }
 
+// A key pushed again gets the new value.
 void archive_push(Archive_t *archive, char *key, char *value) {
+  unsigned hash = hash_key(key);
+  int slot = index_find(archive, key, hash);
+  if (archive->index[slot] >= 0) {
+    archive->ptr[archive->index[slot]].value = arena_strdup(archive, value);
+    return;
+  }
   if (archive->size == archive->capacity) {
     archive->capacity *= 2;
-    archive->ptr = realloc(archive->ptr, archive->capacity * sizeof(struct Entry_t));
-    if (archive->ptr == NULL) {
-      fprintf(stderr, "Cannot get more memory for archive of capacity %d",
-              archive->capacity);
-      exit(1);
-    }
+    archive->ptr = checked_alloc(archive->ptr, archive->capacity * sizeof(struct Entry_t));
+  }
+  Entry_t *entry = &archive->ptr[archive->size];
+  entry->key = arena_strdup(archive, key);
+  entry->value = arena_strdup(archive, value);
+  entry->hash = hash;
+  archive->index[slot] = archive->size++;
+  if (2 * archive->size > archive->index_capacity) {
+    index_reset(archive, 2 * archive->index_capacity);
+    for (int i = 0; i < archive->size; ++i)
+      archive->index[index_find(archive, archive->ptr[i].key, archive->ptr[i].hash)] = i;
   }
-  char *key_in = malloc(STRING_LIMIT);
-  strcpy(key_in, key);
-  char *value_in = malloc(STRING_LIMIT);
-  strcpy(value_in, value);
-  archive->ptr[archive->size].key = key_in;
-  archive->ptr[archive->size].value = value_in;
-  ++archive->size;
 }
 
 char* archive_search(Archive_t *archive, char *key) {
+  int i = archive->index[index_find(archive, key, hash_key(key))];
+  return i < 0 ? NULL : archive->ptr[i].value;
+}
+
+/**
+ * The former store, kept as the baseline of benchmarks/pmi_kvs and selected
+ * with IBVB_PMI_MPI_FIXED=1: every key and value takes a fixed slot of
+ * FIXED_STRING_LIMIT bytes, lookups search the entries linearly, and the
+ * barrier exchanges the whole slots.
+ */
+#define FIXED_STRING_LIMIT 256
+
+typedef struct FixedArchive_t {
+  char *ptr;  // key and value slots of each entry, back to back
+  int size;
+  int capacity;
+} FixedArchive_t;
+FixedArchive_t l_fixed, g_fixed;
+static int g_use_fixed = 0;
+
+static void fixed_init(FixedArchive_t *archive) {
+  archive->capacity = 8;
+  archive->size = 0;
+  archive->ptr = checked_alloc(NULL, archive->capacity * 2 * FIXED_STRING_LIMIT);
+}
+
+static void fixed_fina(FixedArchive_t *archive) {
+  free(archive->ptr);
+  archive->ptr = NULL;
+  archive->size = 0;
+  archive->capacity = 0;
+}
+
+static void fixed_push(FixedArchive_t *archive, const char *key, const char *value) {
+  if (strlen(key) >= FIXED_STRING_LIMIT || strlen(value) >= FIXED_STRING_LIMIT) {
+    fprintf(stderr, "PMI key %s or its value is longer than %d bytes\n", key, FIXED_STRING_LIMIT - 1);
+    exit(1);
+  }
+  if (archive->size == archive->capacity) {
+    archive->capacity *= 2;
+    archive->ptr = checked_alloc(archive->ptr, (size_t) archive->capacity * 2 * FIXED_STRING_LIMIT);
+  }
+  char *entry = archive->ptr + (size_t) archive->size * 2 * FIXED_STRING_LIMIT;
+  strcpy(entry, key);
+  strcpy(entry + FIXED_STRING_LIMIT, value);
+  ++archive->size;
+}
+
+static char* fixed_search(FixedArchive_t *archive, const char *key) {
   for (int i = 0; i < archive->size; ++i) {
-    if (strcmp(archive->ptr[i].key, key) == 0) {
-      return archive->ptr[i].value;
-    }
+    char *entry = archive->ptr + (size_t) i * 2 * FIXED_STRING_LIMIT;
+    if (strcmp(entry, key) == 0) return entry + FIXED_STRING_LIMIT;
   }
   return NULL;
 }
 
+static void fixed_barrier() {
+  int size = lcm_pm_get_size();
+  size_t entry_bytes = 2 * FIXED_STRING_LIMIT;
+  if ((size_t) l_fixed.size * entry_bytes > INT_MAX) {
+    fprintf(stderr, "Too many PMI keys published before the barrier: %d\n", l_fixed.size);
+    exit(1);
+  }
+  // exchange the entry counts, then the slots
+  int my_count = (int) (l_fixed.size * entry_bytes);
+  int *count_buf = checked_alloc(NULL, size * sizeof(int));
+  MPI_Allgather(&my_count, 1, MPI_INT, count_buf, 1, MPI_INT, MPI_COMM_WORLD);
+  int *displs_buf = checked_alloc(NULL, size * sizeof(int));
+  size_t total_bytes = 0;
+  for (int i = 0; i < size; ++i) {
+    if (total_bytes > INT_MAX) {
+      fprintf(stderr, "Too many PMI keys published before the barrier: %zu bytes\n", total_bytes);
+      exit(1);
+    }
+    displs_buf[i] = (int) total_bytes;
+    total_bytes += count_buf[i];
+  }
+  char *dst_buf = checked_alloc(NULL, total_bytes + 1);
+  MPI_Allgatherv(l_fixed.ptr, my_count, MPI_BYTE, dst_buf,
+                 count_buf, displs_buf, MPI_BYTE, MPI_COMM_WORLD);
+  for (size_t i = 0; i < total_bytes / entry_bytes; ++i)
+    fixed_push(&g_fixed, dst_buf + i * entry_bytes, dst_buf + i * entry_bytes + FIXED_STRING_LIMIT);
+  free(displs_buf);
+  free(dst_buf);
+  free(count_buf);
+  l_fixed.size = 0;
+}
+
 void lcm_pm_initialize()
 {
   MPI_Init(NULL, NULL);
+  char *fixed = getenv("IBVB_PMI_MPI_FIXED");
+  g_use_fixed = fixed && atoi(fixed);
+  if (g_use_fixed) {
+    fixed_init(&l_fixed);
+    fixed_init(&g_fixed);
+    return;
+  }
   archive_init(&l_archive);
   archive_init(&g_archive);
 }
@@ -97,52 +272,78 @@ int lcm_pm_get_size() {
 
 void lcm_pm_publish(char* key, char* value)
 {
-  archive_push(&l_archive, key, value);
+  if (g_use_fixed)
+    fixed_push(&l_fixed, key, value);
+  else
+    archive_push(&l_archive, key, value);
 }
 
 void lcm_pm_getname(char* key, char* value)
 {
-  char *ret = archive_search(&g_archive, key);
+  char *ret = g_use_fixed ? fixed_search(&g_fixed, key) : archive_search(&g_archive, key);
+  if (ret == NULL) {
+    fprintf(stderr, "Rank %d: no PMI key %s\n", lcm_pm_get_rank(), key);
+    exit(1);
+  }
   strcpy(value, ret);
 }
 
+void lcm_pm_getname_rank(int rank, char* key, char* value)
+{
+  (void) rank;
+  lcm_pm_getname(key, value);
+}
+
 void lcm_pm_barrier() {
-  int rank = lcm_pm_get_rank();
+  if (g_use_fixed) {
+    fixed_barrier();
+    return;
+  }
   int size = lcm_pm_get_size();
-  // exchange the counts
-  int my_count = l_archive.size;
-  int *count_buf = malloc(size * sizeof(int));
-  MPI_Allgather(&my_count, 1, MPI_INT, count_buf, 1, MPI_INT, MPI_COMM_WORLD);
-
-  // exchange the data
-  int total_count = 0;
-  for (int i = 0; i < size; ++i) {
-    total_count += count_buf[i];
+  // pack the local entries as "key\0value\0"
+  size_t my_bytes = 0;
+  for (int i = 0; i < l_archive.size; ++i)
+    my_bytes += strlen(l_archive.ptr[i].key) + strlen(l_archive.ptr[i].value) + 2;
+  if (my_bytes > INT_MAX) {
+    fprintf(stderr, "Too many PMI keys published before the barrier: %zu bytes\n", my_bytes);
+    exit(1);
   }
-  char *src_buf = malloc(l_archive.size * STRING_LIMIT * 2);
-  char *dst_buf = malloc(total_count * STRING_LIMIT * 2);
-  // refactor the count_buf
-  for (int i = 0; i < size; ++i) {
-    count_buf[i] *= STRING_LIMIT * 2;
+  char *src_buf = checked_alloc(NULL, my_bytes + 1);
+  char *p = src_buf;
+  for (int i = 0; i < l_archive.size; ++i) {
+    size_t len = strlen(l_archive.ptr[i].key) + 1;
+    memcpy(p, l_archive.ptr[i].key, len);
+    p += len;
+    len = strlen(l_archive.ptr[i].value) + 1;
+    memcpy(p, l_archive.ptr[i].value, len);
+    p += len;
   }
-  // assemble the displs_buf
-  int *displs_buf = malloc(sizeof(int) * size);
-  int current_displs = 0;
+
+  // exchange the byte counts, then the data
+  int my_count = (int) my_bytes;
+  int *count_buf = checked_alloc(NULL, size * sizeof(int));
+  MPI_Allgather(&my_count, 1, MPI_INT, count_buf, 1, MPI_INT, MPI_COMM_WORLD);
+  int *displs_buf = checked_alloc(NULL, size * sizeof(int));
+  size_t total_bytes = 0;
   for (int i = 0; i < size; ++i) {
-    displs_buf[i] = current_displs;
-    current_displs += count_buf[i];
-  }
-  // assemble the send buffer
-  for (int i = 0; i < l_archive.size; ++i) {
-    memcpy(src_buf + 2 * i * STRING_LIMIT, l_archive.ptr[i].key, STRING_LIMIT);
-    memcpy(src_buf + (i * 2 + 1) * STRING_LIMIT, l_archive.ptr[i].value, STRING_LIMIT);
+    if (total_bytes > INT_MAX) {
+      fprintf(stderr, "Too many PMI keys published before the barrier: %zu bytes\n", total_bytes);
+      exit(1);
+    }
+    displs_buf[i] = (int) total_bytes;
+    total_bytes += count_buf[i];
   }
-  MPI_Allgatherv(src_buf, my_count * STRING_LIMIT * 2, MPI_BYTE, dst_buf,
+  char *dst_buf = checked_alloc(NULL, total_bytes + 1);
+  MPI_Allgatherv(src_buf, my_count, MPI_BYTE, dst_buf,
                  count_buf, displs_buf, MPI_BYTE, MPI_COMM_WORLD);
 
   // put the data back the global archive
-  for (int i = 0; i < total_count; ++i) {
-    archive_push(&g_archive, dst_buf + 2 * i * STRING_LIMIT, dst_buf + (2 * i + 1) * STRING_LIMIT);
+  for (p = dst_buf; p < dst_buf + total_bytes;) {
+    char *key = p;
+    p += strlen(p) + 1;
+    char *value = p;
+    p += strlen(p) + 1;
+    archive_push(&g_archive, key, value);
   }
   free(displs_buf);
   free(dst_buf);
@@ -152,7 +353,12 @@ void lcm_pm_barrier() {
 }
 
 void lcm_pm_finalize() {
-  archive_fina(&l_archive);
-  archive_fina(&g_archive);
+  if (g_use_fixed) {
+    fixed_fina(&l_fixed);
+    fixed_fina(&g_fixed);
+  } else {
+    archive_fina(&l_archive);
+    archive_fina(&g_archive);
+  }
   MPI_Finalize();
 }
\ No newline at end of file
@@ -40,6 +40,12 @@ void lcm_pm_getname(char* key, char* value)
   PMI_KVS_Get(lcg_name, key, value, 255);
 }
 
+void lcm_pm_getname_rank(int rank, char* key, char* value)
+{
+  (void) rank;
+  lcm_pm_getname(key, value);
+}
+
 void lcm_pm_barrier() {
   PMI_Barrier();
 }
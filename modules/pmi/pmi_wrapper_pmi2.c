@@ -35,6 +35,12 @@ void lcm_pm_getname(char* key, char* value)
   PMI2_KVS_Get(NULL, PMI2_ID_NULL, key, value, 255, &vallen);
 }
 
+void lcm_pm_getname_rank(int rank, char* key, char* value)
+{
+  (void) rank;
+  lcm_pm_getname(key, value);
+}
+
 void lcm_pm_barrier() {
   // WARNING: Switching to PMI2 breaks this barrier
   PMI2_KVS_Fence();
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "pmi_wrapper.h"
+#include <pmix.h>
+
+/**
+ * PMIx backend. Published values are PMIx_Put under this process, and the
+ * barrier commits them and fences. By default the fence does not collect the
+ * data (direct modex): a value is fetched from the server of its rank on the
+ * first PMIx_Get, so a rank only moves the keys it reads. Set
+ * IBVB_PMIX_COLLECT=1 to collect all of them in the fence instead (full
+ * modex).
+ *
+ * A value that is not in the local store is waited for at most
+ * LCM_PM_PMIX_TIMEOUT seconds: the server holds a direct-modex request until
+ * the rank commits the key, so a key that is never published would block the
+ * lookup forever.
+ */
+#define LCM_PM_PMIX_TIMEOUT 10
+
+static pmix_proc_t g_proc;
+static int g_size = 0;
+static bool g_initialized = false;
+static bool g_collect = false;
+
+static void check(pmix_status_t rc, const char *what)
+{
+  if (rc != PMIX_SUCCESS) {
+    fprintf(stderr, "%s failed: %s\n", what, PMIx_Error_string(rc));
+    exit(1);
+  }
+}
+
+void lcm_pm_initialize()
+{
+  if (g_initialized) return;
+  check(PMIx_Init(&g_proc, NULL, 0), "PMIx_Init");
+  pmix_proc_t wildcard;
+  PMIX_LOAD_PROCID(&wildcard, g_proc.nspace, PMIX_RANK_WILDCARD);
+  pmix_value_t *val;
+  check(PMIx_Get(&wildcard, PMIX_JOB_SIZE, NULL, 0, &val), "PMIx_Get(PMIX_JOB_SIZE)");
+  g_size = (int) val->data.uint32;
+  PMIX_VALUE_RELEASE(val);
+  char *collect = getenv("IBVB_PMIX_COLLECT");
+  g_collect = collect && atoi(collect);
+  g_initialized = true;
+}
+
+int lcm_pm_initialized() {
+  return g_initialized;
+}
+
+int lcm_pm_get_rank() {
+  return (int) g_proc.rank;
+}
+
+int lcm_pm_get_size() {
+  return g_size;
+}
+
+void lcm_pm_publish(char* key, char* value)
+{
+  pmix_value_t val;
+  PMIX_VALUE_CONSTRUCT(&val);
+  val.type = PMIX_STRING;
+  val.data.string = value;
+  check(PMIx_Put(PMIX_GLOBAL, key, &val), "PMIx_Put");
+}
+
+void lcm_pm_getname_rank(int rank, char* key, char* value)
+{
+  pmix_proc_t proc;
+  PMIX_LOAD_PROCID(&proc, g_proc.nspace, rank);
+  pmix_info_t info;
+  int timeout = LCM_PM_PMIX_TIMEOUT;
+  PMIX_INFO_LOAD(&info, PMIX_TIMEOUT, &timeout, PMIX_INT);
+  pmix_value_t *val;
+  pmix_status_t rc = PMIx_Get(&proc, key, &info, 1, &val);
+  PMIX_INFO_DESTRUCT(&info);
+  if (rc != PMIX_SUCCESS) {
+    fprintf(stderr, "Rank %d: no PMI key %s from rank %d: %s\n", (int) g_proc.rank, key, rank,
+            PMIx_Error_string(rc));
+    exit(1);
+  }
+  strcpy(value, val->data.string);
+  PMIX_VALUE_RELEASE(val);
+}
+
+void lcm_pm_getname(char* key, char* value)
+{
+  // no owner given: ask every rank, this one first. The local store of all
+  // of them first, then the servers of the others, so a key held by one
+  // rank does not wait out the timeout of the ranks before it.
+  pmix_info_t info[2];
+  bool optional = true;
+  int timeout = LCM_PM_PMIX_TIMEOUT;
+  PMIX_INFO_LOAD(&info[0], PMIX_OPTIONAL, &optional, PMIX_BOOL);
+  PMIX_INFO_LOAD(&info[1], PMIX_TIMEOUT, &timeout, PMIX_INT);
+  pmix_value_t *val = NULL;
+  for (int pass = 0; pass < 2 && val == NULL; ++pass) {
+    for (int i = pass; i < g_size; ++i) {
+      pmix_proc_t proc;
+      PMIX_LOAD_PROCID(&proc, g_proc.nspace, (g_proc.rank + i) % g_size);
+      if (PMIx_Get(&proc, key, &info[pass], 1, &val) == PMIX_SUCCESS)
+        break;
+      val = NULL;
+    }
+  }
+  PMIX_INFO_DESTRUCT(&info[0]);
+  PMIX_INFO_DESTRUCT(&info[1]);
+  if (val == NULL) {
+    fprintf(stderr, "Rank %d: no PMI key %s\n", (int) g_proc.rank, key);
+    exit(1);
+  }
+  strcpy(value, val->data.string);
+  PMIX_VALUE_RELEASE(val);
+}
+
+void lcm_pm_barrier() {
+  check(PMIx_Commit(), "PMIx_Commit");
+  pmix_info_t info;
+  PMIX_INFO_LOAD(&info, PMIX_COLLECT_DATA, &g_collect, PMIX_BOOL);
+  check(PMIx_Fence(NULL, 0, &info, 1), "PMIx_Fence");
+  PMIX_INFO_DESTRUCT(&info);
+}
+
+void lcm_pm_finalize() {
+  if (!g_initialized) return;
+  PMIx_Finalize(NULL, 0);
+  g_initialized = false;
+}
@@ -0,0 +1,118 @@
+#ifndef SHMVERBS_SHM_RING_H
+#define SHMVERBS_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Bounded multi-producer/multi-consumer ring living in shared memory
+ * (Vyukov's sequence-number queue). It only stores offsets-free POD
+ * payloads, so it can be placed in a segment mapped at different addresses
+ * by different processes. Used for CQs, SRQs and receive queues.
+ */
+
+#define SHM_CACHE_LINE 64
+
+struct shm_ring {
+    uint32_t mask;
+    uint32_t cell_size;
+    char padding0[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint64_t enqueue_pos;
+    char padding1[SHM_CACHE_LINE - sizeof(uint64_t)];
+    uint64_t dequeue_pos;
+    char padding2[SHM_CACHE_LINE - sizeof(uint64_t)];
+    // cells follow: { uint64_t seq; payload }
+};
+
+static inline uint32_t shm_ring_cell_size(uint32_t elem_size)
+{
+    return (uint32_t) (sizeof(uint64_t) + ((elem_size + 7) & ~7u));
+}
+
+static inline size_t shm_ring_bytes(uint32_t capacity, uint32_t elem_size)
+{
+    return sizeof(struct shm_ring) +
+           (size_t) capacity * shm_ring_cell_size(elem_size);
+}
+
+static inline uint64_t *shm_ring_cell(struct shm_ring *ring, uint64_t pos)
+{
+    return (uint64_t *) ((char *) (ring + 1) +
+                         (size_t) (pos & ring->mask) * ring->cell_size);
+}
+
+// capacity must be a power of two
+static inline void shm_ring_init(struct shm_ring *ring, uint32_t capacity,
+                                 uint32_t elem_size)
+{
+    ring->mask = capacity - 1;
+    ring->cell_size = shm_ring_cell_size(elem_size);
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+    for (uint64_t i = 0; i < capacity; ++i) {
+        *shm_ring_cell(ring, i) = i;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// return 0 on success, -1 if the ring is full
+static inline int shm_ring_push(struct shm_ring *ring, const void *elem,
+                                uint32_t elem_size)
+{
+    uint64_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    uint64_t *cell;
+    while (1) {
+        cell = shm_ring_cell(ring, pos);
+        uint64_t seq = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t) seq - (int64_t) pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(cell + 1, elem, elem_size);
+    __atomic_store_n(cell, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// return 0 on success, -1 if the ring is empty
+static inline int shm_ring_pop(struct shm_ring *ring, void *elem,
+                               uint32_t elem_size)
+{
+    uint64_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    uint64_t *cell;
+    while (1) {
+        cell = shm_ring_cell(ring, pos);
+        uint64_t seq = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t) seq - (int64_t) (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(elem, cell + 1, elem_size);
+    __atomic_store_n(cell, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// approximate number of queued elements
+static inline uint64_t shm_ring_count(struct shm_ring *ring)
+{
+    uint64_t deq = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_ACQUIRE);
+    uint64_t enq = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_ACQUIRE);
+    return enq > deq ? enq - deq : 0;
+}
+
+#endif // SHMVERBS_SHM_RING_H
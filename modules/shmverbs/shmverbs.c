@@ -0,0 +1,1745 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "infiniband/verbs.h"
+#include "shm_ring.h"
+
+/**
+ * Shared-memory loopback verbs provider.
+ *
+ * Every opened context owns one anonymous shared segment (memfd) holding the
+ * queues that other processes must reach: QP records, receive queues and
+ * CQs. Registered memory is moved in place onto its own memfd so that peers
+ * can map it too. A small host-wide registry (a named POSIX shm object) maps
+ * LIDs to (pid, segment fd); peers open the segment through
+ * /proc/<pid>/fd/<fd>.
+ *
+ * Work requests are executed by the initiator: RDMA writes and reads copy
+ * straight between mappings, sends consume a receive WQE from the target's
+ * SRQ and push a CQE into the target's recv CQ. A send that finds no receive
+ * buffer (RNR) stays at the head of its send queue and is retried from
+ * ibv_post_send/ibv_poll_cq, so per-QP ordering is preserved.
+ */
+
+#define SHM_MAX_LIDS 4096
+#define SHM_MAX_QPS (1 << 17)
+#define SHM_QPN_TABLE_SIZE (SHM_MAX_QPS * 2)
+#define SHM_MAX_MRS 4096
+#define SHM_MAX_PDS 1024
+#define SHM_MAX_SGE 4
+#define SHM_MAX_INLINE 512
+#define SHM_MAX_WR (1 << 15)
+#define SHM_MAX_CQE (1 << 22)
+#define SHM_QPN_BASE 0x100
+#define SHM_SEGMENT_MAGIC 0x5348564552425331ULL // "SHVERBS1"
+#define SHM_SEGMENT_SIZE_DEFAULT (256UL << 20)
+
+#define SHM_KEY(idx, lid) ((((uint32_t) (idx) + 1) << 8) | ((lid) & 0xff))
+#define SHM_KEY_INDEX(key) (((key) >> 8) - 1)
+#define SHM_PTR(base, offset) ((void *) ((char *) (base) + (offset)))
+#define SHM_CONTAINER(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* ------------------------------------------------------------------------
+ * Shared layout. Only offsets and plain data, never pointers.
+ * --------------------------------------------------------------------- */
+
+struct shm_registry_slot {
+    int32_t pid;
+    int32_t seg_fd;
+};
+
+struct shm_registry {
+    uint32_t next_qpn;
+    char padding[SHM_CACHE_LINE - sizeof(uint32_t)];
+    struct shm_registry_slot slots[SHM_MAX_LIDS];
+};
+
+struct shm_mr_entry {
+    uint64_t addr;
+    uint64_t length;
+    uint64_t map_base;
+    uint64_t map_len;
+    int32_t fd;
+    uint32_t key;
+    uint32_t access;
+    uint32_t valid;
+};
+
+struct shm_qpn_entry {
+    uint32_t qpn;
+    uint32_t padding;
+    uint64_t offset;
+};
+
+struct shm_segment {
+    uint64_t magic;
+    uint64_t size;
+    int32_t owner_pid;
+    uint32_t lid;
+    uint64_t brk; // only touched by the owner
+    int32_t async_fd; // write end of the owner's async event pipe
+    char padding[SHM_CACHE_LINE - 4 * sizeof(uint64_t) - sizeof(int32_t)];
+    struct shm_qpn_entry qpn_table[SHM_QPN_TABLE_SIZE];
+    struct shm_mr_entry mrs[SHM_MAX_MRS];
+};
+
+struct shm_recv_wqe {
+    uint64_t wr_id;
+    uint32_t num_sge;
+    uint32_t padding;
+    struct ibv_sge sge[SHM_MAX_SGE];
+};
+
+// A shared receive queue or the receive queue of a QP without SRQ.
+struct shm_rq_shared {
+    uint32_t max_sge;
+    uint32_t srq_limit;
+    uint32_t limit_reached; // set when the armed srq_limit fired
+    char padding[SHM_CACHE_LINE - 3 * sizeof(uint32_t)];
+    struct shm_ring ring; // must be the last member
+};
+
+struct shm_cqe {
+    uint64_t wr_id;
+    uint32_t status;
+    uint32_t opcode;
+    uint32_t byte_len;
+    uint32_t imm_data;
+    uint32_t qp_num;
+    uint32_t src_qp;
+    uint32_t wc_flags;
+    uint32_t slid;
+    // send queue entries released when this CQE is polled
+    uint32_t qp_index;
+    uint32_t sq_retire;
+};
+
+struct shm_qp_shared {
+    uint32_t qpn;
+    uint32_t state;
+    uint32_t access_flags;
+    uint32_t qkey; // UD
+    uint64_t recv_cq_offset;
+    uint64_t rq_offset;
+};
+
+/* ------------------------------------------------------------------------
+ * Process-local objects.
+ * --------------------------------------------------------------------- */
+
+struct shm_peer {
+    uint16_t lid;
+    int is_self;
+    pid_t pid;
+    struct shm_segment *seg;
+    size_t seg_size;
+    pthread_mutex_t lock;
+    int async_fd; // opened on the first async event raised at this peer
+    char *mr_base[SHM_MAX_MRS];
+};
+
+struct shm_context {
+    struct ibv_context ibv;
+    uint16_t lid;
+    int seg_fd;
+    size_t seg_size;
+    struct shm_segment *seg;
+    pthread_mutex_t lock;
+    int async_wfd;
+    struct shm_srq *srqs; // scanned by ibv_get_async_event
+    struct shm_peer self;
+    struct shm_peer **peers;
+    struct shm_qp **qps;
+    uint32_t nqps;
+    uint32_t next_mr;
+    uint32_t next_pd;
+    int npending;
+};
+
+struct shm_cq {
+    struct ibv_cq ibv;
+    struct shm_ring *ring;
+    uint64_t offset;
+};
+
+struct shm_srq {
+    struct ibv_srq ibv;
+    struct shm_rq_shared *rq;
+    uint64_t offset;
+    struct shm_srq *next;
+};
+
+struct shm_mr {
+    struct ibv_mr ibv;
+    uint32_t index;
+};
+
+struct shm_ah {
+    struct ibv_ah ibv;
+    uint16_t dlid;
+};
+
+struct shm_send_wqe {
+    uint64_t wr_id;
+    uint32_t opcode;
+    uint32_t send_flags;
+    uint32_t imm_data;
+    uint32_t num_sge;
+    uint64_t remote_addr;
+    uint32_t rkey;
+    uint32_t inline_len;
+    // UD destination
+    uint32_t remote_qpn;
+    uint32_t remote_qkey;
+    uint32_t dlid;
+    struct ibv_sge sge[SHM_MAX_SGE];
+};
+
+struct shm_qp {
+    struct ibv_qp ibv;
+    struct shm_qp_shared *sh;
+    uint64_t offset;
+    uint32_t index;
+    struct shm_rq_shared *rq;
+    struct ibv_qp_cap cap;
+    int sq_sig_all;
+    pthread_spinlock_t sq_lock;
+    struct shm_send_wqe *sq;
+    char *sq_inline;
+    uint32_t sq_depth;
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_outstanding;
+    uint32_t unsignaled;
+    int pending;
+    struct ibv_qp_attr attr;
+    struct shm_peer *peer;
+    struct shm_qp_shared *remote;
+};
+
+struct shm_iov {
+    char *ptr;
+    uint64_t len;
+};
+
+enum shm_exec_result {
+    SHM_EXEC_DONE,
+    SHM_EXEC_RNR,
+};
+
+static struct ibv_device shm_device = {
+        .name = "shm0",
+        .dev_name = "shmverbs0",
+        .node_type = IBV_NODE_CA,
+        .transport_type = IBV_TRANSPORT_IB,
+};
+static struct ibv_device *shm_device_list[] = {&shm_device, NULL};
+
+static pthread_once_t shm_registry_once = PTHREAD_ONCE_INIT;
+static struct shm_registry *shm_registry = NULL;
+
+static inline struct shm_context *to_ctx(struct ibv_context *ibctx)
+{
+    return SHM_CONTAINER(ibctx, struct shm_context, ibv);
+}
+
+static inline uint32_t shm_pow2(uint32_t n)
+{
+    uint32_t ret = 1;
+    while (ret < n) ret <<= 1;
+    return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * Registry and segments
+ * --------------------------------------------------------------------- */
+
+static void shm_registry_init(void)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/ibvbench-shmverbs-%d", (int) getuid());
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "shmverbs: cannot open registry %s: %s\n", name,
+                strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        (size_t) st.st_size < sizeof(struct shm_registry)) {
+        if (ftruncate(fd, sizeof(struct shm_registry)) != 0) {
+            fprintf(stderr, "shmverbs: cannot size registry %s: %s\n", name,
+                    strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+    void *ptr = mmap(NULL, sizeof(struct shm_registry), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "shmverbs: cannot map registry %s: %s\n", name,
+                strerror(errno));
+        return;
+    }
+    shm_registry = (struct shm_registry *) ptr;
+}
+
+static int shm_pid_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Claim a free LID; slots of dead processes are recycled.
+static int shm_claim_lid(void)
+{
+    int32_t me = (int32_t) getpid();
+    for (int i = 0; i < SHM_MAX_LIDS; ++i) {
+        struct shm_registry_slot *slot = &shm_registry->slots[i];
+        int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && shm_pid_alive(pid)) continue;
+        if (__atomic_compare_exchange_n(&slot->pid, &pid, me, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return i + 1;
+    }
+    return -1;
+}
+
+static uint32_t shm_alloc_qpn(void)
+{
+    uint32_t qpn;
+    do {
+        qpn = (__atomic_fetch_add(&shm_registry->next_qpn, 1,
+                                  __ATOMIC_RELAXED) + SHM_QPN_BASE) & 0xffffff;
+    } while (qpn < SHM_QPN_BASE);
+    return qpn;
+}
+
+// Allocate from the owner's segment. Segment memory is never reclaimed.
+static uint64_t shm_seg_alloc(struct shm_context *ctx, size_t size)
+{
+    pthread_mutex_lock(&ctx->lock);
+    uint64_t offset = (ctx->seg->brk + SHM_CACHE_LINE - 1) &
+                      ~(uint64_t) (SHM_CACHE_LINE - 1);
+    if (offset + size > ctx->seg_size) {
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    ctx->seg->brk = offset + size;
+    pthread_mutex_unlock(&ctx->lock);
+    return offset;
+}
+
+static void shm_qpn_insert(struct shm_segment *seg, uint32_t qpn,
+                           uint64_t offset)
+{
+    // QPs may be created from several threads: claim the entry with a CAS.
+    // Nobody looks the QPN up before ibv_create_qp returns it, so the offset
+    // can follow.
+    uint32_t h = (qpn * 2654435761u) & (SHM_QPN_TABLE_SIZE - 1);
+    uint32_t expected = 0;
+    while (!__atomic_compare_exchange_n(&seg->qpn_table[h].qpn, &expected, qpn, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        h = (h + 1) & (SHM_QPN_TABLE_SIZE - 1);
+        expected = 0;
+    }
+    __atomic_store_n(&seg->qpn_table[h].offset, offset, __ATOMIC_RELEASE);
+}
+
+static struct shm_qp_shared *shm_qpn_lookup(struct shm_segment *seg,
+                                            uint32_t qpn)
+{
+    uint32_t h = (qpn * 2654435761u) & (SHM_QPN_TABLE_SIZE - 1);
+    uint32_t cur;
+    while ((cur = __atomic_load_n(&seg->qpn_table[h].qpn, __ATOMIC_ACQUIRE))) {
+        if (cur == qpn)
+            return (struct shm_qp_shared *) SHM_PTR(
+                    seg, __atomic_load_n(&seg->qpn_table[h].offset,
+                                         __ATOMIC_ACQUIRE));
+        h = (h + 1) & (SHM_QPN_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+static void *shm_map_remote_fd(pid_t pid, int fd, size_t *size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) pid, fd);
+    int local_fd = open(path, O_RDWR);
+    if (local_fd < 0) {
+        fprintf(stderr, "shmverbs: cannot open %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+    if (*size == 0) {
+        struct stat st;
+        if (fstat(local_fd, &st) != 0) {
+            close(local_fd);
+            return NULL;
+        }
+        *size = st.st_size;
+    }
+    void *ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     local_fd, 0);
+    close(local_fd);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static struct shm_peer *shm_get_peer(struct shm_context *ctx, uint16_t lid)
+{
+    if (lid == ctx->lid) return &ctx->self;
+    if (lid == 0 || lid > SHM_MAX_LIDS) return NULL;
+    struct shm_peer *peer = __atomic_load_n(&ctx->peers[lid - 1],
+                                            __ATOMIC_ACQUIRE);
+    if (peer) return peer;
+
+    pthread_mutex_lock(&ctx->lock);
+    peer = ctx->peers[lid - 1];
+    if (!peer) {
+        struct shm_registry_slot *slot = &shm_registry->slots[lid - 1];
+        pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        size_t size = 0;
+        struct shm_segment *seg = NULL;
+        if (pid != 0)
+            seg = (struct shm_segment *) shm_map_remote_fd(pid, slot->seg_fd,
+                                                           &size);
+        if (seg && (seg->magic != SHM_SEGMENT_MAGIC || seg->lid != lid)) {
+            munmap(seg, size);
+            seg = NULL;
+        }
+        if (seg) {
+            peer = (struct shm_peer *) calloc(1, sizeof(struct shm_peer));
+            peer->lid = lid;
+            peer->pid = pid;
+            peer->seg = seg;
+            peer->seg_size = size;
+            peer->async_fd = -1;
+            pthread_mutex_init(&peer->lock, NULL);
+            __atomic_store_n(&ctx->peers[lid - 1], peer, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return peer;
+}
+
+// Disarm an armed SRQ limit once fewer WQEs than the limit are left and raise
+// IBV_EVENT_SRQ_LIMIT_REACHED at the owner of the queue.
+static void shm_rq_check_limit(struct shm_peer *owner,
+                               struct shm_rq_shared *rq)
+{
+    uint32_t limit = __atomic_load_n(&rq->srq_limit, __ATOMIC_ACQUIRE);
+    if (limit == 0 || shm_ring_count(&rq->ring) >= limit) return;
+    if (!__atomic_compare_exchange_n(&rq->srq_limit, &limit, 0, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    __atomic_store_n(&rq->limit_reached, 1, __ATOMIC_RELEASE);
+
+    int fd = __atomic_load_n(&owner->async_fd, __ATOMIC_ACQUIRE);
+    if (fd < 0) {
+        pthread_mutex_lock(&owner->lock);
+        if (owner->async_fd < 0) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) owner->pid,
+                     owner->seg->async_fd);
+            __atomic_store_n(&owner->async_fd,
+                             open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC),
+                             __ATOMIC_RELEASE);
+        }
+        fd = owner->async_fd;
+        pthread_mutex_unlock(&owner->lock);
+        if (fd < 0) return;
+    }
+    // a full pipe already wakes up the owner
+    char c = 0;
+    ssize_t ret = write(fd, &c, 1);
+    (void) ret;
+}
+
+// Translate a (key, addr, len) triple of a peer into a local pointer.
+static char *shm_translate(struct shm_peer *peer, uint32_t key, uint64_t addr,
+                           uint64_t len, uint32_t access)
+{
+    uint32_t idx = SHM_KEY_INDEX(key);
+    if (idx >= SHM_MAX_MRS) return NULL;
+    struct shm_mr_entry *entry = &peer->seg->mrs[idx];
+    if (!__atomic_load_n(&entry->valid, __ATOMIC_ACQUIRE) ||
+        entry->key != key)
+        return NULL;
+    if (addr < entry->addr || addr + len > entry->addr + entry->length)
+        return NULL;
+    if ((entry->access & access) != access) return NULL;
+    if (peer->is_self) return (char *) addr;
+
+    char *base = __atomic_load_n(&peer->mr_base[idx], __ATOMIC_ACQUIRE);
+    if (!base) {
+        pthread_mutex_lock(&peer->lock);
+        base = peer->mr_base[idx];
+        if (!base) {
+            size_t size = entry->map_len;
+            base = (char *) shm_map_remote_fd(peer->pid, entry->fd, &size);
+            __atomic_store_n(&peer->mr_base[idx], base, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&peer->lock);
+        if (!base) return NULL;
+    }
+    return base + (addr - entry->map_base);
+}
+
+// Place data in address order and store the final byte last, like an HCA
+// writing a message front to back; pollers may spin on the last byte.
+static void shm_copy(const struct shm_iov *dst, const struct shm_iov *src,
+                     uint64_t total)
+{
+    if (total == 0) return;
+    uint64_t doff = 0, soff = 0, left = total - 1;
+    while (left) {
+        uint64_t n = dst->len - doff;
+        if (src->len - soff < n) n = src->len - soff;
+        if (left < n) n = left;
+        memcpy(dst->ptr + doff, src->ptr + soff, n);
+        doff += n;
+        soff += n;
+        left -= n;
+        if (doff == dst->len) {
+            ++dst;
+            doff = 0;
+        }
+        if (soff == src->len) {
+            ++src;
+            soff = 0;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *(volatile char *) (dst->ptr + doff) = src->ptr[soff];
+}
+
+/* ------------------------------------------------------------------------
+ * Device, context, PD
+ * --------------------------------------------------------------------- */
+
+struct ibv_device **ibv_get_device_list(int *num_devices)
+{
+    if (num_devices) *num_devices = 1;
+    return shm_device_list;
+}
+
+void ibv_free_device_list(struct ibv_device **list) { (void) list; }
+
+const char *ibv_get_device_name(struct ibv_device *device)
+{
+    return device->name;
+}
+
+uint64_t ibv_get_device_guid(struct ibv_device *device)
+{
+    (void) device;
+    return 0x0002c90300000000ULL | (uint64_t) getpid();
+}
+
+struct ibv_context *ibv_open_device(struct ibv_device *device)
+{
+    pthread_once(&shm_registry_once, shm_registry_init);
+    if (!shm_registry) {
+        errno = ENODEV;
+        return NULL;
+    }
+    struct shm_context *ctx =
+            (struct shm_context *) calloc(1, sizeof(struct shm_context));
+    if (!ctx) return NULL;
+    ctx->peers = (struct shm_peer **) calloc(SHM_MAX_LIDS,
+                                             sizeof(struct shm_peer *));
+    ctx->qps = (struct shm_qp **) calloc(SHM_MAX_QPS, sizeof(struct shm_qp *));
+    if (!ctx->peers || !ctx->qps) goto err_free;
+
+    ctx->seg_size = SHM_SEGMENT_SIZE_DEFAULT;
+    char *p = getenv("IBVB_SHM_SEGMENT_SIZE");
+    if (p) ctx->seg_size = strtoull(p, NULL, 0);
+    if (ctx->seg_size < sizeof(struct shm_segment) + (1 << 20))
+        ctx->seg_size = sizeof(struct shm_segment) + (1 << 20);
+
+    ctx->seg_fd = memfd_create("ibvbench-shmverbs", 0);
+    if (ctx->seg_fd < 0) goto err_free;
+    if (ftruncate(ctx->seg_fd, ctx->seg_size) != 0) goto err_close;
+    ctx->seg = (struct shm_segment *) mmap(NULL, ctx->seg_size,
+                                           PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           ctx->seg_fd, 0);
+    if (ctx->seg == MAP_FAILED) goto err_close;
+
+    int lid = shm_claim_lid();
+    if (lid < 0) {
+        fprintf(stderr, "shmverbs: no free LID in the host registry\n");
+        errno = EBUSY;
+        goto err_unmap;
+    }
+    ctx->lid = (uint16_t) lid;
+    ctx->seg->size = ctx->seg_size;
+    ctx->seg->owner_pid = getpid();
+    ctx->seg->lid = ctx->lid;
+    ctx->seg->brk = sizeof(struct shm_segment);
+    // Async events are announced by a byte on a pipe; peers that raise
+    // one write to it through /proc/<pid>/fd/<fd>.
+    int async_fds[2];
+    if (pipe2(async_fds, O_CLOEXEC) != 0) goto err_unmap;
+    ctx->ibv.async_fd = async_fds[0];
+    ctx->async_wfd = async_fds[1];
+    ctx->seg->async_fd = async_fds[1];
+    __atomic_store_n(&ctx->seg->magic, SHM_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm_registry->slots[lid - 1].seg_fd, ctx->seg_fd,
+                     __ATOMIC_RELEASE);
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->self.lid = ctx->lid;
+    ctx->self.is_self = 1;
+    ctx->self.pid = getpid();
+    ctx->self.seg = ctx->seg;
+    ctx->self.seg_size = ctx->seg_size;
+    ctx->self.async_fd = ctx->async_wfd;
+    pthread_mutex_init(&ctx->self.lock, NULL);
+
+    ctx->ibv.device = device;
+    ctx->ibv.cmd_fd = -1;
+    ctx->ibv.num_comp_vectors = 1;
+    return &ctx->ibv;
+
+err_unmap:
+    munmap(ctx->seg, ctx->seg_size);
+err_close:
+    close(ctx->seg_fd);
+err_free:
+    free(ctx->qps);
+    free(ctx->peers);
+    free(ctx);
+    return NULL;
+}
+
+int ibv_close_device(struct ibv_context *context)
+{
+    struct shm_context *ctx = to_ctx(context);
+    int32_t me = (int32_t) getpid();
+    __atomic_compare_exchange_n(&shm_registry->slots[ctx->lid - 1].pid, &me, 0,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    for (int i = 0; i < SHM_MAX_LIDS; ++i) {
+        struct shm_peer *peer = ctx->peers[i];
+        if (!peer) continue;
+        if (peer->async_fd >= 0) close(peer->async_fd);
+        munmap(peer->seg, peer->seg_size);
+        free(peer);
+    }
+    munmap(ctx->seg, ctx->seg_size);
+    close(ctx->seg_fd);
+    close(ctx->ibv.async_fd);
+    close(ctx->async_wfd);
+    free(ctx->qps);
+    free(ctx->peers);
+    free(ctx);
+    return 0;
+}
+
+int ibv_query_device(struct ibv_context *context,
+                     struct ibv_device_attr *device_attr)
+{
+    (void) context;
+    memset(device_attr, 0, sizeof(*device_attr));
+    snprintf(device_attr->fw_ver, sizeof(device_attr->fw_ver), "shmverbs-1.0");
+    device_attr->node_guid = ibv_get_device_guid(&shm_device);
+    device_attr->sys_image_guid = device_attr->node_guid;
+    device_attr->max_mr_size = UINT32_MAX;
+    device_attr->page_size_cap = (uint64_t) sysconf(_SC_PAGESIZE);
+    device_attr->vendor_id = 0x2c9;
+    device_attr->max_qp = SHM_MAX_QPS;
+    device_attr->max_qp_wr = SHM_MAX_WR;
+    device_attr->max_sge = SHM_MAX_SGE;
+    device_attr->max_sge_rd = SHM_MAX_SGE;
+    device_attr->max_cq = SHM_MAX_QPS;
+    device_attr->max_cqe = SHM_MAX_CQE;
+    device_attr->max_mr = SHM_MAX_MRS;
+    device_attr->max_pd = SHM_MAX_PDS;
+    device_attr->max_qp_rd_atom = 16;
+    device_attr->max_res_rd_atom = 16 * SHM_MAX_QPS;
+    device_attr->max_qp_init_rd_atom = 16;
+    device_attr->atomic_cap = IBV_ATOMIC_NONE;
+    device_attr->max_srq = SHM_MAX_QPS;
+    device_attr->max_srq_wr = SHM_MAX_WR;
+    device_attr->max_srq_sge = SHM_MAX_SGE;
+    device_attr->max_pkeys = 1;
+    device_attr->phys_port_cnt = 1;
+    return 0;
+}
+
+int ibv_query_port(struct ibv_context *context, uint8_t port_num,
+                   struct ibv_port_attr *port_attr)
+{
+    if (port_num != 1) return EINVAL;
+    memset(port_attr, 0, sizeof(*port_attr));
+    port_attr->state = IBV_PORT_ACTIVE;
+    port_attr->max_mtu = IBV_MTU_4096;
+    port_attr->active_mtu = IBV_MTU_4096;
+    port_attr->gid_tbl_len = 1;
+    port_attr->max_msg_sz = 1U << 31;
+    port_attr->pkey_tbl_len = 1;
+    port_attr->lid = to_ctx(context)->lid;
+    port_attr->sm_lid = 1;
+    port_attr->max_vl_num = 1;
+    port_attr->active_width = 2;  // 4x
+    port_attr->active_speed = 32; // EDR
+    port_attr->phys_state = 5;    // LinkUp
+    port_attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+    return 0;
+}
+
+int ibv_query_gid(struct ibv_context *context, uint8_t port_num, int index,
+                  union ibv_gid *gid)
+{
+    if (port_num != 1 || index != 0) return EINVAL;
+    memset(gid, 0, sizeof(*gid));
+    gid->raw[0] = 0xfe;
+    gid->raw[1] = 0x80;
+    gid->raw[14] = (uint8_t) (to_ctx(context)->lid >> 8);
+    gid->raw[15] = (uint8_t) (to_ctx(context)->lid & 0xff);
+    return 0;
+}
+
+const char *ibv_port_state_str(enum ibv_port_state port_state)
+{
+    static const char *const port_state_str[] = {
+        "PORT_NOP", "PORT_DOWN", "PORT_INIT", "PORT_ARMED",
+        "PORT_ACTIVE", "PORT_ACTIVE_DEFER"
+    };
+    if (port_state < IBV_PORT_NOP || port_state > IBV_PORT_ACTIVE_DEFER)
+        return "unknown";
+    return port_state_str[port_state];
+}
+
+const char *ibv_wc_status_str(enum ibv_wc_status status)
+{
+    static const char *const wc_status_str[] = {
+            [IBV_WC_SUCCESS] = "success",
+            [IBV_WC_LOC_LEN_ERR] = "local length error",
+            [IBV_WC_LOC_QP_OP_ERR] = "local QP operation error",
+            [IBV_WC_LOC_EEC_OP_ERR] = "local EE context operation error",
+            [IBV_WC_LOC_PROT_ERR] = "local protection error",
+            [IBV_WC_WR_FLUSH_ERR] = "Work Request Flushed Error",
+            [IBV_WC_MW_BIND_ERR] = "memory management operation error",
+            [IBV_WC_BAD_RESP_ERR] = "bad response error",
+            [IBV_WC_LOC_ACCESS_ERR] = "local access error",
+            [IBV_WC_REM_INV_REQ_ERR] = "remote invalid request error",
+            [IBV_WC_REM_ACCESS_ERR] = "remote access error",
+            [IBV_WC_REM_OP_ERR] = "remote operation error",
+            [IBV_WC_RETRY_EXC_ERR] = "transport retry counter exceeded",
+            [IBV_WC_RNR_RETRY_EXC_ERR] = "RNR retry counter exceeded",
+            [IBV_WC_LOC_RDD_VIOL_ERR] = "local RDD violation error",
+            [IBV_WC_REM_INV_RD_REQ_ERR] = "remote invalid RD request",
+            [IBV_WC_REM_ABORT_ERR] = "aborted error",
+            [IBV_WC_INV_EECN_ERR] = "invalid EE context number",
+            [IBV_WC_INV_EEC_STATE_ERR] = "invalid EE context state",
+            [IBV_WC_FATAL_ERR] = "fatal error",
+            [IBV_WC_RESP_TIMEOUT_ERR] = "response timeout error",
+            [IBV_WC_GENERAL_ERR] = "general error",
+    };
+    if ((unsigned) status > IBV_WC_GENERAL_ERR) return "unknown";
+    return wc_status_str[status];
+}
+
+// The flags of the SRQs are the events; the pipe only wakes up the reader.
+// Follows the fd: with O_NONBLOCK set on async_fd, returns -1 (EAGAIN) when
+// no event is pending.
+int ibv_get_async_event(struct ibv_context *context,
+                        struct ibv_async_event *event)
+{
+    struct shm_context *ctx = to_ctx(context);
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        for (struct shm_srq *srq = ctx->srqs; srq; srq = srq->next) {
+            if (__atomic_exchange_n(&srq->rq->limit_reached, 0,
+                                    __ATOMIC_ACQ_REL)) {
+                pthread_mutex_unlock(&ctx->lock);
+                event->element.srq = &srq->ibv;
+                event->event_type = IBV_EVENT_SRQ_LIMIT_REACHED;
+                return 0;
+            }
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        char buf[64];
+        if (read(context->async_fd, buf, sizeof(buf)) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+void ibv_ack_async_event(struct ibv_async_event *event) { (void) event; }
+
+const char *ibv_event_type_str(enum ibv_event_type event)
+{
+    static const char *const event_type_str[] = {
+            [IBV_EVENT_CQ_ERR] = "CQ error",
+            [IBV_EVENT_QP_FATAL] = "local work queue catastrophic error",
+            [IBV_EVENT_QP_REQ_ERR] = "invalid request local work queue error",
+            [IBV_EVENT_QP_ACCESS_ERR] = "local access violation work queue error",
+            [IBV_EVENT_COMM_EST] = "communication established",
+            [IBV_EVENT_SQ_DRAINED] = "send queue drained",
+            [IBV_EVENT_PATH_MIG] = "path migrated",
+            [IBV_EVENT_PATH_MIG_ERR] = "path migration request error",
+            [IBV_EVENT_DEVICE_FATAL] = "local catastrophic error",
+            [IBV_EVENT_PORT_ACTIVE] = "port active",
+            [IBV_EVENT_PORT_ERR] = "port error",
+            [IBV_EVENT_LID_CHANGE] = "LID change",
+            [IBV_EVENT_PKEY_CHANGE] = "P_Key change",
+            [IBV_EVENT_SM_CHANGE] = "SM change",
+            [IBV_EVENT_SRQ_ERR] = "SRQ catastrophic error",
+            [IBV_EVENT_SRQ_LIMIT_REACHED] = "SRQ limit reached",
+            [IBV_EVENT_QP_LAST_WQE_REACHED] = "last WQE reached",
+            [IBV_EVENT_CLIENT_REREGISTER] = "client reregistration",
+            [IBV_EVENT_GID_CHANGE] = "GID table change",
+    };
+    if ((unsigned) event > IBV_EVENT_GID_CHANGE) return "unknown";
+    return event_type_str[event];
+}
+
+struct ibv_pd *ibv_alloc_pd(struct ibv_context *context)
+{
+    struct shm_context *ctx = to_ctx(context);
+    struct ibv_pd *pd = (struct ibv_pd *) calloc(1, sizeof(struct ibv_pd));
+    if (!pd) return NULL;
+    pd->context = context;
+    pd->handle = __atomic_fetch_add(&ctx->next_pd, 1, __ATOMIC_RELAXED);
+    return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd *pd)
+{
+    free(pd);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Memory registration
+ * --------------------------------------------------------------------- */
+
+// Registration moves the pages backing [addr, addr + length) onto a memfd,
+// in place, so that peers can map them. Pages already moved by an earlier
+// registration are shared with it.
+struct ibv_mr *ibv_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+                          int access)
+{
+    struct shm_context *ctx = to_ctx(pd->context);
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t map_base = (uintptr_t) addr & ~(page_size - 1);
+    uintptr_t map_end = ((uintptr_t) addr + length + page_size - 1) &
+                        ~(page_size - 1);
+    if (!addr || length == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t idx = ctx->next_mr;
+    if (idx >= SHM_MAX_MRS) {
+        pthread_mutex_unlock(&ctx->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct shm_mr_entry *entry = &ctx->seg->mrs[idx];
+    int fd = -1;
+    for (uint32_t i = 0; i < idx; ++i) {
+        struct shm_mr_entry *old = &ctx->seg->mrs[i];
+        if (!old->valid) continue;
+        uint64_t old_end = old->map_base + old->map_len;
+        if (map_base >= old->map_base && map_end <= old_end) {
+            fd = old->fd;
+            map_base = old->map_base;
+            map_end = old_end;
+            break;
+        }
+        if (map_base < old_end && map_end > old->map_base) {
+            fprintf(stderr, "shmverbs: memory region %p+%zu partially "
+                            "overlaps a registered region\n", addr, length);
+            pthread_mutex_unlock(&ctx->lock);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    if (fd < 0) {
+        size_t map_len = map_end - map_base;
+        fd = memfd_create("ibvbench-shmverbs-mr", 0);
+        void *tmp = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, map_len) == 0)
+            tmp = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       0);
+        if (tmp == MAP_FAILED) {
+            if (fd >= 0) close(fd);
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+        memcpy(tmp, (void *) map_base, map_len);
+        munmap(tmp, map_len);
+        if (mmap((void *) map_base, map_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            close(fd);
+            pthread_mutex_unlock(&ctx->lock);
+            return NULL;
+        }
+    }
+    entry->addr = (uintptr_t) addr;
+    entry->length = length;
+    entry->map_base = map_base;
+    entry->map_len = map_end - map_base;
+    entry->fd = fd;
+    entry->key = SHM_KEY(idx, ctx->lid);
+    entry->access = (uint32_t) access;
+    __atomic_store_n(&entry->valid, 1, __ATOMIC_RELEASE);
+    ctx->next_mr = idx + 1;
+    pthread_mutex_unlock(&ctx->lock);
+
+    struct shm_mr *mr = (struct shm_mr *) calloc(1, sizeof(struct shm_mr));
+    mr->index = idx;
+    mr->ibv.context = pd->context;
+    mr->ibv.pd = pd;
+    mr->ibv.addr = addr;
+    mr->ibv.length = length;
+    mr->ibv.handle = idx;
+    mr->ibv.lkey = entry->key;
+    mr->ibv.rkey = entry->key;
+    return &mr->ibv;
+}
+
+// The pages stay on the memfd; only the key is invalidated.
+int ibv_dereg_mr(struct ibv_mr *ibmr)
+{
+    struct shm_mr *mr = SHM_CONTAINER(ibmr, struct shm_mr, ibv);
+    struct shm_context *ctx = to_ctx(ibmr->context);
+    __atomic_store_n(&ctx->seg->mrs[mr->index].valid, 0, __ATOMIC_RELEASE);
+    free(mr);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Completion queues
+ * --------------------------------------------------------------------- */
+
+struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe,
+                             void *cq_context,
+                             struct ibv_comp_channel *channel, int comp_vector)
+{
+    (void) comp_vector;
+    struct shm_context *ctx = to_ctx(context);
+    if (cqe <= 0 || cqe > SHM_MAX_CQE || channel) {
+        errno = channel ? EOPNOTSUPP : EINVAL;
+        return NULL;
+    }
+    uint32_t capacity = shm_pow2((uint32_t) cqe + 1);
+    uint64_t offset = shm_seg_alloc(
+            ctx, shm_ring_bytes(capacity, sizeof(struct shm_cqe)));
+    if (!offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct shm_cq *cq = (struct shm_cq *) calloc(1, sizeof(struct shm_cq));
+    cq->offset = offset;
+    cq->ring = (struct shm_ring *) SHM_PTR(ctx->seg, offset);
+    shm_ring_init(cq->ring, capacity, sizeof(struct shm_cqe));
+    cq->ibv.context = context;
+    cq->ibv.cq_context = cq_context;
+    cq->ibv.handle = (uint32_t) (offset / SHM_CACHE_LINE);
+    cq->ibv.cqe = (int) capacity - 1;
+    return &cq->ibv;
+}
+
+int ibv_destroy_cq(struct ibv_cq *cq)
+{
+    free(SHM_CONTAINER(cq, struct shm_cq, ibv));
+    return 0;
+}
+
+static void shm_cq_push(struct shm_ring *ring, const struct shm_cqe *cqe)
+{
+    if (shm_ring_push(ring, cqe, sizeof(*cqe)) != 0) {
+        fprintf(stderr, "shmverbs: CQ overrun (qp_num %u)\n", cqe->qp_num);
+        abort();
+    }
+}
+
+static void shm_progress_pending(struct shm_context *ctx);
+
+int ibv_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
+{
+    struct shm_cq *cq = SHM_CONTAINER(ibcq, struct shm_cq, ibv);
+    struct shm_context *ctx = to_ctx(ibcq->context);
+    if (__atomic_load_n(&ctx->npending, __ATOMIC_RELAXED))
+        shm_progress_pending(ctx);
+
+    int n = 0;
+    struct shm_cqe cqe;
+    for (; n < num_entries; ++n) {
+        if (shm_ring_pop(cq->ring, &cqe, sizeof(cqe)) != 0) break;
+        if (cqe.sq_retire) {
+            struct shm_qp *qp = ctx->qps[cqe.qp_index];
+            __atomic_fetch_sub(&qp->sq_outstanding, cqe.sq_retire,
+                               __ATOMIC_RELEASE);
+        }
+        wc[n].wr_id = cqe.wr_id;
+        wc[n].status = (enum ibv_wc_status) cqe.status;
+        wc[n].opcode = (enum ibv_wc_opcode) cqe.opcode;
+        wc[n].vendor_err = 0;
+        wc[n].byte_len = cqe.byte_len;
+        wc[n].imm_data = cqe.imm_data;
+        wc[n].qp_num = cqe.qp_num;
+        wc[n].src_qp = cqe.src_qp;
+        wc[n].wc_flags = cqe.wc_flags;
+        wc[n].pkey_index = 0;
+        wc[n].slid = (uint16_t) cqe.slid;
+        wc[n].sl = 0;
+        wc[n].dlid_path_bits = 0;
+    }
+    return n;
+}
+
+/* ------------------------------------------------------------------------
+ * Receive queues
+ * --------------------------------------------------------------------- */
+
+static struct shm_rq_shared *shm_rq_create(struct shm_context *ctx,
+                                           uint32_t max_wr, uint32_t max_sge,
+                                           uint64_t *offset_out)
+{
+    if (max_wr == 0 || max_wr > SHM_MAX_WR || max_sge > SHM_MAX_SGE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t capacity = shm_pow2(max_wr);
+    size_t size = offsetof(struct shm_rq_shared, ring) +
+                  shm_ring_bytes(capacity, sizeof(struct shm_recv_wqe));
+    uint64_t offset = shm_seg_alloc(ctx, size);
+    if (!offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct shm_rq_shared *rq = (struct shm_rq_shared *) SHM_PTR(ctx->seg,
+                                                                offset);
+    rq->max_sge = max_sge ? max_sge : 1;
+    rq->srq_limit = 0;
+    rq->limit_reached = 0;
+    shm_ring_init(&rq->ring, capacity, sizeof(struct shm_recv_wqe));
+    *offset_out = offset;
+    return rq;
+}
+
+static int shm_rq_post(struct shm_rq_shared *rq, struct ibv_recv_wr *wr,
+                       struct ibv_recv_wr **bad_wr)
+{
+    struct shm_recv_wqe wqe;
+    for (; wr; wr = wr->next) {
+        if (wr->num_sge < 0 || (uint32_t) wr->num_sge > rq->max_sge) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        wqe.wr_id = wr->wr_id;
+        wqe.num_sge = (uint32_t) wr->num_sge;
+        wqe.padding = 0;
+        memcpy(wqe.sge, wr->sg_list, wr->num_sge * sizeof(struct ibv_sge));
+        if (shm_ring_push(&rq->ring, &wqe, sizeof(wqe)) != 0) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+struct ibv_srq *ibv_create_srq(struct ibv_pd *pd,
+                               struct ibv_srq_init_attr *srq_init_attr)
+{
+    struct shm_context *ctx = to_ctx(pd->context);
+    uint64_t offset;
+    struct shm_rq_shared *rq = shm_rq_create(ctx, srq_init_attr->attr.max_wr,
+                                             srq_init_attr->attr.max_sge,
+                                             &offset);
+    if (!rq) return NULL;
+    rq->srq_limit = srq_init_attr->attr.srq_limit;
+    struct shm_srq *srq = (struct shm_srq *) calloc(1, sizeof(struct shm_srq));
+    srq->rq = rq;
+    srq->offset = offset;
+    srq->ibv.context = pd->context;
+    srq->ibv.srq_context = srq_init_attr->srq_context;
+    srq->ibv.pd = pd;
+    srq->ibv.handle = (uint32_t) (offset / SHM_CACHE_LINE);
+    srq_init_attr->attr.max_wr = rq->ring.mask + 1;
+    srq_init_attr->attr.max_sge = rq->max_sge;
+    pthread_mutex_lock(&ctx->lock);
+    srq->next = ctx->srqs;
+    ctx->srqs = srq;
+    pthread_mutex_unlock(&ctx->lock);
+    return &srq->ibv;
+}
+
+int ibv_modify_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *srq_attr,
+                   int srq_attr_mask)
+{
+    struct shm_srq *srq = SHM_CONTAINER(ibsrq, struct shm_srq, ibv);
+    if (srq_attr_mask & IBV_SRQ_MAX_WR) return EINVAL; // no resize
+    if (srq_attr_mask & IBV_SRQ_LIMIT) {
+        if (srq_attr->srq_limit > srq->rq->ring.mask + 1) return EINVAL;
+        __atomic_store_n(&srq->rq->srq_limit, srq_attr->srq_limit,
+                         __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int ibv_query_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *srq_attr)
+{
+    struct shm_srq *srq = SHM_CONTAINER(ibsrq, struct shm_srq, ibv);
+    srq_attr->max_wr = srq->rq->ring.mask + 1;
+    srq_attr->max_sge = srq->rq->max_sge;
+    srq_attr->srq_limit = __atomic_load_n(&srq->rq->srq_limit,
+                                          __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+int ibv_destroy_srq(struct ibv_srq *ibsrq)
+{
+    struct shm_context *ctx = to_ctx(ibsrq->context);
+    struct shm_srq *srq = SHM_CONTAINER(ibsrq, struct shm_srq, ibv);
+    pthread_mutex_lock(&ctx->lock);
+    struct shm_srq **link = &ctx->srqs;
+    while (*link != srq) link = &(*link)->next;
+    *link = srq->next;
+    pthread_mutex_unlock(&ctx->lock);
+    free(srq);
+    return 0;
+}
+
+int ibv_post_srq_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *recv_wr,
+                      struct ibv_recv_wr **bad_recv_wr)
+{
+    struct shm_srq *srq = SHM_CONTAINER(ibsrq, struct shm_srq, ibv);
+    return shm_rq_post(srq->rq, recv_wr, bad_recv_wr);
+}
+
+/* ------------------------------------------------------------------------
+ * Address handles
+ * --------------------------------------------------------------------- */
+
+struct ibv_ah *ibv_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+    if (attr->port_num != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct shm_ah *ah = (struct shm_ah *) calloc(1, sizeof(struct shm_ah));
+    if (!ah) return NULL;
+    ah->ibv.context = pd->context;
+    ah->ibv.pd = pd;
+    ah->dlid = attr->dlid;
+    return &ah->ibv;
+}
+
+int ibv_destroy_ah(struct ibv_ah *ah)
+{
+    free(SHM_CONTAINER(ah, struct shm_ah, ibv));
+    return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Queue pairs
+ * --------------------------------------------------------------------- */
+
+struct ibv_qp *ibv_create_qp(struct ibv_pd *pd,
+                             struct ibv_qp_init_attr *qp_init_attr)
+{
+    struct shm_context *ctx = to_ctx(pd->context);
+    struct ibv_qp_cap *cap = &qp_init_attr->cap;
+    if (qp_init_attr->qp_type != IBV_QPT_RC &&
+        qp_init_attr->qp_type != IBV_QPT_UD) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    if (!qp_init_attr->send_cq || !qp_init_attr->recv_cq ||
+        cap->max_send_wr == 0 || cap->max_send_wr > SHM_MAX_WR ||
+        cap->max_send_sge > SHM_MAX_SGE ||
+        cap->max_inline_data > SHM_MAX_INLINE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    uint32_t index = __atomic_fetch_add(&ctx->nqps, 1, __ATOMIC_RELAXED);
+    if (index >= SHM_MAX_QPS) {
+        __atomic_fetch_sub(&ctx->nqps, 1, __ATOMIC_RELAXED);
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t offset = shm_seg_alloc(ctx, sizeof(struct shm_qp_shared));
+    if (!offset) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct shm_qp *qp = (struct shm_qp *) calloc(1, sizeof(struct shm_qp));
+    qp->offset = offset;
+    qp->index = index;
+    qp->cap = *cap;
+    qp->sq_sig_all = qp_init_attr->sq_sig_all;
+    qp->sq_depth = shm_pow2(cap->max_send_wr);
+    qp->sq = (struct shm_send_wqe *) calloc(qp->sq_depth,
+                                            sizeof(struct shm_send_wqe));
+    if (cap->max_inline_data)
+        qp->sq_inline = (char *) malloc((size_t) qp->sq_depth *
+                                        cap->max_inline_data);
+    pthread_spin_init(&qp->sq_lock, PTHREAD_PROCESS_PRIVATE);
+
+    qp->sh = (struct shm_qp_shared *) SHM_PTR(ctx->seg, offset);
+    qp->sh->state = IBV_QPS_RESET;
+    qp->sh->recv_cq_offset =
+            SHM_CONTAINER(qp_init_attr->recv_cq, struct shm_cq, ibv)->offset;
+    if (qp_init_attr->srq) {
+        struct shm_srq *srq =
+                SHM_CONTAINER(qp_init_attr->srq, struct shm_srq, ibv);
+        qp->rq = srq->rq;
+        qp->sh->rq_offset = srq->offset;
+        cap->max_recv_wr = 0;
+        cap->max_recv_sge = 0;
+    } else {
+        uint64_t rq_offset;
+        qp->rq = shm_rq_create(ctx, cap->max_recv_wr, cap->max_recv_sge,
+                               &rq_offset);
+        if (!qp->rq) {
+            free(qp->sq_inline);
+            free(qp->sq);
+            free(qp);
+            return NULL;
+        }
+        qp->sh->rq_offset = rq_offset;
+    }
+    qp->sh->qpn = shm_alloc_qpn();
+    shm_qpn_insert(ctx->seg, qp->sh->qpn, offset);
+
+    qp->ibv.context = pd->context;
+    qp->ibv.qp_context = qp_init_attr->qp_context;
+    qp->ibv.pd = pd;
+    qp->ibv.send_cq = qp_init_attr->send_cq;
+    qp->ibv.recv_cq = qp_init_attr->recv_cq;
+    qp->ibv.srq = qp_init_attr->srq;
+    qp->ibv.handle = index;
+    qp->ibv.qp_num = qp->sh->qpn;
+    qp->ibv.state = IBV_QPS_RESET;
+    qp->ibv.qp_type = qp_init_attr->qp_type;
+    qp->attr.qp_state = IBV_QPS_RESET;
+    qp->attr.cap = *cap;
+    __atomic_store_n(&ctx->qps[index], qp, __ATOMIC_RELEASE);
+    return &qp->ibv;
+}
+
+static void shm_qp_set_state(struct shm_qp *qp, enum ibv_qp_state state)
+{
+    qp->ibv.state = state;
+    qp->attr.qp_state = state;
+    __atomic_store_n(&qp->sh->state, (uint32_t) state, __ATOMIC_RELEASE);
+}
+
+int ibv_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int attr_mask)
+{
+    struct shm_qp *qp = SHM_CONTAINER(ibqp, struct shm_qp, ibv);
+    struct shm_context *ctx = to_ctx(ibqp->context);
+    enum ibv_qp_state cur = qp->ibv.state;
+    enum ibv_qp_state next = (attr_mask & IBV_QP_STATE) ? attr->qp_state : cur;
+
+    switch (next) {
+        case IBV_QPS_INIT:
+            if (cur != IBV_QPS_RESET && cur != IBV_QPS_INIT) return EINVAL;
+            if (attr_mask & IBV_QP_PORT) {
+                if (attr->port_num != 1) return EINVAL;
+                qp->attr.port_num = attr->port_num;
+            }
+            if (attr_mask & IBV_QP_ACCESS_FLAGS) {
+                qp->attr.qp_access_flags = attr->qp_access_flags;
+                qp->sh->access_flags = attr->qp_access_flags;
+            }
+            if (attr_mask & IBV_QP_PKEY_INDEX)
+                qp->attr.pkey_index = attr->pkey_index;
+            if (attr_mask & IBV_QP_QKEY) {
+                qp->attr.qkey = attr->qkey;
+                qp->sh->qkey = attr->qkey;
+            }
+            break;
+        case IBV_QPS_RTR: {
+            if (cur != IBV_QPS_INIT) return EINVAL;
+            if (ibqp->qp_type == IBV_QPT_UD) break; // addressed per WR
+            if (!(attr_mask & IBV_QP_AV) || !(attr_mask & IBV_QP_DEST_QPN))
+                return EINVAL;
+            struct shm_peer *peer = shm_get_peer(ctx, attr->ah_attr.dlid);
+            if (!peer) return EINVAL;
+            struct shm_qp_shared *remote =
+                    shm_qpn_lookup(peer->seg, attr->dest_qp_num);
+            if (!remote) return EINVAL;
+            qp->peer = peer;
+            qp->remote = remote;
+            qp->attr.ah_attr = attr->ah_attr;
+            qp->attr.dest_qp_num = attr->dest_qp_num;
+            if (attr_mask & IBV_QP_PATH_MTU) qp->attr.path_mtu = attr->path_mtu;
+            if (attr_mask & IBV_QP_RQ_PSN) qp->attr.rq_psn = attr->rq_psn;
+            if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+                qp->attr.max_dest_rd_atomic = attr->max_dest_rd_atomic;
+            if (attr_mask & IBV_QP_MIN_RNR_TIMER)
+                qp->attr.min_rnr_timer = attr->min_rnr_timer;
+            break;
+        }
+        case IBV_QPS_RTS:
+            if (cur != IBV_QPS_RTR && cur != IBV_QPS_RTS) return EINVAL;
+            if (attr_mask & IBV_QP_SQ_PSN) qp->attr.sq_psn = attr->sq_psn;
+            if (attr_mask & IBV_QP_TIMEOUT) qp->attr.timeout = attr->timeout;
+            if (attr_mask & IBV_QP_RETRY_CNT)
+                qp->attr.retry_cnt = attr->retry_cnt;
+            if (attr_mask & IBV_QP_RNR_RETRY)
+                qp->attr.rnr_retry = attr->rnr_retry;
+            if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+                qp->attr.max_rd_atomic = attr->max_rd_atomic;
+            break;
+        case IBV_QPS_RESET:
+        case IBV_QPS_ERR:
+            break;
+        default:
+            return EINVAL;
+    }
+    shm_qp_set_state(qp, next);
+    return 0;
+}
+
+int ibv_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr, int attr_mask,
+                 struct ibv_qp_init_attr *init_attr)
+{
+    (void) attr_mask;
+    struct shm_qp *qp = SHM_CONTAINER(ibqp, struct shm_qp, ibv);
+    *attr = qp->attr;
+    attr->cur_qp_state = qp->ibv.state;
+    if (init_attr) {
+        memset(init_attr, 0, sizeof(*init_attr));
+        init_attr->qp_context = ibqp->qp_context;
+        init_attr->send_cq = ibqp->send_cq;
+        init_attr->recv_cq = ibqp->recv_cq;
+        init_attr->srq = ibqp->srq;
+        init_attr->cap = qp->cap;
+        init_attr->qp_type = ibqp->qp_type;
+        init_attr->sq_sig_all = qp->sq_sig_all;
+    }
+    return 0;
+}
+
+int ibv_destroy_qp(struct ibv_qp *ibqp)
+{
+    struct shm_qp *qp = SHM_CONTAINER(ibqp, struct shm_qp, ibv);
+    struct shm_context *ctx = to_ctx(ibqp->context);
+    shm_qp_set_state(qp, IBV_QPS_RESET);
+    pthread_spin_lock(&qp->sq_lock);
+    if (qp->pending) __atomic_fetch_sub(&ctx->npending, 1, __ATOMIC_RELAXED);
+    pthread_spin_unlock(&qp->sq_lock);
+    __atomic_store_n(&ctx->qps[qp->index], NULL, __ATOMIC_RELEASE);
+    pthread_spin_destroy(&qp->sq_lock);
+    free(qp->sq_inline);
+    free(qp->sq);
+    free(qp);
+    return 0;
+}
+
+int ibv_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+                  struct ibv_recv_wr **bad_wr)
+{
+    struct shm_qp *qp = SHM_CONTAINER(ibqp, struct shm_qp, ibv);
+    if (ibqp->srq) {
+        *bad_wr = wr;
+        return EINVAL;
+    }
+    return shm_rq_post(qp->rq, wr, bad_wr);
+}
+
+/* ------------------------------------------------------------------------
+ * Send queue execution
+ * --------------------------------------------------------------------- */
+
+static void shm_complete_send(struct shm_context *ctx, struct shm_qp *qp,
+                              struct shm_send_wqe *wqe,
+                              enum ibv_wc_status status,
+                              enum ibv_wc_opcode opcode, uint32_t byte_len)
+{
+    if (status == IBV_WC_SUCCESS && !qp->sq_sig_all &&
+        !(wqe->send_flags & IBV_SEND_SIGNALED)) {
+        ++qp->unsignaled;
+        return;
+    }
+    struct shm_cqe cqe;
+    cqe.wr_id = wqe->wr_id;
+    cqe.status = status;
+    cqe.opcode = opcode;
+    cqe.byte_len = byte_len;
+    cqe.imm_data = 0;
+    cqe.qp_num = qp->ibv.qp_num;
+    cqe.src_qp = 0;
+    cqe.wc_flags = 0;
+    cqe.slid = 0;
+    cqe.qp_index = qp->index;
+    cqe.sq_retire = qp->unsignaled + 1;
+    qp->unsignaled = 0;
+    shm_cq_push(SHM_CONTAINER(qp->ibv.send_cq, struct shm_cq, ibv)->ring,
+                &cqe);
+    if (status != IBV_WC_SUCCESS) shm_qp_set_state(qp, IBV_QPS_ERR);
+    (void) ctx;
+}
+
+static enum ibv_wc_opcode shm_wc_opcode(uint32_t wr_opcode)
+{
+    switch (wr_opcode) {
+        case IBV_WR_RDMA_WRITE:
+        case IBV_WR_RDMA_WRITE_WITH_IMM:
+            return IBV_WC_RDMA_WRITE;
+        case IBV_WR_RDMA_READ:
+            return IBV_WC_RDMA_READ;
+        default:
+            return IBV_WC_SEND;
+    }
+}
+
+// Build the local iov list of a send WQE.
+static int shm_local_iov(struct shm_context *ctx, struct shm_qp *qp,
+                         struct shm_send_wqe *wqe, uint32_t access,
+                         struct shm_iov *iov, uint64_t *total)
+{
+    int n = 0;
+    *total = 0;
+    if (wqe->send_flags & IBV_SEND_INLINE) {
+        uint32_t slot = (uint32_t) (wqe - qp->sq);
+        iov[0].ptr = qp->sq_inline + (size_t) slot * qp->cap.max_inline_data;
+        iov[0].len = wqe->inline_len;
+        *total = wqe->inline_len;
+        return wqe->inline_len ? 1 : 0;
+    }
+    for (uint32_t i = 0; i < wqe->num_sge; ++i) {
+        struct ibv_sge *sge = &wqe->sge[i];
+        if (sge->length == 0) continue;
+        char *ptr = shm_translate(&ctx->self, sge->lkey, sge->addr,
+                                  sge->length, access);
+        if (!ptr) return -1;
+        iov[n].ptr = ptr;
+        iov[n].len = sge->length;
+        *total += sge->length;
+        ++n;
+    }
+    return n;
+}
+
+// Size of the GRH that precedes every UD payload in the receive buffer.
+#define SHM_GRH_SIZE 40
+
+// UD send: a datagram to (dlid, remote_qpn). As on the wire, it is
+// silently dropped when the target QP does not exist or is not ready, the
+// Q_Key does not match or no receive WQE is posted.
+static void shm_execute_ud(struct shm_context *ctx, struct shm_qp *qp,
+                           struct shm_send_wqe *wqe)
+{
+    if (wqe->opcode != IBV_WR_SEND && wqe->opcode != IBV_WR_SEND_WITH_IMM) {
+        shm_complete_send(ctx, qp, wqe, IBV_WC_LOC_QP_OP_ERR, IBV_WC_SEND, 0);
+        return;
+    }
+    struct shm_iov local[SHM_MAX_SGE], peer[SHM_MAX_SGE];
+    uint64_t total;
+    if (shm_local_iov(ctx, qp, wqe, 0, local, &total) < 0) {
+        shm_complete_send(ctx, qp, wqe, IBV_WC_LOC_PROT_ERR, IBV_WC_SEND, 0);
+        return;
+    }
+    struct shm_peer *target = shm_get_peer(ctx, (uint16_t) wqe->dlid);
+    struct shm_qp_shared *remote =
+            target ? shm_qpn_lookup(target->seg, wqe->remote_qpn) : NULL;
+    if (!remote ||
+        __atomic_load_n(&remote->state, __ATOMIC_ACQUIRE) < IBV_QPS_RTR ||
+        remote->qkey != wqe->remote_qkey)
+        goto done;
+    struct shm_rq_shared *rq =
+            (struct shm_rq_shared *) SHM_PTR(target->seg, remote->rq_offset);
+    struct shm_recv_wqe rwqe;
+    if (shm_ring_pop(&rq->ring, &rwqe, sizeof(rwqe)) != 0) goto done;
+    shm_rq_check_limit(target, rq);
+
+    struct shm_cqe cqe;
+    cqe.wr_id = rwqe.wr_id;
+    cqe.status = IBV_WC_SUCCESS;
+    cqe.opcode = IBV_WC_RECV;
+    cqe.byte_len = (uint32_t) total + SHM_GRH_SIZE;
+    cqe.imm_data = wqe->imm_data;
+    cqe.qp_num = remote->qpn;
+    cqe.src_qp = qp->ibv.qp_num;
+    cqe.wc_flags = wqe->opcode == IBV_WR_SEND ? 0 : IBV_WC_WITH_IMM;
+    cqe.slid = ctx->lid;
+    cqe.qp_index = 0;
+    cqe.sq_retire = 0;
+    // the payload lands after the (unwritten) GRH
+    int npeer = 0;
+    uint64_t skip = SHM_GRH_SIZE, capacity = 0;
+    for (uint32_t i = 0; i < rwqe.num_sge; ++i) {
+        struct ibv_sge *sge = &rwqe.sge[i];
+        char *ptr = shm_translate(target, sge->lkey, sge->addr, sge->length,
+                                  IBV_ACCESS_LOCAL_WRITE);
+        if (!ptr) {
+            cqe.status = IBV_WC_LOC_PROT_ERR;
+            break;
+        }
+        uint64_t len = sge->length;
+        uint64_t n = skip < len ? skip : len;
+        skip -= n;
+        if (len == n) continue;
+        peer[npeer].ptr = ptr + n;
+        peer[npeer].len = len - n;
+        capacity += len - n;
+        ++npeer;
+    }
+    if (cqe.status == IBV_WC_SUCCESS && (skip > 0 || capacity < total))
+        cqe.status = IBV_WC_LOC_LEN_ERR;
+    if (cqe.status == IBV_WC_SUCCESS) shm_copy(peer, local, total);
+    shm_cq_push((struct shm_ring *) SHM_PTR(target->seg,
+                                            remote->recv_cq_offset),
+                &cqe);
+done:
+    shm_complete_send(ctx, qp, wqe, IBV_WC_SUCCESS, IBV_WC_SEND,
+                      (uint32_t) total);
+}
+
+static enum shm_exec_result shm_execute(struct shm_context *ctx,
+                                        struct shm_qp *qp,
+                                        struct shm_send_wqe *wqe)
+{
+    enum ibv_wc_opcode wc_opcode = shm_wc_opcode(wqe->opcode);
+    if (qp->ibv.state == IBV_QPS_ERR) {
+        shm_complete_send(ctx, qp, wqe, IBV_WC_WR_FLUSH_ERR, wc_opcode, 0);
+        return SHM_EXEC_DONE;
+    }
+    if (qp->ibv.qp_type == IBV_QPT_UD) {
+        shm_execute_ud(ctx, qp, wqe);
+        return SHM_EXEC_DONE;
+    }
+    struct shm_qp_shared *remote = qp->remote;
+    uint32_t remote_state = __atomic_load_n(&remote->state, __ATOMIC_ACQUIRE);
+    if (remote_state == IBV_QPS_ERR || remote_state == IBV_QPS_RESET) {
+        shm_complete_send(ctx, qp, wqe, IBV_WC_RETRY_EXC_ERR, wc_opcode, 0);
+        return SHM_EXEC_DONE;
+    }
+    if (remote_state < IBV_QPS_RTR) return SHM_EXEC_RNR;
+
+    struct shm_iov local[SHM_MAX_SGE], peer[SHM_MAX_SGE];
+    uint64_t total;
+    uint32_t local_access = wqe->opcode == IBV_WR_RDMA_READ
+                                    ? IBV_ACCESS_LOCAL_WRITE : 0;
+    int nlocal = shm_local_iov(ctx, qp, wqe, local_access, local, &total);
+    if (nlocal < 0) {
+        shm_complete_send(ctx, qp, wqe, IBV_WC_LOC_PROT_ERR, wc_opcode, 0);
+        return SHM_EXEC_DONE;
+    }
+
+    switch (wqe->opcode) {
+        case IBV_WR_RDMA_WRITE: {
+            if (!(remote->access_flags & IBV_ACCESS_REMOTE_WRITE) ||
+                !(peer[0].ptr = shm_translate(qp->peer, wqe->rkey,
+                                              wqe->remote_addr, total,
+                                              IBV_ACCESS_REMOTE_WRITE))) {
+                shm_complete_send(ctx, qp, wqe, IBV_WC_REM_ACCESS_ERR,
+                                  wc_opcode, 0);
+                return SHM_EXEC_DONE;
+            }
+            peer[0].len = total;
+            shm_copy(peer, local, total);
+            shm_complete_send(ctx, qp, wqe, IBV_WC_SUCCESS, wc_opcode,
+                              (uint32_t) total);
+            return SHM_EXEC_DONE;
+        }
+        case IBV_WR_RDMA_READ: {
+            if (!(remote->access_flags & IBV_ACCESS_REMOTE_READ) ||
+                !(peer[0].ptr = shm_translate(qp->peer, wqe->rkey,
+                                              wqe->remote_addr, total,
+                                              IBV_ACCESS_REMOTE_READ))) {
+                shm_complete_send(ctx, qp, wqe, IBV_WC_REM_ACCESS_ERR,
+                                  wc_opcode, 0);
+                return SHM_EXEC_DONE;
+            }
+            peer[0].len = total;
+            shm_copy(local, peer, total);
+            shm_complete_send(ctx, qp, wqe, IBV_WC_SUCCESS, wc_opcode,
+                              (uint32_t) total);
+            return SHM_EXEC_DONE;
+        }
+        case IBV_WR_RDMA_WRITE_WITH_IMM:
+        case IBV_WR_SEND:
+        case IBV_WR_SEND_WITH_IMM:
+            break;
+        default:
+            shm_complete_send(ctx, qp, wqe, IBV_WC_LOC_QP_OP_ERR, wc_opcode,
+                              0);
+            return SHM_EXEC_DONE;
+    }
+
+    // The remaining opcodes consume a receive WQE at the target.
+    int is_write = wqe->opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+    if (is_write) {
+        if (!(remote->access_flags & IBV_ACCESS_REMOTE_WRITE) ||
+            !(peer[0].ptr = shm_translate(qp->peer, wqe->rkey,
+                                          wqe->remote_addr, total,
+                                          IBV_ACCESS_REMOTE_WRITE))) {
+            shm_complete_send(ctx, qp, wqe, IBV_WC_REM_ACCESS_ERR, wc_opcode,
+                              0);
+            return SHM_EXEC_DONE;
+        }
+        peer[0].len = total;
+    }
+    struct shm_rq_shared *rq =
+            (struct shm_rq_shared *) SHM_PTR(qp->peer->seg, remote->rq_offset);
+    struct shm_recv_wqe rwqe;
+    if (shm_ring_pop(&rq->ring, &rwqe, sizeof(rwqe)) != 0) return SHM_EXEC_RNR;
+    shm_rq_check_limit(qp->peer, rq);
+
+    struct shm_cqe cqe;
+    cqe.wr_id = rwqe.wr_id;
+    cqe.status = IBV_WC_SUCCESS;
+    cqe.opcode = is_write ? IBV_WC_RECV_RDMA_WITH_IMM : IBV_WC_RECV;
+    cqe.byte_len = (uint32_t) total;
+    cqe.imm_data = wqe->imm_data;
+    cqe.qp_num = remote->qpn;
+    cqe.src_qp = qp->ibv.qp_num;
+    cqe.wc_flags = wqe->opcode == IBV_WR_SEND ? 0 : IBV_WC_WITH_IMM;
+    cqe.slid = ctx->lid;
+    cqe.qp_index = 0;
+    cqe.sq_retire = 0;
+
+    enum ibv_wc_status send_status = IBV_WC_SUCCESS;
+    if (!is_write) {
+        int npeer = 0;
+        uint64_t capacity = 0;
+        for (uint32_t i = 0; i < rwqe.num_sge; ++i) {
+            struct ibv_sge *sge = &rwqe.sge[i];
+            if (sge->length == 0) continue;
+            peer[npeer].ptr = shm_translate(qp->peer, sge->lkey, sge->addr,
+                                            sge->length,
+                                            IBV_ACCESS_LOCAL_WRITE);
+            if (!peer[npeer].ptr) {
+                cqe.status = IBV_WC_LOC_PROT_ERR;
+                send_status = IBV_WC_REM_OP_ERR;
+                break;
+            }
+            peer[npeer].len = sge->length;
+            capacity += sge->length;
+            ++npeer;
+        }
+        if (cqe.status == IBV_WC_SUCCESS && capacity < total) {
+            cqe.status = IBV_WC_LOC_LEN_ERR;
+            send_status = IBV_WC_REM_INV_REQ_ERR;
+        }
+    }
+    if (cqe.status == IBV_WC_SUCCESS) shm_copy(peer, local, total);
+    shm_cq_push((struct shm_ring *) SHM_PTR(qp->peer->seg,
+                                            remote->recv_cq_offset),
+                &cqe);
+    shm_complete_send(ctx, qp, wqe, send_status, wc_opcode, (uint32_t) total);
+    return SHM_EXEC_DONE;
+}
+
+// Must hold qp->sq_lock.
+static void shm_qp_progress(struct shm_context *ctx, struct shm_qp *qp)
+{
+    while (qp->sq_head != qp->sq_tail) {
+        struct shm_send_wqe *wqe = &qp->sq[qp->sq_head & (qp->sq_depth - 1)];
+        if (shm_execute(ctx, qp, wqe) == SHM_EXEC_RNR) break;
+        ++qp->sq_head;
+    }
+    int pending = qp->sq_head != qp->sq_tail;
+    if (pending != qp->pending) {
+        qp->pending = pending;
+        __atomic_fetch_add(&ctx->npending, pending ? 1 : -1, __ATOMIC_RELAXED);
+    }
+}
+
+static void shm_progress_pending(struct shm_context *ctx)
+{
+    uint32_t nqps = __atomic_load_n(&ctx->nqps, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < nqps; ++i) {
+        struct shm_qp *qp = __atomic_load_n(&ctx->qps[i], __ATOMIC_ACQUIRE);
+        if (!qp || !qp->pending) continue;
+        if (pthread_spin_trylock(&qp->sq_lock) != 0) continue;
+        shm_qp_progress(ctx, qp);
+        pthread_spin_unlock(&qp->sq_lock);
+    }
+}
+
+int ibv_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+                  struct ibv_send_wr **bad_wr)
+{
+    struct shm_qp *qp = SHM_CONTAINER(ibqp, struct shm_qp, ibv);
+    struct shm_context *ctx = to_ctx(ibqp->context);
+    int ret = 0;
+
+    pthread_spin_lock(&qp->sq_lock);
+    if (qp->ibv.state != IBV_QPS_RTS && qp->ibv.state != IBV_QPS_ERR) {
+        *bad_wr = wr;
+        pthread_spin_unlock(&qp->sq_lock);
+        return EINVAL;
+    }
+    for (; wr; wr = wr->next) {
+        if (wr->num_sge < 0 ||
+            (uint32_t) wr->num_sge > qp->cap.max_send_sge) {
+            ret = EINVAL;
+            break;
+        }
+        if (__atomic_load_n(&qp->sq_outstanding, __ATOMIC_ACQUIRE) >=
+            qp->cap.max_send_wr) {
+            ret = ENOMEM;
+            break;
+        }
+        uint32_t slot = qp->sq_tail & (qp->sq_depth - 1);
+        struct shm_send_wqe *wqe = &qp->sq[slot];
+        wqe->wr_id = wr->wr_id;
+        wqe->opcode = wr->opcode;
+        wqe->send_flags = wr->send_flags;
+        wqe->imm_data = wr->imm_data;
+        wqe->num_sge = (uint32_t) wr->num_sge;
+        wqe->remote_addr = wr->wr.rdma.remote_addr;
+        wqe->rkey = wr->wr.rdma.rkey;
+        wqe->inline_len = 0;
+        if (qp->ibv.qp_type == IBV_QPT_UD) {
+            wqe->remote_qpn = wr->wr.ud.remote_qpn;
+            wqe->remote_qkey = wr->wr.ud.remote_qkey;
+            wqe->dlid = SHM_CONTAINER(wr->wr.ud.ah, struct shm_ah, ibv)->dlid;
+        }
+        if (wr->send_flags & IBV_SEND_INLINE) {
+            if (wr->opcode == IBV_WR_RDMA_READ) {
+                ret = EINVAL;
+                break;
+            }
+            // Inline data is copied at post time; the buffer may be reused
+            // as soon as ibv_post_send returns.
+            char *dst = qp->sq_inline +
+                        (size_t) slot * qp->cap.max_inline_data;
+            uint32_t len = 0;
+            int i = 0;
+            for (; i < wr->num_sge; ++i) {
+                struct ibv_sge *sge = &wr->sg_list[i];
+                if (len + sge->length > qp->cap.max_inline_data) break;
+                memcpy(dst + len, (void *) sge->addr, sge->length);
+                len += sge->length;
+            }
+            if (i < wr->num_sge) {
+                ret = EINVAL;
+                break;
+            }
+            wqe->inline_len = len;
+        } else {
+            memcpy(wqe->sge, wr->sg_list,
+                   wr->num_sge * sizeof(struct ibv_sge));
+        }
+        __atomic_fetch_add(&qp->sq_outstanding, 1, __ATOMIC_RELAXED);
+        ++qp->sq_tail;
+    }
+    shm_qp_progress(ctx, qp);
+    pthread_spin_unlock(&qp->sq_lock);
+    if (ret) *bad_wr = wr;
+    return ret;
+}